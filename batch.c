@@ -0,0 +1,124 @@
+#include "cscshell.h"
+
+extern char **environ;
+
+
+/**
+ * Works out how many bytes of arguments a single execv may take, after
+ * the environment and a safety margin are accounted for.
+ *
+ * @return The usable size in bytes.
+ */
+size_t usable_arg_space(void) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) {
+        arg_max = 128 * 1024; // the historical minimum
+    }
+
+    size_t used = ARG_MAX_MARGIN;
+    for (char **env = environ; *env != NULL; env++) {
+        used += strlen(*env) + 1 + sizeof(char *);
+    }
+    return (size_t) arg_max > used ? (size_t) arg_max - used : 0;
+}
+
+/**
+ * Waits for the oldest running chunk and records its status.
+ *
+ * @param pids The running chunks, oldest first.
+ * @param running Pointer to the number of running chunks.
+ * @param status Pointer to the batch status, set on the first failure.
+ */
+void reap_oldest_chunk(pid_t *pids, int *running, int *status) {
+    int child_status;
+    if (waitpid(pids[0], &child_status, 0) < 0) {
+        perror("waitpid");
+        child_status = -1;
+    }
+    stats_child_reaped(pids[0]);
+    if (*status == 0) {
+        *status = child_status;
+    }
+    memmove(pids, pids + 1, sizeof(pid_t) * (--(*running)));
+}
+
+int run_batched(Command *command) {
+    size_t space = usable_arg_space();
+
+    // options are repeated in every chunk, the rest is split between them
+    int num_fixed = 1;
+    size_t fixed_size = 0;
+    while (command->args[num_fixed] && command->args[num_fixed][0] == '-') {
+        num_fixed++;
+    }
+    for (int i = 0; i < num_fixed; i++) {
+        fixed_size += strlen(command->args[i]) + 1 + sizeof(char *);
+    }
+    int num_args = num_fixed;
+    while (command->args[num_args] != NULL) num_args++;
+
+    // every chunk writes to the same open file, so `>` truncates only once
+    int out_fd = STDOUT_FILENO;
+    if (command->redir_out_path != NULL) {
+        out_fd = open_redirect_out(command);
+        if (out_fd < 0) {
+            perror("open");
+            return -1;
+        }
+    }
+
+    char **chunk_args = malloc(sizeof(char *) * (num_args + 1));
+    pid_t *pids = malloc(sizeof(pid_t) * command->batch_jobs);
+    if (chunk_args == NULL || pids == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(chunk_args, command->args, sizeof(char *) * num_fixed);
+
+    int status = 0, running = 0;
+    int next = num_fixed;
+    do {
+        // take as many arguments as fit, but always at least one
+        int count = num_fixed;
+        size_t size = fixed_size;
+        while (next < num_args) {
+            size_t arg_size = strlen(command->args[next]) + 1 + sizeof(char *);
+            if (size + arg_size > space && count > num_fixed) break;
+            if (size + arg_size > space) {
+                ERR_PRINT(ERR_BATCH_TOO_LONG, command->args[next]);
+            }
+            chunk_args[count++] = command->args[next++];
+            size += arg_size;
+        }
+        chunk_args[count] = NULL;
+
+        if (running == (int) command->batch_jobs) {
+            reap_oldest_chunk(pids, &running, &status);
+        }
+
+        Command chunk = *command;
+        chunk.args = chunk_args;
+        chunk.next = NULL;
+        chunk.redir_out_path = NULL;
+        if (out_fd != STDOUT_FILENO) {
+            chunk.stdout_fd = fcntl(out_fd, F_DUPFD_CLOEXEC, 0);
+        }
+
+        pid_t pid = run_command(&chunk);
+        if (pid < 0) {
+            status = -1;
+            break;
+        }
+        pids[running++] = pid;
+    } while (next < num_args);
+
+    while (running > 0) {
+        reap_oldest_chunk(pids, &running, &status);
+    }
+
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
+    free(chunk_args);
+    free(pids);
+    return status;
+}
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/*
+** A malloc-counting shim for the soak test, preloaded into the shell:
+**
+**     MALLOC_COUNT_FILE=FILE LD_PRELOAD=bench/malloc_count.so cscshell ...
+**
+** It keeps the number of heap blocks the process has allocated and not
+** freed, and when the process exits writes that count and its peak RSS
+** in KiB to FILE, on one line. Forks of the shell write nothing, and the
+** commands it runs do not see FILE.
+*/
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static long live_blocks = 0;
+static char *count_file = NULL;
+static pid_t owner;
+
+
+/**
+ * Counts a block as allocated if the allocation gave one.
+ *
+ * @param ptr The block, or NULL.
+ * @return ptr.
+ */
+void *counted(void *ptr) {
+    if (ptr != NULL) {
+        __atomic_add_fetch(&live_blocks, 1, __ATOMIC_RELAXED);
+    }
+    return ptr;
+}
+
+void *malloc(size_t size) {
+    return counted(__libc_malloc(size));
+}
+
+void *calloc(size_t count, size_t size) {
+    return counted(__libc_calloc(count, size));
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return counted(__libc_realloc(NULL, size));
+    }
+    void *moved = __libc_realloc(ptr, size);
+    // a size of 0 frees the block; a failure leaves it where it was
+    if (moved == NULL && size == 0) {
+        __atomic_sub_fetch(&live_blocks, 1, __ATOMIC_RELAXED);
+    }
+    return moved;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return counted(__libc_memalign(alignment, size));
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return counted(__libc_memalign(alignment, size));
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    void *block = counted(__libc_memalign(alignment, size));
+    if (block == NULL) {
+        return ENOMEM;
+    }
+    *ptr = block;
+    return 0;
+}
+
+void free(void *ptr) {
+    if (ptr != NULL) {
+        __atomic_sub_fetch(&live_blocks, 1, __ATOMIC_RELAXED);
+    }
+    __libc_free(ptr);
+}
+
+/**
+ * Takes the output file out of the environment, so only this process
+ * reports.
+ */
+__attribute__((constructor)) void malloc_count_start(void) {
+    const char *path = getenv("MALLOC_COUNT_FILE");
+    if (path == NULL) {
+        return;
+    }
+    count_file = __libc_malloc(strlen(path) + 1);
+    if (count_file == NULL) {
+        return;
+    }
+    strcpy(count_file, path);
+    owner = getpid();
+    unsetenv("MALLOC_COUNT_FILE");
+    unsetenv("LD_PRELOAD");
+}
+
+/**
+ * Writes the blocks still allocated and the peak RSS.
+ */
+__attribute__((destructor)) void malloc_count_report(void) {
+    if (count_file == NULL || getpid() != owner) {
+        return;
+    }
+    // taken before the file is opened, whose blocks are not the shell's
+    long live = __atomic_load_n(&live_blocks, __ATOMIC_RELAXED);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    FILE *out = fopen(count_file, "w");
+    if (out == NULL) {
+        return;
+    }
+    fprintf(out, "%ld %ld\n", live, usage.ru_maxrss);
+    fclose(out);
+}
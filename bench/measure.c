@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+** Runs a command a number of times and prints, on one line, its median
+** wall time and CPU time (user + system, itself and its children) in
+** milliseconds and its peak RSS in KiB:
+**
+**     measure RUNS command [args...]
+**
+** The command's output goes to /dev/null. Exits with 1 if any run fails.
+*/
+
+/**
+ * Orders doubles for qsort.
+ */
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Converts a timeval to milliseconds.
+ */
+double timeval_ms(struct timeval tv) {
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || atoi(argv[1]) <= 0) {
+        fprintf(stderr, "Usage: measure RUNS command [args...]\n");
+        return 2;
+    }
+    int runs = atoi(argv[1]);
+    double *wall = malloc(sizeof(double) * runs);
+    double *cpu = malloc(sizeof(double) * runs);
+    if (wall == NULL || cpu == NULL) {
+        return 2;
+    }
+
+    long max_rss = 0;
+    int failed = 0;
+    for (int i = 0; i < runs; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 2;
+        }
+        if (pid == 0) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd >= 0) {
+                dup2(null_fd, STDOUT_FILENO);
+                close(null_fd);
+            }
+            execvp(argv[2], &argv[2]);
+            perror(argv[2]);
+            _exit(127);
+        }
+
+        // wait4 reports the run's own children too, once it has reaped them
+        int status;
+        struct rusage usage;
+        if (wait4(pid, &status, 0, &usage) < 0) {
+            perror("wait4");
+            return 2;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+
+        wall[i] = (end.tv_sec - start.tv_sec) * 1000.0 +
+                  (end.tv_nsec - start.tv_nsec) / 1e6;
+        cpu[i] = timeval_ms(usage.ru_utime) + timeval_ms(usage.ru_stime);
+        if (usage.ru_maxrss > max_rss) max_rss = usage.ru_maxrss;
+    }
+
+    qsort(wall, runs, sizeof(double), compare_doubles);
+    qsort(cpu, runs, sizeof(double), compare_doubles);
+    printf("%10.2f %10.2f %10ld%s\n", wall[runs / 2], cpu[runs / 2], max_rss,
+           failed ? "  (failed)" : "");
+    free(wall);
+    free(cpu);
+    return failed;
+}
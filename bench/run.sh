@@ -0,0 +1,132 @@
+#!/bin/sh
+# End-to-end benchmark of cscshell against dash and bash.
+#
+#     sh bench/run.sh CSCSHELL MEASURE [RUNS]
+#
+# Every workload is generated into a scratch directory in the syntax the
+# three shells share, then run RUNS times by each shell that is installed.
+# The table gives the median wall and CPU time in milliseconds and the
+# peak RSS in KiB, CPU time and RSS including the commands the shell runs.
+#
+# cscshell needs its init file to set PATH, so each workload's init file is
+# passed to it with -i, while dash and bash run it as the script's first
+# lines; both see the same variables and functions before the workload.
+
+set -e
+
+cscshell=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+measure=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+runs=${3:-5}
+work=$(mktemp -d "${TMPDIR:-/tmp}/cscshell-bench.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+
+# repeat N LINE: prints LINE N times
+repeat() {
+    i=0
+    while [ "$i" -lt "$1" ]; do
+        echo "$2"
+        i=$((i + 1))
+    done
+}
+
+# init NAME: starts the init file of a workload
+init() {
+    echo 'PATH=/usr/bin:/bin' > "$work/$1.init"
+}
+
+# fork: one external command per line, so every line is a fork and exec
+init fork
+repeat 500 '/bin/true' > "$work/fork.sh"
+
+# pipeline: long pipelines of external filters
+init pipeline
+repeat 50 'seq 2000 | sort -r | tr 0-9 a-j | sort | uniq | head -n 100 | wc -l > /dev/null' \
+    > "$work/pipeline.sh"
+
+# expansion: variable-heavy lines run by the echo builtin, with no forks.
+# cscshell variable names are letters and underscores only, so the names
+# spell their numbers in letters: V_a is 0, V_bc is 12
+init expansion
+awk 'BEGIN {
+    for (i = 0; i < 50; i++) {
+        print "V_" letters(i) "=value" i
+    }
+    for (i = 0; i < 2000; i++)
+        print "echo $V_b $V_h ${V_bd}x $V_cb$V_de ${V_ej}/$V_a $V_ec $V_d > /dev/null"
+}
+function letters(i,    s) {
+    s = i ""
+    gsub(/0/, "a", s); gsub(/1/, "b", s); gsub(/2/, "c", s); gsub(/3/, "d", s)
+    gsub(/4/, "e", s); gsub(/5/, "f", s); gsub(/6/, "g", s); gsub(/7/, "h", s)
+    gsub(/8/, "i", s); gsub(/9/, "j", s)
+    return s
+}' > "$work/expansion.sh"
+
+# longexpand: 5 KB lines of literal text around sixteen 8-byte values and
+# two 4 KB ones, the sizes the two-pass expander was measured on
+init longexpand
+awk 'BEGIN {
+    long = sprintf("%4096s", ""); gsub(/ /, "v", long)
+    names = "abcdefghijklmnop"
+    for (i = 1; i <= 16; i++)
+        print "S_" substr(names, i, 1) "=value" sprintf("%03d", i)
+    print "L_a=" long
+    print "L_b=" long
+}' >> "$work/longexpand.init"
+awk 'BEGIN {
+    text = sprintf("%310s", ""); gsub(/ /, "t", text)
+    names = "abcdefghijklmnop"
+    line = "echo $L_a"
+    for (i = 1; i <= 16; i++)
+        line = line " " text "$S_" substr(names, i, 1)
+    line = line " ${L_b}x > /dev/null"
+    for (i = 0; i < 2000; i++)
+        print line
+}' > "$work/longexpand.sh"
+
+# init: a large init file of assignments and functions, then one command
+init init
+awk 'BEGIN {
+    for (i = 0; i < 3000; i++)
+        print "INIT_" letters(i) "=/usr/local/share/item/" i
+    for (i = 0; i < 300; i++)
+        print "fn_" i "() { echo $INIT_" letters(i) " > /dev/null; }"
+}
+function letters(i,    s) {
+    s = i ""
+    gsub(/0/, "a", s); gsub(/1/, "b", s); gsub(/2/, "c", s); gsub(/3/, "d", s)
+    gsub(/4/, "e", s); gsub(/5/, "f", s); gsub(/6/, "g", s); gsub(/7/, "h", s)
+    gsub(/8/, "i", s); gsub(/9/, "j", s)
+    return s
+}' >> "$work/init.init"
+repeat 1 'fn_299' > "$work/init.sh"
+
+# startup: a single short command, for the cost of starting the shell
+init startup
+repeat 1 '/bin/true' > "$work/startup.sh"
+
+# run SHELL WORKLOAD RUNS: prints one row of the table
+run() {
+    name=$1 workload=$2 n=$3
+    case $name in
+        cscshell)
+            cmd="$cscshell -i $work/$workload.init $work/$workload.sh" ;;
+        *)
+            command -v "$name" > /dev/null 2>&1 || return 0
+            cat "$work/$workload.init" "$work/$workload.sh" > "$work/$workload.$name"
+            cmd="$(command -v "$name") $work/$workload.$name" ;;
+    esac
+    printf '%-10s %-10s ' "$workload" "$name"
+    # shellcheck disable=SC2086
+    "$measure" "$n" $cmd || true
+}
+
+printf '%-10s %-10s %10s %10s %10s\n' workload shell wall_ms cpu_ms rss_kb
+for workload in fork pipeline expansion longexpand init startup; do
+    n=$runs
+    # many short invocations need more samples to be stable
+    [ "$workload" = startup ] && n=$((runs * 20))
+    for name in cscshell dash bash; do
+        run "$name" "$workload" "$n"
+    done
+done
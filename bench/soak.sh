@@ -0,0 +1,89 @@
+#!/bin/sh
+# Soak test: pushes generated lines through a script and the interactive
+# loop under the malloc-counting shim, and fails if memory grows with the
+# number of lines.
+#
+#     sh bench/soak.sh CSCSHELL SHIM [LINES] [RSS_SLACK_KB]
+#
+# Each mode runs twice, with LINES / 10 and with LINES lines. The longer
+# run must end with exactly as many blocks still allocated as the shorter
+# one, so no line leaks, and its peak RSS may only be RSS_SLACK_KB above.
+# The lines come through a pipe, so a script is read a line at a time and
+# its file is never mapped into the RSS.
+
+set -e
+
+cscshell=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shim=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+lines=${3:-1000000}
+slack=${4:-1024}
+work=$(mktemp -d "${TMPDIR:-/tmp}/cscshell-soak.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+
+echo 'PATH=/usr/bin:/bin' > "$work/init"
+echo 'LIB_a=sourced' > "$work/lib.sh"
+
+# generate N: prints N lines that go through every kind of line the shell
+# keeps state for, each with its own text so the parse cache keeps turning
+# over, and ends on a builtin so the shell exits by itself
+generate() {
+    awk -v n="$1" -v lib="$work/lib.sh" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            if (i % 1000 == 0) {
+                print "greet() { echo hello $1 > /dev/null; }"
+                print "source " lib
+            } else if (i % 10000 == 1) {
+                print "echo " i " | cat > /dev/null"
+            } else if (i % 10000 == 2) {
+                print "/bin/true " i
+            } else if (i % 4 == 0) {
+                print "V_a=value" i
+            } else if (i % 4 == 1) {
+                print "echo $V_a ${V_a}x " i " > /dev/null"
+            } else if (i % 4 == 2) {
+                print "greet " i
+            } else {
+                print "cd / " i
+            }
+        }
+        print "echo done > /dev/null"
+    }'
+}
+
+# run MODE N: runs N lines in MODE and prints the blocks left allocated
+# and the peak RSS in KiB
+run() {
+    mode=$1 n=$2
+    case $mode in
+        script) set -- "$work/init" /dev/stdin ;;
+        interactive) set -- "$work/init" ;;
+    esac
+    generate "$n" | CSCSHELL_HISTFILE="$work/history" MALLOC_COUNT_FILE="$work/count" \
+        LD_PRELOAD="$shim" "$cscshell" -i "$@" > /dev/null 2> "$work/errors" || true
+    if [ -s "$work/errors" ]; then
+        echo "soak: $mode: the shell reported errors:" >&2
+        head -n 5 "$work/errors" >&2
+        return 1
+    fi
+    rm -f "$work/history"
+    cat "$work/count"
+}
+
+failed=0
+printf '%-12s %10s %10s %10s\n' mode lines blocks rss_kb
+for mode in script interactive; do
+    short=$(run "$mode" $((lines / 10)))
+    long=$(run "$mode" "$lines")
+    printf '%-12s %10s %10s %10s\n' "$mode" $((lines / 10)) $short
+    printf '%-12s %10s %10s %10s\n' "$mode" "$lines" $long
+    set -- $short $long
+    if [ "$3" -ne "$1" ]; then
+        echo "soak: $mode: $(($3 - $1)) more blocks left allocated after $lines lines" >&2
+        failed=1
+    fi
+    if [ "$4" -gt $(($2 + slack)) ]; then
+        echo "soak: $mode: peak RSS grew by $(($4 - $2)) KiB" >&2
+        failed=1
+    fi
+done
+exit $failed
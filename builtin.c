@@ -0,0 +1,297 @@
+#include "cscshell.h"
+#include <ctype.h>
+#include <pthread.h>
+
+
+// Commands run inside the shell process instead of being exec'd
+static const Builtin builtins[] = {
+    {PARALLEL_BUILTIN, builtin_parallel, NULL},
+    {STATS_BUILTIN, builtin_stats, NULL},
+    {ULIMIT_BUILTIN, builtin_ulimit, NULL},
+    {SET_BUILTIN, builtin_set, NULL},
+    {FG_BUILTIN, builtin_fg, NULL},
+    {BG_BUILTIN, builtin_bg, NULL},
+    {JOBS_BUILTIN, builtin_jobs, NULL},
+    {HISTORY_BUILTIN, builtin_history, NULL},
+    {SOURCE_BUILTIN, builtin_source, NULL},
+    {DOT_BUILTIN, builtin_source, NULL},
+    {ECHO_BUILTIN, NULL, builtin_echo},
+    {READ_BUILTIN, NULL, builtin_read},
+    {NULL, NULL, NULL}
+};
+
+// read may run on several pipeline stages at once
+static pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+const Builtin *find_builtin(const char *name) {
+    for (const Builtin *current = builtins; current->name != NULL; current++) {
+        if (strcmp(current->name, name) == 0) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+const Builtin *shell_builtin(const Command *command) {
+    const Builtin *builtin = find_builtin(command->args[0]);
+    if (builtin == NULL || command->exec_replace) {
+        return NULL;
+    }
+    if (builtin->stage != NULL && (command->batch_jobs || command->cached ||
+                                   command->limits != NULL || command->timeout_ms)) {
+        return NULL;
+    }
+    return builtin;
+}
+
+int *run_builtin(const Builtin *builtin, Command *command, Variable **root) {
+    int *status = malloc(sizeof(int));
+    if (status == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    int out_fd = STDOUT_FILENO;
+    if (command->redir_out_path != NULL) {
+        out_fd = open_redirect_out(command);
+        if (out_fd < 0) {
+            perror("open");
+            *status = -1;
+            return status;
+        }
+    }
+
+    // anything buffered so far must not end up after the builtin's output
+    fflush(stdout);
+    if (builtin->stage != NULL) {
+        StageIO io = {STDIN_FILENO, out_fd, NULL, NULL,
+                      shell_options.interactive ? stdin : NULL};
+        if (command->redir_in_path != NULL) {
+            io.in_fd = open(command->redir_in_path, O_RDONLY | O_CLOEXEC);
+        }
+        if (io.in_fd < 0) {
+            perror("open");
+            *status = W_EXITCODE(1, 0);
+        } else {
+            *status = builtin->stage(command, root, &io);
+        }
+        if (io.in_fd > STDIN_FILENO) close(io.in_fd);
+    } else {
+        *status = builtin->fn(command, root, out_fd);
+    }
+
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
+    return status;
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int builtin_set(Command *command, Variable **root, int out_fd) {
+    char **args = command->args;
+    if (args[1] == NULL || (strcmp(args[1], SET_OPTION_ON) == 0 && args[2] == NULL)) {
+        dprintf(out_fd, "%-10s %s\n%-10s %s\n",
+                PIPEFAIL_OPTION, shell_options.pipefail ? "on" : "off",
+                TEARDOWN_OPTION, shell_options.pipe_teardown ? "on" : "off");
+        return 0;
+    }
+
+    bool on = strcmp(args[1], SET_OPTION_ON) == 0;
+    if ((!on && strcmp(args[1], SET_OPTION_OFF) != 0) || args[2] == NULL || args[3] != NULL) {
+        ERR_PRINT(ERR_SET_USAGE);
+        return W_EXITCODE(2, 0);
+    }
+
+    if (strcmp(args[2], PIPEFAIL_OPTION) == 0) {
+        shell_options.pipefail = on;
+        // teardown needs to know which stage failed first
+        if (!on) shell_options.pipe_teardown = 0;
+    } else if (strcmp(args[2], TEARDOWN_OPTION) == 0) {
+        shell_options.pipe_teardown = on;
+        if (on) shell_options.pipefail = 1;
+    } else {
+        ERR_PRINT(ERR_SET_USAGE);
+        return W_EXITCODE(2, 0);
+    }
+    return 0;
+}
+
+/**
+ * Interprets the backslash escape at the start of src, as echo -e does.
+ *
+ * @param src The character after the backslash.
+ * @param out Set to the character it stands for.
+ * @param stop Set if the escape is \c, which ends all output.
+ * @return The number of characters of src the escape used.
+ */
+int echo_escape(const char *src, char *out, bool *stop) {
+    static const char escapes[] = "\\\\a\ab\be\033f\fn\nr\rt\tv\v";
+    for (const char *e = escapes; *e; e += 2) {
+        if (*src == e[0]) {
+            *out = e[1];
+            return 1;
+        }
+    }
+    if (*src == 'c') {
+        *stop = true;
+        return 1;
+    }
+    if (*src == '0' || *src == 'x') {
+        // up to three octal digits after \0, or two hex ones after \x
+        int base = *src == '0' ? 8 : 16, max = base == 8 ? 3 : 2, used = 1;
+        int value = 0;
+        while (used <= max && src[used] &&
+               (base == 16 ? isxdigit((unsigned char)src[used])
+                           : (src[used] >= '0' && src[used] <= '7'))) {
+            value = value * base + (isdigit((unsigned char)src[used])
+                                    ? src[used] - '0'
+                                    : tolower((unsigned char)src[used]) - 'a' + 10);
+            used++;
+        }
+        if (base == 16 && used == 1) {
+            *out = '\\';
+            return 0;
+        }
+        *out = (char) value;
+        return used;
+    }
+    // anything else is kept as it is, backslash included
+    *out = '\\';
+    return 0;
+}
+
+int builtin_echo(Command *command, Variable **root, StageIO *io) {
+    bool newline = true, escapes = false;
+    int idx = 1;
+    for (; command->args[idx] != NULL && command->args[idx][0] == '-' &&
+           command->args[idx][1] != '\0' &&
+           strspn(command->args[idx] + 1, "neE") == strlen(command->args[idx] + 1); idx++) {
+        for (const char *flag = command->args[idx] + 1; *flag; flag++) {
+            if (*flag == 'n') newline = false;
+            else escapes = *flag == 'e';
+        }
+    }
+
+    // the whole line goes out in one write, escapes only ever shrink it
+    size_t len = 1;
+    for (int i = idx; command->args[i] != NULL; i++) {
+        len += strlen(command->args[i]) + 1;
+    }
+    char *out = malloc(len);
+    if (out == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    size_t used = 0;
+    bool stop = false;
+    for (int i = idx; command->args[i] != NULL && !stop; i++) {
+        if (i > idx) out[used++] = ' ';
+        for (const char *src = command->args[i]; *src && !stop; src++) {
+            if (escapes && *src == '\\' && src[1] != '\0') {
+                char c;
+                int taken = echo_escape(src + 1, &c, &stop);
+                if (stop) break;
+                out[used++] = c;
+                src += taken;
+            } else {
+                out[used++] = *src;
+            }
+        }
+    }
+    if (newline && !stop) {
+        out[used++] = '\n';
+    }
+
+    int ret = stage_write(io, out, used) < 0 ? W_EXITCODE(1, 0) : 0;
+    free(out);
+    return ret;
+}
+
+/**
+ * Checks a name read assigns, by the rules assignments follow.
+ */
+bool valid_read_name(const char *name) {
+    for (const char *ptr = name; *ptr; ptr++) {
+        if (!isalpha((unsigned char)*ptr) && *ptr != '_') {
+            return false;
+        }
+    }
+    return *name != '\0';
+}
+
+int builtin_read(Command *command, Variable **root, StageIO *io) {
+    for (int i = 1; command->args[i] != NULL; i++) {
+        if (!valid_read_name(command->args[i])) {
+            ERR_PRINT(ERR_READ_NAME, command->args[i]);
+            return W_EXITCODE(2, 0);
+        }
+    }
+
+    // a byte at a time, so nothing after the line is taken from a file
+    // the next command reads
+    size_t len = 0, cap = MAX_USER_BUF;
+    char *line = malloc(cap);
+    if (line == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    ssize_t got;
+    char c;
+    while ((got = stage_read(io, &c, 1)) == 1 && c != '\n') {
+        if (len + 1 == cap) {
+            cap *= 2;
+            line = realloc(line, cap);
+            if (line == NULL) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        line[len++] = c;
+    }
+    line[len] = '\0';
+    if (got <= 0 && len == 0) {
+        free(line);
+        return W_EXITCODE(1, 0);
+    }
+
+    pthread_mutex_lock(&read_lock);
+    char *rest = line + strspn(line, WORD_DELIMS);
+    int ret = 0;
+    for (int i = 1; command->args[i] != NULL && ret == 0; i++) {
+        char *value = rest;
+        if (command->args[i + 1] != NULL) {
+            size_t word_len = strcspn(rest, WORD_DELIMS);
+            rest += word_len;
+            if (*rest) *rest++ = '\0';
+            rest += strspn(rest, WORD_DELIMS);
+        } else {
+            // the last name takes the rest, without trailing blanks
+            size_t value_len = strlen(value);
+            while (value_len > 0 && strchr(WORD_DELIMS, value[value_len - 1])) {
+                value[--value_len] = '\0';
+            }
+        }
+        ret = set_variable(root, command->args[i], value);
+    }
+    if (command->args[1] == NULL) {
+        ret = set_variable(root, READ_DEFAULT_VAR, line);
+    }
+    pthread_mutex_unlock(&read_lock);
+
+    free(line);
+    if (ret < 0) {
+        exit(EXIT_FAILURE);
+    }
+    // as in other shells, a last line without a newline is still read
+    return got == 1 ? 0 : W_EXITCODE(1, 0);
+}
@@ -1,5 +1,6 @@
 #include "cscshell.h"
 
+ShellOptions shell_options;
 
 void print_help(){
     printf("CSC209 Shell\n");
@@ -7,7 +8,15 @@ void print_help(){
     printf("Options:\n");
     printf("  -h, --help\t\t\tDisplay this help message\n");
     printf("  -i, --init-file=FILE\t\tUse a specific init file. Default is ~/.cscshell_init\n");
-    printf("If no script file is given, cscshell will run in interactive mode\n");
+    printf("  --stats-json=FILE\t\tWrite runtime statistics as JSON to FILE on exit\n");
+    printf("  --incremental\t\t\tSkip script lines whose output files are up to date\n");
+    printf("  --pipelined\t\t\tTokenize upcoming script lines while the current one runs\n");
+    printf("  --line-timeout=SECONDS\t\tStop any line that runs longer than SECONDS\n");
+    printf("  -c LINE\t\t\tRun LINE instead of a script\n");
+    printf("  --server=SOCKET\t\tLoad the init file once and run scripts sent to SOCKET\n");
+    printf("  --client=SOCKET\t\tRun the script or LINE on the server at SOCKET\n");
+    printf("If no script file is given, cscshell will run in interactive mode,\n");
+    printf("or as a client, send its standard input as the script\n");
 }
 
 
@@ -18,10 +27,16 @@ char *prompt(char *line, size_t line_length){
         return (char *) -1;
     }
 
+    // without a login session, e.g. under script(1) or in a container,
+    // fall back to the user the shell runs as
     char user_buff[MAX_USER_BUF];
     if (getlogin_r(user_buff, MAX_USER_BUF)){
-        perror("prompt:");
-        return (char *) -1;
+        struct passwd *pw = getpwuid(geteuid());
+        if (pw == NULL){
+            perror("prompt:");
+            return (char *) -1;
+        }
+        snprintf(user_buff, MAX_USER_BUF, "%s", pw->pw_name);
     }
 
     printf("%s@<%s> %s", user_buff, cwd_buff, PROMPT_STR);
@@ -37,9 +52,15 @@ int run_interactive(Variable **root){
     printf("Interactive CSCSHELL starting...\n");
     #endif
 
-    while ((error = (long) prompt(line, MAX_SINGLE_LINE)) > 0) {
-        // kill the newline
-        line[strlen(line) - 1] = '\0';
+    // ^C and ^Z go to the running pipeline, not the shell
+    init_job_control();
+    shell_options.interactive = 1;
+    open_history();
+
+    while (reap_jobs(), (error = (long) prompt(line, MAX_SINGLE_LINE)) > 0) {
+        // kill the newline, which a last line at EOF does not have
+        line[strcspn(line, "\n")] = '\0';
+        add_history(line);
 
         Command *commands = parse_line(line, root);
         if (commands == (Command *) -1){
@@ -48,14 +69,16 @@ int run_interactive(Variable **root){
         }
         if (commands == NULL) continue;
 
-        int *last_ret_code_pt = execute_line(commands);
+        int *last_ret_code_pt = execute_shell_line(commands, root);
+        free_command(commands);
         if (last_ret_code_pt == (int *) -1){
             ERR_PRINT(ERR_EXECUTE_LINE);
-            free(last_ret_code_pt);
+            close_history();
             return -1;
         }
         free(last_ret_code_pt);
     }
+    close_history();
     printf("\n");
 
     #ifdef DEBUG
@@ -71,6 +94,11 @@ int main(int argc, char *argv[]){
 
     int num_args_parsed = 0;
     char *init_file = DEFAULT_INIT;
+    char *stats_file = NULL;
+    char *line = NULL;
+    char *server_socket = NULL;
+    char *client_socket = NULL;
+    ShellOptions requested = {0};
 
     for (int i=1; i < argc; i++){
         if (strcmp(argv[i], "-h") == 0 ||
@@ -91,11 +119,70 @@ int main(int argc, char *argv[]){
             }
         }
 
-        else if (strncmp(argv[1], LONG_INIT_ARG,
+        else if (strcmp(argv[i], "-c") == 0){
+            if (i + 1 < argc){
+                line = argv[i + 1];
+                i++;
+                num_args_parsed += 2;
+            }
+            else{
+                fprintf(stderr, ERR_LINE_MISSING);
+                return -1;
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_SERVER_ARG,
+                         strlen(LONG_SERVER_ARG)) == 0){
+            num_args_parsed++;
+            server_socket = strchr(argv[i], '=') + 1;
+        }
+
+        else if (strncmp(argv[i], LONG_CLIENT_ARG,
+                         strlen(LONG_CLIENT_ARG)) == 0){
+            num_args_parsed++;
+            client_socket = strchr(argv[i], '=') + 1;
+        }
+
+        else if (strncmp(argv[i], LONG_INIT_ARG,
                          strlen(LONG_INIT_ARG)) == 0){
             num_args_parsed++;
-            init_file = strchr(argv[1], '=') + 1;
+            init_file = strchr(argv[i], '=') + 1;
         }
+
+        else if (strcmp(argv[i], LONG_INCREMENTAL_ARG) == 0){
+            num_args_parsed++;
+            requested.incremental = 1;
+        }
+
+        else if (strcmp(argv[i], LONG_PIPELINED_ARG) == 0){
+            num_args_parsed++;
+            requested.pipelined = 1;
+        }
+
+        else if (strncmp(argv[i], LONG_LINE_TIMEOUT_ARG,
+                         strlen(LONG_LINE_TIMEOUT_ARG)) == 0){
+            num_args_parsed++;
+            if (!parse_duration(argv[i] + strlen(LONG_LINE_TIMEOUT_ARG),
+                                &requested.line_timeout_ms)) {
+                ERR_PRINT(ERR_TIMEOUT_USAGE);
+                return -1;
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_STATS_ARG,
+                         strlen(LONG_STATS_ARG)) == 0){
+            num_args_parsed++;
+            stats_file = strchr(argv[i], '=') + 1;
+        }
+    }
+
+    // a client leaves the init file and everything else to the server
+    if (client_socket != NULL){
+        if (line != NULL){
+            return run_client(client_socket, SERVER_RUN_LINE, line);
+        }
+        return run_client(client_socket, SERVER_RUN_SCRIPT,
+                          num_args_parsed < argc-1 ? argv[argc-1] : SERVER_STDIN_SCRIPT);
     }
 
     #ifdef DEBUG
@@ -113,14 +200,32 @@ int main(int argc, char *argv[]){
         ERR_PRINT(ERR_PATH_INIT, init_file);
     }
 
+    // the init file always runs plainly
+    shell_options.incremental = requested.incremental;
+    shell_options.pipelined = requested.pipelined;
+    shell_options.line_timeout_ms = requested.line_timeout_ms;
+
     int ret_code;
-    if (num_args_parsed < argc-1){
+    if (server_socket != NULL){
+        ret_code = run_server(server_socket, &start_of_vars);
+    }
+    else if (line != NULL){
+        shell_options.exec_last_command = stats_file == NULL;
+        ret_code = run_line(line, &start_of_vars);
+    }
+    else if (num_args_parsed < argc-1){
+        // exec'ing the last command would lose the statistics
+        shell_options.exec_last_command = stats_file == NULL;
         ret_code = run_script(argv[argc-1], &start_of_vars);
     }
     else{
         ret_code = run_interactive(&start_of_vars);
     }
 
+    if (stats_file != NULL){
+        stats_dump_json(stats_file);
+    }
+
     free_variable(start_of_vars, NON_ZERO_BYTE);
     return ret_code;
 }
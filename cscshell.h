@@ -1,24 +1,39 @@
 #ifndef CSCSHELL_H
 #define CSCSHELL_H
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <poll.h>
 #include <fcntl.h>
 
 #include <dirent.h>
 #include <pwd.h>
 #include <errno.h>
+#include <termios.h>
+#include <signal.h>
 
 // Arg help
 #define LONG_HELP_ARG "--help"
 #define LONG_INIT_ARG "--init-file="
+#define LONG_STATS_ARG "--stats-json="
+#define LONG_INCREMENTAL_ARG "--incremental"
+#define LONG_PIPELINED_ARG "--pipelined"
+#define LONG_LINE_TIMEOUT_ARG "--line-timeout="
+#define LONG_SERVER_ARG "--server="
+#define LONG_CLIENT_ARG "--client="
 #define DEFAULT_INIT "~/.cscshell_init"
 
 // Buffer sizes
@@ -33,9 +48,100 @@
 #define PATH_VAR_NAME "PATH"
 #define CD "cd"
 #define VARIABLE_PARSE_MARKER '$'
+#define VAR_APPEND_MARKER '+'
 #define PARSING_START_MARKER '<'
 #define PARSING_END_MARKER '>'
 #define NON_ZERO_BYTE 0x42
+#define WORD_DELIMS " \t"
+#define PIPE_MARKER '|'
+#define COMMENT_MARKER '#'
+#define FUNC_PARENS "()"
+#define FUNC_BODY_START '{'
+#define FUNC_BODY_END '}'
+#define FUNC_LINE_SEPARATOR ';'
+#define MAX_FUNC_DEPTH 256
+#define LOOKAHEAD_QUEUE_DEPTH 64
+#define INCREMENTAL_STATE_SUFFIX ".cscstate"
+#define INCREMENTAL_RAN "ran"
+#define INCREMENTAL_SKIPPED "skipped"
+#define EXEC_PREFIX "exec"
+#define BATCH_PREFIX "batch"
+#define MEMO_PREFIX "cached"
+#define MEMO_DIR_ENV "CSCSHELL_CACHE_DIR"
+#define MEMO_SUBDIR "cscshell"
+#define MEMO_NO_INPUT "/dev/null"
+#define MEMO_HASH_HEX 16
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define PATH_INDEX_PREFIX "pathidx-"
+#define PATH_INDEX_MAGIC "CSCPIDX1"
+#define MEMO_COPY_BUF (64 * 1024)
+#define BATCH_JOBS_FLAG "-P"
+#define ARG_MAX_MARGIN 2048
+#define SET_BUILTIN "set"
+#define SET_OPTION_ON "-o"
+#define SET_OPTION_OFF "+o"
+#define PIPEFAIL_OPTION "pipefail"
+#define TEARDOWN_OPTION "teardown"
+#define PIPESTATUS_VAR "PIPESTATUS"
+#define TIMEOUT_PREFIX "timeout"
+#define TIMEOUT_KILL_FLAG "-k"
+#define TIMEOUT_KILL_AFTER_MS 2000
+#define TIMEOUT_POLL_MS 10
+#define TIMEOUT_EXIT_STATUS 124
+#define PGID_NEW -1
+#define FG_BUILTIN "fg"
+#define BG_BUILTIN "bg"
+#define JOBS_BUILTIN "jobs"
+#define JOB_STOPPED "Stopped"
+#define JOB_RUNNING "Running"
+#define JOB_DONE "Done"
+#define ECHO_BUILTIN "echo"
+#define READ_BUILTIN "read"
+#define READ_DEFAULT_VAR "REPLY"
+#define SOURCE_BUILTIN "source"
+#define DOT_BUILTIN "."
+#define SOURCE_CACHE_SIZE 32
+#define FD_CACHE_SIZE 16
+#define MAPPED_SCRIPTS_MAX 4
+#define PARSE_CACHE_SIZE 256
+#define PARSE_CACHE_BUCKETS 512
+#define PARSE_DEPS_MAX 16
+#define PARSE_DEPS_NAMES 256
+#define HISTORY_BUILTIN "history"
+#define HISTORY_SEARCH_FLAG "-s"
+#define HISTORY_DEFAULT_COUNT 16
+#define HISTORY_FILE_ENV "CSCSHELL_HISTFILE"
+#define HISTORY_FILE_NAME ".cscshell_history"
+#define HISTORY_INDEX_PREFIX "histidx-"
+#define HISTORY_INDEX_MAGIC "CSCHIDX1"
+#define HISTORY_BATCH_LINES 8
+#define HISTORY_BATCH_BYTES MAX_SINGLE_LINE
+#define HISTORY_REINDEX_BYTES (256 * 1024)
+#define STAGE_RING_SIZE (64 * 1024)
+#define SERVER_RUN_SCRIPT 's'
+#define SERVER_RUN_LINE 'l'
+#define SERVER_NUM_FDS 3
+#define SERVER_STDIN_SCRIPT "/dev/stdin"
+#define LIMIT_PREFIX "limit"
+#define LIMIT_CPUS_FLAG 'c'
+#define LIMIT_NICE_FLAG 'n'
+#define LIMIT_IO_FLAG 'i'
+#define LIMIT_RLIMIT_FLAG 'r'
+#define LIMIT_UNLIMITED "unlimited"
+#define MAX_RLIMITS 16
+#define ULIMIT_BUILTIN "ulimit"
+#define ULIMIT_DEFAULT_FLAG 'f'
+#define STATS_BUILTIN "stats"
+#define STATS_JSON_FLAG "--json"
+#define PARALLEL_BUILTIN "parallel"
+#define PARALLEL_JOBS_FLAG "-j"
+#define PARALLEL_ARGS_MARKER ":::"
+#define PARALLEL_READ_BUF 4096
+#define PARALLEL_MAX_EXIT 101
+#define GLOB_CHARS "*?["
+#define REPLACE_LOCAL_USAGES 16
+#define GLOB_DIRENT_BUF (64 * 1024)
 
 // Error Strings
 #define ERR_ARGS_MISSING "Missing init file path after argument: '-i'\n"
@@ -43,6 +149,7 @@
 of the variable list."
 #define ERR_PARSING_LINE "Could not parse line into commands.\n"
 #define ERR_EXECUTE_LINE "Could not execute line.\n"
+#define ERR_SCRIPT_CUT "Script file shrank while it was read: %s\n"
 #define ERR_INIT_SCRIPT "Failed to run init script: %s\n"
 #define ERR_VAR_START "Assignment cannot start with '=' character.\n"
 #define ERR_VAR_NAME "Variable names must only contain alphabetic characters and\
@@ -52,6 +159,44 @@ of the variable list."
 #define ERR_NO_EXECU "Could not resolve executable [%s]\n"
 #define ERR_VAR_USAGE "Variable could not be parsed from %s\n"
 #define ERR_VAR_NOT_FOUND "Could not find variable: <%s>\n"
+#define ERR_EMPTY_STAGE "Missing command in pipeline.\n"
+#define ERR_REDIR_TARGET "Missing file after redirection: '%s'\n"
+#define ERR_PREFIX_USAGE "Missing command or bad option after prefix: %s\n"
+#define ERR_PREFIX_PIPELINE "%s can only run a single command, not a pipeline.\n"
+#define ERR_BATCH_TOO_LONG "batch: an argument alone exceeds the size limit: %.32s...\n"
+#define ERR_BUILTIN_PIPELINE "%s is a shell builtin and cannot be part of a pipeline.\n"
+#define ERR_FUNCTION_PIPELINE "%s is a shell function and cannot be part of a pipeline.\n"
+#define ERR_READ_NAME "read: not a valid variable name: %s\n"
+#define ERR_LIMIT_USAGE "Usage: limit [-c CPUS] [-n NICE] [-i CLASS[:LEVEL]] \
+[-r NAME=SOFT[:HARD]]... command [args...]\n"
+#define ERR_PREFIX_INTERNAL "%s only applies to external commands, not %s\n"
+#define ERR_TIMEOUT_USAGE "Usage: timeout [-k DURATION] DURATION command [args...]\n"
+#define ERR_TIMEOUT_STAGE "timeout must start the line; it covers the whole pipeline.\n"
+#define ERR_TIMEOUT_PREFIX "timeout cannot be combined with %s.\n"
+#define ERR_TIMED_OUT "%s timed out\n"
+#define ERR_SET_USAGE "Usage: set [-o|+o] [pipefail|teardown]\n"
+#define ERR_PIPE_TEARDOWN "%s failed; stopped the rest of the pipeline\n"
+#define ERR_NO_JOB "%s: no such job\n"
+#define ERR_NO_JOB_CONTROL "%s: no job control in this shell\n"
+#define ERR_SOURCE_USAGE "Usage: %s FILE\n"
+#define ERR_SOURCE_DEPTH "source: nesting too deep in: %s\n"
+#define ERR_HISTORY_USAGE "Usage: history [-s TEXT] [COUNT]\n"
+#define ERR_NO_HISTORY "history: no history file; set HOME or " HISTORY_FILE_ENV "\n"
+#define ERR_LINE_MISSING "Missing line after argument: '-c'\n"
+#define ERR_SERVER_PATH "Socket path too long: %s\n"
+#define ERR_SERVER_IN_USE "A shell server is already listening on %s\n"
+#define ERR_SERVER_REQUEST "Malformed request from a shell client.\n"
+#define ERR_SERVER_CONNECT "Could not reach the shell server at %s: %s\n"
+#define ERR_SERVER_LOST "The shell server at %s went away before the request finished.\n"
+#define ERR_SERVER_TOO_LONG "Script path or line too long to send to the shell server.\n"
+#define ERR_ULIMIT_USAGE "Usage: ulimit [-S] [-H] [-a | -c|-d|-f|-l|-n|-s|-t|-u|-v [VALUE]]\n"
+#define ERR_PARALLEL_USAGE "Usage: parallel [-j N] command [args...] ::: inputs...\n"
+#define ERR_PARALLEL_FAILED "parallel: %d of %d jobs failed\n"
+#define ERR_PARALLEL_JOB "parallel: [%s] exited with status %d\n"
+#define ERR_FUNC_DEF "Malformed function definition: %s\n"
+#define ERR_FUNC_NAME "Function names must only contain alphanumeric characters\
+ and '_' chars.\n Got: %s\n"
+#define ERR_FUNC_DEPTH "Function call depth exceeded in: %s\n"
 
 #define ERR_PRINT(...) fprintf(stderr, "ERROR: ");\
     fprintf(stderr, __VA_ARGS__);
@@ -70,6 +215,9 @@ of the variable list."
 typedef struct Variable{
     char *name;
     char *value;
+    size_t value_len;   // bytes in value, without the terminator
+    size_t value_cap;   // bytes allocated for value
+    uint64_t version;   // new, and unique to this variable, on every store
     struct Variable *next;
 } Variable;
 
@@ -81,9 +229,78 @@ typedef struct Command {
     uint32_t stdout_fd;
     char *redir_in_path;
     char *redir_out_path;
+    int redir_out_fd;   // opened by the shell for the child, 0 if none
     uint8_t redir_append;
+    uint32_t batch_jobs;
+    uint8_t exec_replace;
+    uint8_t cached;
+    struct ProcLimits *limits;
+    uint64_t timeout_ms;
+    uint64_t kill_after_ms;
+    pid_t pgid;
+    int status;
 } Command;
 
+/*
+** Scheduling and resource limits a `limit` prefix attaches to a command.
+** They are applied in the child between fork and exec, so the shell
+** itself is never affected.
+**
+** nice is an increment, as for nice(1); ioprio is an ioprio_set value.
+*/
+typedef struct ProcLimits {
+    cpu_set_t cpus;
+    int nice;
+    int ioprio;
+    int num_rlimits;
+    int rlimit_resources[MAX_RLIMITS];
+    struct rlimit rlimits[MAX_RLIMITS];
+    uint8_t has_cpus;
+    uint8_t has_nice;
+    uint8_t has_ioprio;
+} ProcLimits;
+
+/*
+** A line that has been split into pipeline stages and words, but whose
+** variable usages have not been replaced yet. Shell function bodies are
+** stored in this form so a call only needs replacement and PATH
+** resolution instead of another pass over the text.
+**
+** Lines that cannot be tokenized ahead of time (assignments) keep
+** stages as NULL and are run through parse_line from their text.
+*/
+typedef struct ParsedLine {
+    char *text;
+    char ***stages;
+    struct ParsedLine *next;
+} ParsedLine;
+
+/*
+** A sorted snapshot of one directory's entries, used by glob expansion.
+** Listings are cached for the duration of a single line so several
+** patterns over the same directory read it only once.
+**
+** Each name is preceded in buf by its d_type byte.
+*/
+typedef struct DirListing {
+    char *path;
+    char *buf;
+    size_t buf_len;
+    char **names;
+    size_t count;
+    struct DirListing *next;
+} DirListing;
+
+/*
+** Shell functions defined with `name() { ... }`, kept in a list next
+** to the variable store and invoked inside the shell process.
+*/
+typedef struct Function {
+    char *name;
+    ParsedLine *body;
+    struct Function *next;
+} Function;
+
 
 /*
 ** The following functions are provided for you in _shell.c
@@ -113,6 +330,13 @@ typedef struct Command {
 */
 Command *parse_line(char *line, Variable **variables);
 
+/*
+** Parses a line that is not NUL-terminated, such as one a ScriptReader
+** hands out, returning the same values as parse_line. Lines that run
+** commands are tokenized from the span without copying it first.
+*/
+Command *parse_line_span(const char *line, size_t len, Variable **variables);
+
 /*
 ** WARNING: this is a challenging string parsing task.
 **
@@ -164,6 +388,13 @@ char *resolve_executable(const char *command_name, Variable *path);
 */
 int *execute_line(Command *head);
 
+/*
+** Does what execute_line does, with the builtin stages running on
+** threads of the shell with the variables in root. execute_line gives
+** them a list of their own that is dropped with the line.
+*/
+int *execute_pipeline(Command *head, Variable **root);
+
 /*
 ** Forks a new process and execs the command
 ** making sure all file descriptors are set up correctly.
@@ -181,12 +412,45 @@ int run_command(Command *command);
 */
 int run_script(char *file_path, Variable **root);
 
+/*
+** Runs a single line as if it were a script of its own, for `-c LINE`.
+**
+** Returns 0 on success, -1 on error
+*/
+int run_line(char *line, Variable **root);
+
+/*
+** Serves scripts and lines to clients on a Unix socket, one forked
+** worker per request. Workers start from the shell as it is after the
+** init file, with the client's stdin, stdout and stderr, passed along
+** with the request, and its working directory. Each client gets back
+** the exit code the shell would have exited with.
+**
+** Only returns, with -1, if the socket cannot be served.
+*/
+int run_server(const char *socket_path, Variable **root);
+
+/*
+** Sends a script path (SERVER_RUN_SCRIPT) or a line (SERVER_RUN_LINE) to
+** a server together with this process's stdio, and waits for it to run.
+**
+** Returns the exit code of the request, or -1 if the server could not
+** run it.
+*/
+int run_client(const char *socket_path, char kind, const char *text);
+
 /*
 ** Implement the following function that frees all the
 ** heap memory associated with a particular command.
  */
 void free_command(Command *command);
 
+/*
+** Copies a list of prepared commands, so the copy can be run and freed
+** on its own. Defined in parsecache.c.
+*/
+Command *copy_commands(const Command *head);
+
 /*
 ** Implement the following function that frees variable(s).
 **
@@ -194,4 +458,693 @@ void free_command(Command *command);
 ** list starting at var, else just var.
  */
 void free_variable(Variable *var, uint8_t recursive);
+
+
+/*
+** Shell internals shared between the modules.
+*/
+
+/*
+** Options chosen on the command line, shared by the whole shell.
+**
+** exec_last_command: the next run_script execs its last command in
+**                    place of the shell instead of forking for it. A
+**                    failed exec is reported as any line that could
+**                    not run, but once the command runs the shell's
+**                    exit status is its own, without the error and the
+**                    255 a failing line gets otherwise.
+** incremental:       run_script skips lines whose outputs are newer
+**                    than their inputs and executables, like make.
+** pipelined:         run_script reads and tokenizes upcoming lines on a
+**                    second thread while the current one runs.
+** line_timeout_ms:   a timeout for every line without its own, 0 for none.
+** pipefail:          a pipeline's status is that of its first failing
+**                    stage instead of its last one.
+** pipe_teardown:     a failing stage stops the rest of its pipeline.
+** job_control:       the shell owns a terminal; every pipeline gets its
+**                    own process group and the terminal while it runs.
+*/
+typedef struct ShellOptions {
+    uint8_t exec_last_command;
+    uint8_t incremental;
+    uint8_t pipelined;
+    uint64_t line_timeout_ms;
+    uint8_t pipefail;
+    uint8_t pipe_teardown;
+    uint8_t job_control;
+    uint8_t interactive;
+} ShellOptions;
+
+extern ShellOptions shell_options;
+
+/*
+** Sets up a command's file descriptors in the calling process and execs
+** it. Returns -1 if the exec failed.
+*/
+int exec_command(Command *command);
+
+/*
+** Opens the file a command's output is redirected to, returning a new
+** close-on-exec descriptor or -1 with errno set. Files appended to are
+** kept open in a cache of FD_CACHE_SIZE, by the path as written, and
+** handed out as duplicates while the path still names the same file;
+** fd_cache_chdir forgets the relative paths after a cd.
+*/
+int open_redirect_out(Command *command);
+void fd_cache_chdir(void);
+
+/*
+** Looks up variables by name. find_variable_span takes a name that is
+** not NUL-terminated, and find_path_variable returns PATH.
+*/
+Variable *find_variable(Variable *variables, const char *name);
+Variable *find_variable_span(Variable *variables, const char *name, size_t name_len);
+Variable *find_path_variable(Variable *variables);
+
+/*
+** Sets (or creates at the head of the list) the variable name to a copy
+** of value; append_variable adds the copy to the end of its value
+** instead, in amortized constant time per byte. remove_variable unlinks
+** name from the list and returns it, or NULL if it does not exist.
+**
+** Returns 0 on success, -1 if the allocation failed.
+*/
+int set_variable(Variable **variables, const char *name, const char *value);
+int append_variable(Variable **variables, const char *name, const char *value);
+Variable *remove_variable(Variable **variables, const char *name);
+
+/*
+** Splits len bytes of line into pipeline stages and words. Leading
+** whitespace and trailing comments are dropped.
+**
+** Returns NULL for a line with no words, or (ParsedLine *) -1 on error.
+*/
+ParsedLine *tokenize_line(const char *line, size_t len);
+
+/*
+** Turns a tokenized line into a list of commands ready for execute_line,
+** replacing variables and resolving executables against PATH.
+**
+** Returns the same values as parse_line.
+*/
+Command *prepare_line(ParsedLine *line, Variable **variables);
+
+/*
+** Like prepare_line, going through the parse cache with the line's
+** tokenized text as the key.
+*/
+Command *prepare_line_cached(ParsedLine *line, Variable **variables);
+
+/*
+** Appends a heap string to a growable NULL-terminated array of strings.
+** Returns false if the allocation failed.
+*/
+bool append_string(char ***list, size_t *count, size_t *capacity, char *str);
+
+/*
+** Checks whether a trimmed line assigns a variable (its first word
+** contains an '=').
+*/
+bool is_assignment(const char *line);
+
+/*
+** Frees a tokenized line, or the whole list if recursive is non-zero.
+*/
+void free_parsed_line(ParsedLine *line, uint8_t recursive);
+
+/*
+** Expands a `*`, `?` and `[...]` pattern against the file system, using
+** (and filling) the directory listings in cache.
+**
+** Returns a heap NULL-terminated array of sorted matching paths, which is
+** empty if nothing matched, or (char **) -1 on error.
+*/
+int has_glob_chars(const char *word);
+char **expand_glob(const char *pattern, DirListing **cache);
+void free_glob_results(char **results);
+void free_dir_listings(DirListing *listing);
+
+/*
+** Runs a command whose arguments may be too large for a single execv,
+** splitting them into chunks that fit under ARG_MAX and running up to
+** command->batch_jobs chunks at a time. Leading arguments that start
+** with '-' are treated as options and repeated in every chunk.
+**
+** Returns the first non-zero wait status of a chunk, 0 if all of them
+** succeeded, or -1 if a chunk could not be started.
+*/
+int run_batched(Command *command);
+
+/*
+** Runs a command marked `cached`, keyed on its executable, arguments,
+** environment, working directory and input file. A hit replays the
+** stored stdout without running anything; a miss runs the command with
+** its stdout teed into the cache, which keeps it if the command succeeds.
+** Key files hold everything the key was made from, which a hit has to
+** match, and outputs are only shared when their contents are the same.
+** Without a `<` redirection the command's stdin is /dev/null.
+**
+** Returns the wait status of the command (0 on a hit), or -1 if it
+** could not be started.
+*/
+int run_cached(Command *command);
+
+/*
+** Shared by the on-disk caches. cache_dir finds the per-user cache
+** directory (MEMO_DIR_ENV, else under XDG_CACHE_HOME or ~/.cache) and
+** creates it, writing its path into a MAX_PATH_STR buffer; it returns -1
+** if there is no usable one. fnv1a and fnv1a_str fold bytes or a
+** string into a 64-bit FNV-1a hash started from FNV_OFFSET.
+** replace_file writes data under a temporary name and renames it over
+** file, so other shells only ever map a complete index.
+*/
+int cache_dir(char *dir);
+void replace_file(const char *file, const char *data, size_t size);
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len);
+uint64_t fnv1a_str(uint64_t hash, const char *str);
+
+/*
+** Looks a command name up in the persistent PATH index for path_value,
+** a file in the cache directory shared by every shell of the user with
+** the same PATH. The index is checked against the modification times of
+** the PATH directories on every lookup, and rebuilt and atomically
+** replaced when any of them changed.
+**
+** Returns 1 if the index answered, with *exec_path set to a new heap
+** string or NULL when no directory has the command, and 0 if there is
+** no usable index and PATH has to be searched directly. *generation is
+** set to the generation of the index that answered.
+**
+** path_index_generation returns the generation of the index that is
+** current for path_value, or 0 if there is none. Every index the process
+** starts using gets a new generation, so the same generation means the
+** same answers.
+*/
+int path_index_lookup(const char *name, const char *path_value, char **exec_path,
+                      uint64_t *generation);
+uint64_t path_index_generation(const char *path_value);
+
+/*
+** Parses the options of a `limit` prefix at the start of cmd->args into
+** cmd->limits:
+**
+**     limit [-c CPUS] [-n NICE] [-i CLASS[:LEVEL]] [-r NAME=SOFT[:HARD]]...
+**
+** CPUS is a list such as 0-3,6; CLASS is none, rt, be or idle; NAME is
+** a resource as ulimit knows it (core, data, fsize, memlock, nofile,
+** stack, cpu, nproc, as), in the same units.
+**
+** Returns how many words the prefix used, or -1 if it is malformed.
+*/
+int parse_limit_prefix(Command *cmd);
+
+/*
+** Timeouts. A line starting with `timeout [-k KILL_AFTER] DURATION` has
+** its whole pipeline run in a process group of its own; when DURATION
+** passes the group gets SIGTERM, and SIGKILL if it is still there
+** KILL_AFTER later. Durations are seconds, with an optional s, m, h or d
+** suffix as for timeout(1).
+**
+** parse_duration returns false for a malformed duration.
+** parse_timeout_prefix fills cmd's timeout fields from the start of
+** cmd->args, returning how many words it used or -1 if malformed.
+*/
+bool parse_duration(const char *str, uint64_t *ms);
+int parse_timeout_prefix(Command *cmd);
+
+/*
+** How wait_pipeline waits, and what happened while it did.
+**
+** pgid:              the pipeline's process group, for the signals.
+** timeout_ms:        signal the group once this has passed, 0 for never.
+** kill_after_ms:     follow SIGTERM with SIGKILL after this long.
+** in_order_failures: reap stages as they exit, so first_failed is the
+**                    first stage to fail rather than the leftmost one.
+** teardown:          signal the group as soon as a stage fails.
+** untraced:          stop waiting as soon as a stage is stopped, which
+**                    sets stopped; its children are left in pids.
+** first_failed:      the index of the first failing stage, or -1.
+*/
+typedef struct PipelineWait {
+    pid_t pgid;
+    uint64_t timeout_ms;
+    uint64_t kill_after_ms;
+    bool in_order_failures;
+    bool teardown;
+    bool untraced;
+    int first_failed;
+    bool timed_out;
+    bool torn_down;
+    bool stopped;
+} PipelineWait;
+
+/*
+** Waits for every child of a pipeline, storing each stage's wait status
+** in statuses. A timeout is kept with a timerfd. Entries of pids are set
+** to 0 as they are reaped, and ones already 0 are skipped, so a stopped
+** job can be waited for again once it is continued.
+**
+** Returns the wait status of the last stage.
+*/
+int wait_pipeline(pid_t *pids, int *statuses, int num_pids, PipelineWait *wait);
+
+/*
+** Gets a file descriptor that polls readable when a child exits.
+** Returns -1 if the kernel has no pidfds.
+*/
+int open_pidfd(pid_t pid);
+
+/*
+** Turns a wait status into the exit code a shell reports for it.
+*/
+int exit_code(int status);
+
+/*
+** Applies limits to the calling process. Returns 0 on success, -1 with
+** the error printed.
+*/
+int apply_limits(const ProcLimits *limits);
+
+/*
+** Incremental execution of scripts. A line is up to date when every
+** stage is an external command, at least one stage writes (not appends)
+** to a file, and the oldest such output is newer than every executable
+** and `<` input of the line.
+**
+** Each run records what it ran and skipped in SCRIPT.cscstate, one
+** "LINE<TAB>ran|skipped<TAB>STATUS<TAB>TEXT" record per command line.
+*/
+typedef struct IncrementalLog IncrementalLog;
+
+int line_is_up_to_date(Command *head);
+IncrementalLog *incremental_open(const char *script_path);
+void incremental_note(IncrementalLog *log, size_t line_no, int ran, int status,
+                      const char *line, size_t line_len);
+void incremental_close(IncrementalLog *log);
+
+/*
+** Reads the lines of a script that could run anything, skipping blank
+** and comment-only lines. A regular file is mapped and its lines are
+** handed out in place, without their newlines and not NUL-terminated,
+** until the reader is closed. Anything else (a pipe, a terminal) is read
+** a line at a time into two buffers in turn, so a line stays valid until
+** the second line after it is read.
+**
+** A mapped file that shrinks while it runs reads as zeros from where it
+** was cut, instead of raising SIGBUS, and the script ends there.
+**
+** line_no is the physical line number of the line last handed out.
+*/
+typedef struct ScriptReader {
+    FILE *file;
+    const char *data;
+    size_t size;
+    size_t pos;
+    int slot;
+    bool past_mapping;
+    volatile sig_atomic_t truncated;
+    char *bufs[2];
+    size_t caps[2];
+    int next_buf;
+    const char *pending;
+    ssize_t pending_len;
+    size_t pending_no;
+    bool has_pending;
+    size_t lines_read;
+    size_t line_no;
+} ScriptReader;
+
+/*
+** Script reading shared by run_script, the pipelined reader and source.
+** Defined in reader.c, except for the last two.
+**
+** next_script_line sets line to the next line and returns its length, or
+** -1 at the end of the file.
+** script_reader_at_end tells whether no line follows the last one handed
+** out, without handing out the next.
+** script_line_cut tells whether a line was cut off by its file shrinking
+** since it was handed out; the script ends before such a line. A reader
+** whose file shrank has truncated set, also once it stops handing out
+** lines, and the script fails.
+** mark_tail_exec lets the last command of a script replace the shell,
+** which then exits with the command's own status (see exec_last_command).
+** run_script_line runs one parsed line of a script (taking ownership of
+** command), returning -1 when the script has to stop.
+*/
+void open_script_reader(ScriptReader *reader, FILE *file);
+ssize_t next_script_line(ScriptReader *reader, const char **line);
+bool script_reader_at_end(ScriptReader *reader);
+bool script_line_cut(ScriptReader *reader, const char *line, size_t len);
+void close_script_reader(ScriptReader *reader);
+void mark_tail_exec(Command *command);
+int run_script_line(Command *command, const char *line, size_t line_len,
+                    size_t line_no, bool exec_in_place, IncrementalLog *log,
+                    Variable **root);
+
+/*
+** Runs a script with reading and tokenizing of upcoming lines done on a
+** reader thread while the current line runs. Expansion, globbing and
+** PATH resolution depend on what earlier lines did, so each line is
+** prepared on the script thread just before it runs. Behaves like
+** run_script otherwise.
+**
+** Returns 0 on success, -1 as soon as a line fails.
+*/
+int run_script_pipelined(ScriptReader *reader, bool tail_exec, IncrementalLog *log,
+                         Variable **root);
+
+/*
+** Passes bytes between two adjacent builtin stages of a pipeline without
+** a pipe. Defined in stage.c.
+*/
+typedef struct StageRing StageRing;
+
+/*
+** Where a builtin that can be a pipeline stage reads and writes: a ring
+** shared with a neighbouring builtin stage, or else an fd, a pipe to an
+** external stage or the shell's own stdin and stdout. The shell's stdin
+** is read through in_file when it is set, the stream the interactive
+** loop reads its lines from, so what it has buffered is not lost.
+*/
+typedef struct StageIO {
+    int in_fd;
+    int out_fd;
+    StageRing *in_ring;
+    StageRing *out_ring;
+    FILE *in_file;
+} StageIO;
+
+/*
+** Commands run inside the shell process. A builtin gets the command it
+** was called as, the variables, and the fd its output should go to, and
+** returns a wait status in the same form execute_line reports.
+**
+** A builtin with a stage function instead, and no fn, reads and writes
+** through a StageIO. It can be part of a pipeline, where it runs on a
+** thread of its own; otherwise it gets the shell's stdin.
+*/
+typedef int (*BuiltinFn)(Command *command, Variable **root, int out_fd);
+typedef int (*StageFn)(Command *command, Variable **root, StageIO *io);
+
+typedef struct Builtin {
+    const char *name;
+    BuiltinFn fn;
+    StageFn stage;
+} Builtin;
+
+/*
+** Looks up a builtin by name. Returns NULL if name is not a builtin.
+*/
+const Builtin *find_builtin(const char *name);
+
+/*
+** Finds the builtin a parsed command runs as. Prefixes that need a
+** process of their own (exec, batch, cached, limit, timeout) run the
+** utility a stage builtin such as echo stands in for instead.
+**
+** Returns NULL if the command does not run as a builtin.
+*/
+const Builtin *shell_builtin(const Command *command);
+
+/*
+** Runs a builtin with its output redirection applied.
+**
+** Returns the same values as execute_line.
+*/
+int *run_builtin(const Builtin *builtin, Command *command, Variable **root);
+
+/*
+** Writes all of buf to fd, retrying short writes.
+** Returns 0 on success, -1 on error.
+*/
+int write_all(int fd, const char *buf, size_t len);
+
+/*
+** `parallel [-j N] cmd [args...] ::: inputs...` runs cmd once per input
+** with at most N jobs at a time, printing the output of each job in one
+** piece once it finishes.
+*/
+int builtin_parallel(Command *command, Variable **root, int out_fd);
+
+/*
+** Runtime counters and latency histograms, always collected and cheap
+** enough to leave on. Counters and histograms may be updated from any
+** thread; children are timed from fork until they are reaped.
+*/
+typedef enum StatCounter {
+    STAT_LINES_PARSED,
+    STAT_FORKS,
+    STAT_EXECS,
+    STAT_PATH_HITS,
+    STAT_PATH_MISSES,
+    STAT_VAR_LOOKUPS,
+    STAT_PIPE_BYTES,
+    STAT_THREAD_STAGES,
+    STAT_SOURCE_HITS,
+    STAT_PARSE_HITS,
+    NUM_STATS
+} StatCounter;
+
+typedef enum StatHistogram {
+    HIST_PARSE_LINE,
+    HIST_RESOLVE,
+    HIST_FORK_TO_EXIT,
+    NUM_HISTS
+} StatHistogram;
+
+uint64_t stats_now(void);
+void stats_add(StatCounter counter, uint64_t amount);
+void stats_record(StatHistogram hist, uint64_t nanoseconds);
+void stats_child_started(pid_t pid);
+void stats_child_reaped(pid_t pid);
+
+/*
+** Writes every counter and histogram summary as JSON to path.
+** Returns 0 on success, -1 on error.
+*/
+int stats_dump_json(const char *path);
+
+/*
+** `stats [--json]` prints the counters and histograms so far.
+*/
+int builtin_stats(Command *command, Variable **root, int out_fd);
+
+/*
+** The ulimit builtin: shows or sets a resource limit of the shell, which
+** every command started afterwards inherits.
+**
+**     ulimit [-S] [-H] [-a | -c|-d|-f|-l|-n|-s|-t|-u|-v [VALUE]]
+**
+** Sizes are in KiB and cpu in seconds; -f is the default, as in other
+** shells, and without -S or -H both limits are set.
+*/
+int builtin_ulimit(Command *command, Variable **root, int out_fd);
+
+/*
+** `set -o NAME` turns a shell option on, `set +o NAME` off, and `set -o`
+** alone lists them. The options are pipefail, and teardown, which also
+** turns pipefail on.
+*/
+int builtin_set(Command *command, Variable **root, int out_fd);
+
+/*
+** `echo [-neE] [args...]` as echo(1) from coreutils: -n drops the
+** newline and -e interprets backslash escapes.
+*/
+int builtin_echo(Command *command, Variable **root, StageIO *io);
+
+/*
+** `read [NAME...]` reads a line and assigns its words to the names, the
+** rest of the line to the last one, or the whole line to REPLY. Returns
+** status 1 at the end of the input.
+*/
+int builtin_read(Command *command, Variable **root, StageIO *io);
+
+/*
+** Builtin pipeline stages. A ring joins two adjacent builtin stages and
+** is freed by the caller once both have finished; start_stage runs a
+** stage on a new thread, which owns the fds and ring ends in io from
+** then on (also if NULL is returned), and finish_stage waits for it and
+** returns its wait status. The thread runs a copy of command, so a stage
+** of a stopped job can outlive its line; stage_finished tells whether it
+** has returned, so finish_stage would not wait. finish_stages finishes
+** the stages of a pipeline, by position with NULL for its processes,
+** storing their statuses, and returns first_failed moved to an earlier
+** stage that failed. close_stage_io closes the ends of a stage that
+** could not be started.
+**
+** stage_read and stage_write are the stage builtins' I/O; stage_read
+** returns 0 at the end of the input, stage_write 0 or -1.
+*/
+typedef struct StageThread StageThread;
+StageRing *stage_ring_new(void);
+void stage_ring_free(StageRing *ring);
+void stage_ring_close(StageRing *ring, bool writer);
+StageThread *start_stage(const Builtin *builtin, Command *command, Variable **root,
+                         StageIO *io);
+int finish_stage(StageThread *stage);
+bool stage_finished(StageThread *stage);
+int finish_stages(StageThread **stages, int *statuses, int num_stages, int first_failed);
+
+/*
+** Runs a builtin stage in a child of its own in command->pgid, as
+** run_command does, for a stage that has to be in the foreground job to
+** read the terminal. What the stage does to variables stays in the
+** child. The child owns io as a thread would, and the shell's copies are
+** closed. Returns the child's pid, or -1 with the error printed.
+*/
+pid_t fork_stage(const Builtin *builtin, Command *command, Variable **root, StageIO *io);
+void close_stage_io(StageIO *io);
+ssize_t stage_read(StageIO *io, void *buf, size_t len);
+int stage_write(StageIO *io, const void *buf, size_t len);
+
+/*
+** Job control for the interactive shell. init_job_control puts the shell
+** in a process group of its own in the foreground of its terminal and
+** ignores the terminal's job signals, so ^C and ^Z only reach the
+** pipeline that has the terminal. Returns -1 if stdin is no terminal.
+*/
+int init_job_control(void);
+
+/*
+** In a child of the shell, once it is in its pipeline's process group:
+** takes the terminal for the group and restores the job signals.
+*/
+void enter_job(void);
+
+/*
+** Hands the terminal to a pipeline's process group, and takes it back
+** for the shell with the shell's terminal modes. take_terminal saves the
+** modes the job left behind in job_modes unless it is NULL.
+*/
+void give_terminal(pid_t pgid);
+void take_terminal(struct termios *job_modes);
+
+/*
+** Puts a stopped pipeline in the job table, with the children it has
+** left and the statuses of those already reaped, and reports it. Its
+** builtin stages (NULL for the processes) and the rings between them
+** are the job's from then on, to be finished once it is done.
+**
+** Returns the new job's number.
+*/
+int suspend_job(Command *head, pid_t pgid, pid_t *pids, int *statuses,
+                StageThread **stages, int num_pids, StageRing **rings, int num_rings,
+                struct termios *modes);
+
+/*
+** Reaps jobs that finished or stopped in the background, reporting each.
+** The interactive shell calls it before every prompt.
+*/
+void reap_jobs(void);
+
+/*
+** `fg [%N]` continues a job in the foreground and waits for it, `bg [%N]`
+** continues it in the background, and `jobs` lists the table. Without N
+** they take the most recent job.
+*/
+int builtin_fg(Command *command, Variable **root, int out_fd);
+int builtin_bg(Command *command, Variable **root, int out_fd);
+int builtin_jobs(Command *command, Variable **root, int out_fd);
+
+/*
+** History of the interactive shell, in a file shared by all its sessions
+** (HISTORY_FILE_ENV, else ~/.cscshell_history). open_history opens it
+** and returns -1 if there is none; add_history records a line, writing
+** lines out HISTORY_BATCH_LINES at a time, and close_history writes out
+** the rest.
+*/
+int open_history(void);
+void add_history(const char *line);
+void close_history(void);
+
+/*
+** `history [COUNT]` lists the last COUNT lines of the history, oldest
+** first, and `history -s TEXT [COUNT]` the last COUNT lines containing
+** TEXT, newest first. COUNT defaults to HISTORY_DEFAULT_COUNT. A search
+** goes through a trigram index kept in the cache directory.
+*/
+int builtin_history(Command *command, Variable **root, int out_fd);
+
+/*
+** Stores the exit codes of the stages of the line that just ran in
+** PIPESTATUS, separated by spaces. A new PIPESTATUS goes at the end of
+** the variables list.
+*/
+void set_pipestatus(Variable **root, const char *codes);
+
+/*
+** Function definitions. A definition may span several lines, in which
+** case parse_line feeds every line up to the closing brace to
+** continue_function_definition.
+**
+** Both return 0 on success and -1 on a malformed definition.
+*/
+int is_function_definition(const char *line);
+int start_function_definition(const char *line);
+int function_definition_pending(void);
+int continue_function_definition(const char *line);
+Function *find_function(const char *name);
+
+/*
+** Returns a number that changes whenever a function is defined, so the
+** result of find_function for any name is the same while it does not.
+*/
+uint64_t functions_version(void);
+
+/*
+** Runs the body of fn in the current shell with args[1..] bound to the
+** positional variables $1, $2, ...
+**
+** Returns the same values as execute_line.
+*/
+int *call_function(Function *fn, char **args, Variable **root);
+
+/*
+** Runs tokenized lines, such as a function body, in the current shell,
+** stopping at the first line that fails. *status is left with the wait
+** status of the last line run.
+**
+** Returns 0, or -1 if a line could not be executed at all.
+*/
+int run_parsed_lines(ParsedLine *lines, Variable **root, int *status);
+
+/*
+** `source FILE` and `. FILE` run a file in the current shell, so its
+** assignments and functions stay. Files are kept tokenized in memory,
+** SOURCE_CACHE_SIZE at most, and read again once their inode, size or
+** modification time change.
+*/
+int builtin_source(Command *command, Variable **root, int out_fd);
+
+/*
+** A cache of prepared lines, PARSE_CACHE_SIZE at most, keyed by their
+** text. While a line is prepared, the variables it reads, the PATH index
+** that resolves its stages and the defined functions are recorded, and
+** the line is served from the cache for as long as none of them change.
+** Lines that expand globs, or whose stages are resolved without the
+** index, depend on directories and are never cached.
+**
+** parse_cache_lookup returns a copy of the commands a line was prepared
+** into, or NULL if it has to be prepared. parse_cache_begin starts
+** recording, and parse_cache_end stops it, keeping a copy of commands
+** when it is a list of commands that can be cached.
+** The note_parse_ functions are called where preparing reads something
+** that can change, and do nothing unless the thread is recording.
+*/
+Command *parse_cache_lookup(const char *line, size_t len, Variable *variables);
+void parse_cache_begin(void);
+void parse_cache_end(const char *line, size_t len, Command *commands);
+void note_parse_variable(const char *name, size_t name_len, const Variable *var);
+void note_parse_path(uint64_t generation);
+void note_parse_uncacheable(void);
+
+/*
+** Executes a parsed line in the context of the shell itself: shell
+** functions and builtins run in-process, anything else goes to
+** execute_line.
+**
+** Returns the same values as execute_line.
+*/
+int *execute_shell_line(Command *head, Variable **root);
 #endif
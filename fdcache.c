@@ -0,0 +1,106 @@
+#include "cscshell.h"
+#include <pthread.h>
+
+
+/*
+** A file kept open for appending redirections, by the path it was named
+** with. O_APPEND writes always go to the end of the file, so one open
+** file can be shared by every command that appends to it; a file opened
+** for reading could not be, as its readers would share one offset.
+*/
+typedef struct CachedFd {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    uint64_t last_used;
+} CachedFd;
+
+static CachedFd cached[FD_CACHE_SIZE];
+static int num_cached = 0;
+static uint64_t use_clock = 0;
+
+// builtin stages open their redirections on their own threads
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Closes a cached file and takes it out of the cache.
+ *
+ * @param i Its slot.
+ */
+void drop_cached_fd(int i) {
+    close(cached[i].fd);
+    free(cached[i].path);
+    cached[i] = cached[--num_cached];
+}
+
+/**
+ * Finds the open file for appending to a path, opening it and evicting
+ * the least recently used one if it is not cached. A cached file is only
+ * used while the path still names it.
+ *
+ * @param path The file.
+ * @return The cache's descriptor, or -1 with errno set.
+ */
+int cached_append_fd(const char *path) {
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    for (int i = 0; i < num_cached; i++) {
+        if (strcmp(cached[i].path, path) != 0) continue;
+        if (exists && cached[i].dev == st.st_dev && cached[i].ino == st.st_ino) {
+            cached[i].last_used = ++use_clock;
+            return cached[i].fd;
+        }
+        // removed or replaced since it was opened
+        drop_cached_fd(i);
+        break;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0777);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (num_cached == FD_CACHE_SIZE) {
+        int oldest = 0;
+        for (int i = 1; i < num_cached; i++) {
+            if (cached[i].last_used < cached[oldest].last_used) oldest = i;
+        }
+        drop_cached_fd(oldest);
+    }
+    cached[num_cached].path = copy;
+    cached[num_cached].dev = st.st_dev;
+    cached[num_cached].ino = st.st_ino;
+    cached[num_cached].fd = fd;
+    cached[num_cached].last_used = ++use_clock;
+    num_cached++;
+    return fd;
+}
+
+int open_redirect_out(Command *command) {
+    if (!command->redir_append) {
+        return open(command->redir_out_path,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0777);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int fd = cached_append_fd(command->redir_out_path);
+    // above stdin, so a descriptor of 0 never means one
+    int copy = fd < 0 ? -1 : fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    pthread_mutex_unlock(&cache_lock);
+    return copy;
+}
+
+void fd_cache_chdir(void) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = num_cached - 1; i >= 0; i--) {
+        if (cached[i].path[0] != '/') drop_cached_fd(i);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,291 @@
+#include "cscshell.h"
+#include <ctype.h>
+#include <stdbool.h>
+
+
+// All defined functions, most recently defined first
+static Function *functions = NULL;
+
+// The definition currently being read, when it spans several lines
+static Function *pending = NULL;
+
+// How many function calls are currently active
+static int call_depth = 0;
+
+// Definitions replaced while a call was active, freed once it returns
+static Function *retired = NULL;
+
+// Bumped on every definition
+static uint64_t definitions = 0;
+
+
+Function *find_function(const char *name) {
+    for (Function *current = functions; current; current = current->next) {
+        if (strcmp(current->name, name) == 0) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Frees a function and its body.
+ *
+ * @param fn The function to free.
+ */
+void free_function(Function *fn) {
+    free(fn->name);
+    free_parsed_line(fn->body, NON_ZERO_BYTE);
+    free(fn);
+}
+
+/**
+ * Makes a finished definition visible, replacing any earlier function with
+ * the same name. A function that is still running keeps its old body until
+ * the outermost call returns, since its caller is walking that body.
+ *
+ * @param fn The finished definition.
+ */
+void register_function(Function *fn) {
+    for (Function **link = &functions; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, fn->name) == 0) {
+            Function *old = *link;
+            *link = old->next;
+            if (call_depth == 0) {
+                free_function(old);
+            } else {
+                old->next = retired;
+                retired = old;
+            }
+            break;
+        }
+    }
+    fn->next = functions;
+    functions = fn;
+    definitions++;
+}
+
+uint64_t functions_version(void) {
+    return definitions;
+}
+
+/**
+ * Appends the lines of a body fragment to a function. The fragment may
+ * contain several lines separated by ';'.
+ *
+ * @param fn The function being defined.
+ * @param start Start of the fragment.
+ * @param end One past the end of the fragment.
+ * @return 0 on success, -1 on error.
+ */
+int add_body_lines(Function *fn, const char *start, const char *end) {
+    ParsedLine **tail = &fn->body;
+    while (*tail) tail = &(*tail)->next;
+
+    while (start < end) {
+        const char *line_end = memchr(start, FUNC_LINE_SEPARATOR, end - start);
+        if (line_end == NULL) line_end = end;
+
+        while (start < line_end && isspace((unsigned char)*start)) start++;
+        size_t first_word_len = strcspn(start, WORD_DELIMS);
+        if (first_word_len > (size_t)(line_end - start)) {
+            first_word_len = line_end - start;
+        }
+
+        if (start < line_end && memchr(start, '=', first_word_len)) {
+            // assignments are re-parsed from their text on every call
+            ParsedLine *assignment = calloc(1, sizeof(ParsedLine));
+            if (assignment == NULL) {
+                return -1;
+            }
+            assignment->text = strndup(start, line_end - start);
+            if (assignment->text == NULL) {
+                free(assignment);
+                return -1;
+            }
+            *tail = assignment;
+            tail = &assignment->next;
+        } else {
+            ParsedLine *line = tokenize_line(start, line_end - start);
+            if (line == (ParsedLine *) -1) {
+                return -1;
+            }
+            if (line != NULL) {
+                *tail = line;
+                tail = &line->next;
+            }
+        }
+        start = line_end + 1;
+    }
+    return 0;
+}
+
+int is_function_definition(const char *line) {
+    const char *ptr = line;
+    while (isalnum((unsigned char)*ptr) || *ptr == '_') ptr++;
+    if (ptr == line) {
+        return 0;
+    }
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+    return strncmp(ptr, FUNC_PARENS, strlen(FUNC_PARENS)) == 0;
+}
+
+int start_function_definition(const char *line) {
+    const char *name_end = line;
+    while (isalnum((unsigned char)*name_end) || *name_end == '_') name_end++;
+
+    const char *body = strchr(name_end, FUNC_BODY_START);
+    if (body == NULL) {
+        ERR_PRINT(ERR_FUNC_DEF, line);
+        return -1;
+    }
+    body++;
+
+    // digits would make the name look like a positional variable
+    if (isdigit((unsigned char)*line)) {
+        ERR_PRINT(ERR_FUNC_NAME, line);
+        return -1;
+    }
+
+    Function *fn = calloc(1, sizeof(Function));
+    if (fn == NULL) {
+        return -1;
+    }
+    fn->name = strndup(line, name_end - line);
+    if (fn->name == NULL) {
+        free(fn);
+        return -1;
+    }
+
+    // `name() { a; b; }` is complete on a single line
+    const char *end = body + strlen(body);
+    while (end > body && isspace((unsigned char)*(end - 1))) end--;
+    bool complete = end > body && *(end - 1) == FUNC_BODY_END;
+    if (complete) end--;
+
+    if (add_body_lines(fn, body, end) < 0) {
+        free_function(fn);
+        return -1;
+    }
+
+    if (complete) {
+        register_function(fn);
+    } else {
+        pending = fn;
+    }
+    return 0;
+}
+
+int function_definition_pending(void) {
+    return pending != NULL;
+}
+
+int continue_function_definition(const char *line) {
+    while (isspace((unsigned char)*line)) line++;
+    const char *end = line + strlen(line);
+    while (end > line && isspace((unsigned char)*(end - 1))) end--;
+
+    bool complete = end > line && *(end - 1) == FUNC_BODY_END;
+    if (complete) end--;
+
+    if (add_body_lines(pending, line, end) < 0) {
+        free_function(pending);
+        pending = NULL;
+        return -1;
+    }
+
+    if (complete) {
+        register_function(pending);
+        pending = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Takes the positional variables ($1, $2, ...) of the current call out of
+ * the variable list so a new call can bind its own.
+ *
+ * @param variables Pointer to the head of the variables list.
+ * @return The detached positional variables, linked in order.
+ */
+Variable *detach_positionals(Variable **variables) {
+    Variable *detached = NULL, **tail = &detached;
+    char name[MAX_USER_BUF];
+
+    for (int i = 1; ; i++) {
+        snprintf(name, sizeof(name), "%d", i);
+        Variable *var = remove_variable(variables, name);
+        if (var == NULL) break;
+        *tail = var;
+        tail = &var->next;
+    }
+    return detached;
+}
+
+int run_parsed_lines(ParsedLine *lines, Variable **root, int *status) {
+    for (ParsedLine *line = lines; line != NULL; line = line->next) {
+        Command *commands = line->stages ?
+            prepare_line(line, root) : parse_line(line->text, root);
+        if (commands == (Command *) -1) {
+            ERR_PRINT(ERR_PARSING_LINE);
+            continue;
+        }
+        if (commands == NULL) continue;
+
+        int *line_status = execute_shell_line(commands, root);
+        free_command(commands);
+        if (line_status == (int *) -1) {
+            return -1;
+        }
+
+        // Stop at the first failing line, as run_script does
+        *status = *line_status;
+        free(line_status);
+        if (*status != 0) break;
+    }
+    return 0;
+}
+
+int *call_function(Function *fn, char **args, Variable **root) {
+    if (call_depth >= MAX_FUNC_DEPTH) {
+        ERR_PRINT(ERR_FUNC_DEPTH, fn->name);
+        return (int *) -1;
+    }
+
+    int *status = malloc(sizeof(int));
+    if (status == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    *status = 0;
+
+    Variable *saved = detach_positionals(root);
+    char name[MAX_USER_BUF];
+    for (int i = 1; args[i] != NULL; i++) {
+        snprintf(name, sizeof(name), "%d", i);
+        if (set_variable(root, name, args[i]) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    call_depth++;
+    if (run_parsed_lines(fn->body, root, status) < 0) {
+        free(status);
+        status = (int *) -1;
+    }
+    call_depth--;
+
+    while (call_depth == 0 && retired != NULL) {
+        Function *next = retired->next;
+        free_function(retired);
+        retired = next;
+    }
+
+    free_variable(detach_positionals(root), NON_ZERO_BYTE);
+    while (saved != NULL) {
+        Variable *next = saved->next;
+        saved->next = *root;
+        *root = saved;
+        saved = next;
+    }
+    return status;
+}
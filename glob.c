@@ -0,0 +1,334 @@
+#include "cscshell.h"
+#include <fnmatch.h>
+#include <stdbool.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+
+/*
+** Record layout returned by getdents64(2); glibc does not export it.
+*/
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+
+int has_glob_chars(const char *word) {
+    return strpbrk(word, GLOB_CHARS) != NULL;
+}
+
+/**
+ * Orders two names from a listing, for qsort.
+ */
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ * Adds one directory entry to a listing under construction. Entries are
+ * packed one after another in a single buffer as a d_type byte followed
+ * by the name, so that listing a huge directory costs a handful of
+ * allocations rather than one per entry.
+ *
+ * @param listing The listing being filled.
+ * @param name The entry name.
+ * @param type The d_type of the entry.
+ * @param buf_cap Pointer to the allocated size of listing->buf.
+ * @param cap Pointer to the allocated number of slots in offsets.
+ * @param offsets Pointer to the array of name offsets into listing->buf.
+ * @return True on success, False if an allocation failed.
+ */
+bool add_listing_entry(DirListing *listing, const char *name, unsigned char type,
+                       size_t *buf_cap, size_t *cap, size_t **offsets) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return true;
+    }
+
+    size_t len = strlen(name) + 1;
+    if (listing->buf_len + len + 1 > *buf_cap) {
+        size_t new_cap = *buf_cap ? *buf_cap * 2 : GLOB_DIRENT_BUF;
+        while (new_cap < listing->buf_len + len + 1) new_cap *= 2;
+        char *grown = realloc(listing->buf, new_cap);
+        if (grown == NULL) {
+            return false;
+        }
+        listing->buf = grown;
+        *buf_cap = new_cap;
+    }
+    if (listing->count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 64;
+        size_t *grown = realloc(*offsets, sizeof(size_t) * new_cap);
+        if (grown == NULL) {
+            return false;
+        }
+        *offsets = grown;
+        *cap = new_cap;
+    }
+
+    listing->buf[listing->buf_len++] = (char) type;
+    (*offsets)[listing->count++] = listing->buf_len;
+    memcpy(listing->buf + listing->buf_len, name, len);
+    listing->buf_len += len;
+    return true;
+}
+
+/**
+ * Reads every entry of a directory into a new, sorted listing.
+ * On Linux the entries are read in large batches with getdents64.
+ *
+ * @param path The directory to read.
+ * @return The new listing, or NULL if the directory cannot be read.
+ */
+DirListing *read_dir_listing(const char *path) {
+    DirListing *listing = calloc(1, sizeof(DirListing));
+    if (listing == NULL) {
+        return NULL;
+    }
+    listing->path = strdup(path);
+    if (listing->path == NULL) {
+        free(listing);
+        return NULL;
+    }
+
+    size_t buf_cap = 0, cap = 0;
+    size_t *offsets = NULL;
+    bool ok = true;
+
+#ifdef __linux__
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *batch = malloc(GLOB_DIRENT_BUF);
+    if (fd < 0 || batch == NULL) {
+        ok = false;
+    }
+    long nread = 0;
+    while (ok && (nread = syscall(SYS_getdents64, fd, batch, GLOB_DIRENT_BUF)) > 0) {
+        for (long pos = 0; ok && pos < nread; ) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *) (batch + pos);
+            ok = add_listing_entry(listing, entry->d_name, entry->d_type,
+                                   &buf_cap, &cap, &offsets);
+            pos += entry->d_reclen;
+        }
+    }
+    if (nread < 0) {
+        ok = false;
+    }
+    free(batch);
+    if (fd >= 0) close(fd);
+#else
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        ok = false;
+    }
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        ok = add_listing_entry(listing, entry->d_name, entry->d_type,
+                               &buf_cap, &cap, &offsets);
+    }
+    if (dir != NULL) closedir(dir);
+#endif
+
+    if (ok) {
+        listing->names = malloc(sizeof(char *) * (listing->count + 1));
+        ok = listing->names != NULL;
+    }
+    if (!ok) {
+        free(offsets);
+        free_dir_listings(listing);
+        return NULL;
+    }
+
+    // the buffer no longer moves, so offsets can become pointers
+    for (size_t i = 0; i < listing->count; i++) {
+        listing->names[i] = listing->buf + offsets[i];
+    }
+    listing->names[listing->count] = NULL;
+    free(offsets);
+
+    qsort(listing->names, listing->count, sizeof(char *), compare_names);
+    return listing;
+}
+
+/**
+ * Finds the listing of a directory in the per-line cache, reading it and
+ * adding it to the cache on first use.
+ *
+ * @param path The directory.
+ * @param cache Pointer to the head of the cache.
+ * @return The listing, or NULL if the directory cannot be read.
+ */
+DirListing *get_dir_listing(const char *path, DirListing **cache) {
+    for (DirListing *current = *cache; current; current = current->next) {
+        if (strcmp(current->path, path) == 0) {
+            return current;
+        }
+    }
+
+    DirListing *listing = read_dir_listing(path);
+    if (listing != NULL) {
+        listing->next = *cache;
+        *cache = listing;
+    }
+    return listing;
+}
+
+void free_dir_listings(DirListing *listing) {
+    while (listing != NULL) {
+        DirListing *next = listing->next;
+        free(listing->path);
+        free(listing->buf);
+        free(listing->names);
+        free(listing);
+        listing = next;
+    }
+}
+
+/**
+ * Joins a directory prefix built up during expansion with an entry name.
+ *
+ * @param prefix The directory so far; "" for the current directory.
+ * @param name The entry name.
+ * @return A new heap string, or NULL if the allocation failed.
+ */
+char *join_glob_path(const char *prefix, const char *name) {
+    size_t prefix_len = strlen(prefix);
+    bool needs_slash = prefix_len > 0 && prefix[prefix_len - 1] != '/';
+    char *path = malloc(prefix_len + needs_slash + strlen(name) + 1);
+    if (path == NULL) {
+        return NULL;
+    }
+    strcpy(path, prefix);
+    if (needs_slash) strcat(path, "/");
+    strcat(path, name);
+    return path;
+}
+
+/**
+ * Checks whether an entry from a listing is a directory, following
+ * symbolic links and falling back to stat when d_type is not reported.
+ *
+ * @param prefix The directory the entry was listed from.
+ * @param name A name from that directory's listing.
+ * @return True if the entry is (or links to) a directory.
+ */
+bool entry_is_dir(const char *prefix, const char *name) {
+    unsigned char type = (unsigned char) name[-1];
+    if (type == DT_DIR) {
+        return true;
+    }
+    if (type != DT_LNK && type != DT_UNKNOWN) {
+        return false;
+    }
+
+    char *path = join_glob_path(prefix, name);
+    struct stat st;
+    bool is_dir = path != NULL && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    free(path);
+    return is_dir;
+}
+
+/**
+ * Frees a NULL-terminated array of heap strings.
+ */
+void free_glob_results(char **results) {
+    if (results == NULL || results == (char **) -1) return;
+    for (int i = 0; results[i] != NULL; i++) free(results[i]);
+    free(results);
+}
+
+char **expand_glob(const char *pattern, DirListing **cache) {
+    char *segments = strdup(pattern);
+    char **results = calloc(2, sizeof(char *));
+    if (segments == NULL || results == NULL) {
+        goto glob_fail;
+    }
+
+    size_t pattern_len = strlen(pattern);
+    bool dirs_only = pattern_len > 1 && pattern[pattern_len - 1] == '/';
+    results[0] = strdup(pattern[0] == '/' ? "/" : "");
+    if (results[0] == NULL) {
+        goto glob_fail;
+    }
+
+    char *savePtr;
+    char *segment = strtok_r(segments, "/", &savePtr);
+    bool matched_any_glob = false;
+    while (segment != NULL) {
+        char *next_segment = strtok_r(NULL, "/", &savePtr);
+        bool last = next_segment == NULL;
+
+        char **matches = NULL;
+        size_t count = 0, capacity = 0;
+        for (int i = 0; results[i] != NULL; i++) {
+            const char *prefix = results[i];
+
+            if (!has_glob_chars(segment)) {
+                char *path = join_glob_path(prefix, segment);
+                if (path == NULL || !append_string(&matches, &count, &capacity, path)) {
+                    free(path);
+                    free_glob_results(matches);
+                    goto glob_fail;
+                }
+                continue;
+            }
+
+            matched_any_glob = true;
+            DirListing *listing = get_dir_listing(*prefix ? prefix : ".", cache);
+            if (listing == NULL) continue;
+
+            for (size_t j = 0; j < listing->count; j++) {
+                const char *name = listing->names[j];
+                if (fnmatch(segment, name, FNM_PERIOD) != 0) continue;
+                if ((!last || dirs_only) && !entry_is_dir(prefix, name)) continue;
+
+                char *path = join_glob_path(prefix, name);
+                if (path == NULL || !append_string(&matches, &count, &capacity, path)) {
+                    free(path);
+                    free_glob_results(matches);
+                    goto glob_fail;
+                }
+            }
+        }
+
+        free_glob_results(results);
+        results = matches ? matches : calloc(1, sizeof(char *));
+        if (results == NULL) {
+            goto glob_fail;
+        }
+        segment = next_segment;
+    }
+    free(segments);
+
+    // literal components after the last glob must actually exist
+    if (matched_any_glob) {
+        int kept = 0;
+        struct stat st;
+        for (int i = 0; results[i] != NULL; i++) {
+            if (lstat(results[i], &st) == 0) {
+                results[kept++] = results[i];
+            } else {
+                free(results[i]);
+            }
+        }
+        results[kept] = NULL;
+    }
+
+    for (int i = 0; dirs_only && results[i] != NULL; i++) {
+        char *with_slash = join_glob_path(results[i], "");
+        if (with_slash == NULL) {
+            goto glob_fail;
+        }
+        free(results[i]);
+        results[i] = with_slash;
+    }
+    return results;
+
+glob_fail:
+    free(segments);
+    free_glob_results(results);
+    return (char **) -1;
+}
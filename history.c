@@ -0,0 +1,542 @@
+#include "cscshell.h"
+#include <sys/mman.h>
+
+
+/*
+** The history file holds one line per entry, each appended with a single
+** O_APPEND write, so the sessions sharing it never tear each other's
+** entries. Its index lives in the cache directory and covers the entries
+** up to some offset; the ones after it are searched by scanning until
+** there are enough of them to be worth indexing again:
+**
+**     HistoryHeader | uint64_t entries[num_entries]
+**                   | HistoryTrigram[num_trigrams] | uint32_t postings[]
+**
+** entries holds where each entry starts. A trigram's postings are the
+** numbers of the entries containing it, oldest first.
+*/
+typedef struct HistoryHeader {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t covered;
+    uint32_t num_entries;
+    uint32_t num_trigrams;
+    uint32_t num_postings;
+    uint32_t reserved;
+} HistoryHeader;
+
+typedef struct HistoryTrigram {
+    uint32_t trigram;
+    uint32_t first;
+    uint32_t count;
+} HistoryTrigram;
+
+/*
+** The history of this session: the file, mapped as of the last search,
+** the entries not written out yet, and the index in use, either mapped
+** from the cache or built in memory.
+*/
+typedef struct History {
+    int fd;
+    char path[MAX_PATH_STR];
+    char *data;
+    size_t size;
+    char pending[HISTORY_BATCH_BYTES];
+    size_t pending_len;
+    int pending_lines;
+    char *index;
+    size_t index_size;
+    bool index_mapped;
+} History;
+
+static History history = {.fd = -1};
+
+
+int open_history(void) {
+    const char *file = getenv(HISTORY_FILE_ENV);
+    const char *home = getenv("HOME");
+    int written;
+    if (file != NULL && *file) {
+        written = snprintf(history.path, MAX_PATH_STR, "%s", file);
+    } else if (home != NULL && *home) {
+        written = snprintf(history.path, MAX_PATH_STR, "%s/%s", home, HISTORY_FILE_NAME);
+    } else {
+        return -1;
+    }
+    if (written >= MAX_PATH_STR) {
+        return -1;
+    }
+    history.fd = open(history.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    return history.fd < 0 ? -1 : 0;
+}
+
+/**
+ * Writes the pending entries to the history file in one append.
+ */
+void flush_history(void) {
+    if (history.pending_len > 0 && history.fd >= 0) {
+        write_all(history.fd, history.pending, history.pending_len);
+    }
+    history.pending_len = 0;
+    history.pending_lines = 0;
+}
+
+void add_history(const char *line) {
+    if (history.fd < 0 || line[strspn(line, WORD_DELIMS)] == '\0') {
+        return;
+    }
+    size_t len = strlen(line);
+    if (history.pending_len + len + 1 > HISTORY_BATCH_BYTES) {
+        flush_history();
+    }
+    if (len + 1 > HISTORY_BATCH_BYTES) {
+        return;
+    }
+    memcpy(history.pending + history.pending_len, line, len);
+    history.pending[history.pending_len + len] = '\n';
+    history.pending_len += len + 1;
+    if (++history.pending_lines >= HISTORY_BATCH_LINES) {
+        flush_history();
+    }
+}
+
+/**
+ * Maps the history file as it is now, including what other sessions
+ * appended since the last time.
+ *
+ * @return 0 on success, -1 if the file could not be mapped.
+ */
+int map_history(void) {
+    struct stat st;
+    if (fstat(history.fd, &st) < 0) {
+        return -1;
+    }
+    if (history.data != NULL && (size_t) st.st_size == history.size) {
+        return 0;
+    }
+    if (history.data != NULL) {
+        munmap(history.data, history.size);
+        history.data = NULL;
+        history.size = 0;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    history.data = data;
+    history.size = st.st_size;
+    return 0;
+}
+
+/**
+ * Packs the three bytes at ptr into a trigram.
+ */
+uint32_t history_trigram(const char *ptr) {
+    const unsigned char *bytes = (const unsigned char *) ptr;
+    return (uint32_t) bytes[0] << 16 | (uint32_t) bytes[1] << 8 | bytes[2];
+}
+
+/**
+ * Sorts (trigram, entry) pairs by trigram, a byte at a time. Each pass is
+ * stable, so pairs made in entry order stay in entry order per trigram.
+ *
+ * @param pairs The pairs, trigram in the upper 32 bits.
+ * @param num_pairs How many there are.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+int sort_history_pairs(uint64_t *pairs, size_t num_pairs) {
+    uint64_t *spare = malloc(sizeof(uint64_t) * (num_pairs ? num_pairs : 1));
+    if (spare == NULL) {
+        return -1;
+    }
+    uint64_t *from = pairs, *to = spare;
+    for (int shift = 32; shift < 56; shift += 8) {
+        size_t counts[257] = {0};
+        for (size_t i = 0; i < num_pairs; i++) counts[((from[i] >> shift) & 0xff) + 1]++;
+        for (int b = 0; b < 256; b++) counts[b + 1] += counts[b];
+        for (size_t i = 0; i < num_pairs; i++) to[counts[(from[i] >> shift) & 0xff]++] = from[i];
+        uint64_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    // three passes leave the sorted pairs in spare
+    memcpy(pairs, from, sizeof(uint64_t) * num_pairs);
+    free(spare);
+    return 0;
+}
+
+/**
+ * Checks that an index is well formed, was built for this history file
+ * and covers no more than the file holds.
+ *
+ * @param data The index.
+ * @param size Its size in bytes.
+ * @return True if the index can answer searches.
+ */
+bool history_index_is_valid(const char *data, size_t size) {
+    if (data == NULL || size < sizeof(HistoryHeader)) {
+        return false;
+    }
+    const HistoryHeader *header = (const HistoryHeader *) data;
+    struct stat st;
+    if (memcmp(header->magic, HISTORY_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        fstat(history.fd, &st) < 0 || header->dev != (uint64_t) st.st_dev ||
+        header->ino != (uint64_t) st.st_ino || header->covered > history.size) {
+        return false;
+    }
+    size_t expected = sizeof(HistoryHeader) +
+        (size_t) header->num_entries * sizeof(uint64_t) +
+        (size_t) header->num_trigrams * sizeof(HistoryTrigram) +
+        (size_t) header->num_postings * sizeof(uint32_t);
+    return expected == size &&
+        (header->covered == 0 || history.data[header->covered - 1] == '\n');
+}
+
+/**
+ * Builds an index of every complete entry of the mapped history file.
+ *
+ * @param size Set to the size of the index.
+ * @return The index on the heap, or NULL on error.
+ */
+char *build_history_index(size_t *size) {
+    size_t covered = history.size;
+    while (covered > 0 && history.data[covered - 1] != '\n') covered--;
+
+    uint64_t *entries = NULL, *pairs = NULL;
+    size_t num_entries = 0, entries_cap = 0, num_pairs = 0, pairs_cap = 0;
+    char *data = NULL;
+
+    for (size_t start = 0; start < covered;) {
+        const char *end = memchr(history.data + start, '\n', covered - start);
+        size_t len = end - (history.data + start);
+        if (num_entries == entries_cap) {
+            entries_cap = entries_cap ? entries_cap * 2 : 1024;
+            uint64_t *grown = realloc(entries, sizeof(uint64_t) * entries_cap);
+            if (grown == NULL) goto build_fail;
+            entries = grown;
+        }
+        if (len >= 3 && num_pairs + len > pairs_cap) {
+            pairs_cap = pairs_cap ? pairs_cap * 2 : 4096;
+            while (pairs_cap < num_pairs + len) pairs_cap *= 2;
+            uint64_t *grown = realloc(pairs, sizeof(uint64_t) * pairs_cap);
+            if (grown == NULL) goto build_fail;
+            pairs = grown;
+        }
+        for (size_t i = 0; i + 3 <= len; i++) {
+            pairs[num_pairs++] = (uint64_t) history_trigram(history.data + start + i) << 32 |
+                                 num_entries;
+        }
+        entries[num_entries++] = start;
+        start += len + 1;
+    }
+    if (num_entries > UINT32_MAX || num_pairs > UINT32_MAX) {
+        goto build_fail;
+    }
+
+    // sorting brings an entry's repeats of a trigram together to be dropped
+    if (sort_history_pairs(pairs, num_pairs) < 0) {
+        goto build_fail;
+    }
+    size_t num_postings = 0, num_trigrams = 0;
+    for (size_t i = 0; i < num_pairs; i++) {
+        if (i > 0 && pairs[i] == pairs[i - 1]) continue;
+        if (num_postings == 0 || pairs[i] >> 32 != pairs[num_postings - 1] >> 32) {
+            num_trigrams++;
+        }
+        pairs[num_postings++] = pairs[i];
+    }
+
+    *size = sizeof(HistoryHeader) + num_entries * sizeof(uint64_t) +
+        num_trigrams * sizeof(HistoryTrigram) + num_postings * sizeof(uint32_t);
+    data = calloc(1, *size);
+    if (data == NULL) {
+        goto build_fail;
+    }
+
+    struct stat st;
+    if (fstat(history.fd, &st) < 0) {
+        goto build_fail;
+    }
+    HistoryHeader *header = (HistoryHeader *) data;
+    memcpy(header->magic, HISTORY_INDEX_MAGIC, sizeof(header->magic));
+    header->dev = st.st_dev;
+    header->ino = st.st_ino;
+    header->covered = covered;
+    header->num_entries = (uint32_t) num_entries;
+    header->num_trigrams = (uint32_t) num_trigrams;
+    header->num_postings = (uint32_t) num_postings;
+
+    memcpy(data + sizeof(HistoryHeader), entries, num_entries * sizeof(uint64_t));
+    HistoryTrigram *trigrams = (HistoryTrigram *) (data + sizeof(HistoryHeader) +
+                                                   num_entries * sizeof(uint64_t));
+    uint32_t *postings = (uint32_t *) (trigrams + num_trigrams);
+    size_t t = 0;
+    for (size_t i = 0; i < num_postings; i++) {
+        uint32_t trigram = (uint32_t) (pairs[i] >> 32);
+        if (i == 0 || trigram != trigrams[t - 1].trigram) {
+            trigrams[t].trigram = trigram;
+            trigrams[t].first = (uint32_t) i;
+            t++;
+        }
+        trigrams[t - 1].count++;
+        postings[i] = (uint32_t) pairs[i];
+    }
+
+    free(entries);
+    free(pairs);
+    return data;
+
+build_fail:
+    free(entries);
+    free(pairs);
+    free(data);
+    return NULL;
+}
+
+/**
+ * Finds the file the index of the history file is kept in.
+ *
+ * @param file Buffer of MAX_PATH_STR bytes for the file name.
+ * @return 0 on success, -1 if there is no usable cache directory.
+ */
+int history_index_file(char *file) {
+    char dir[MAX_PATH_STR];
+    if (cache_dir(dir) < 0) {
+        return -1;
+    }
+    int written = snprintf(file, MAX_PATH_STR, "%s/%s%016" PRIx64, dir,
+                           HISTORY_INDEX_PREFIX, fnv1a_str(FNV_OFFSET, history.path));
+    return written < MAX_PATH_STR ? 0 : -1;
+}
+
+/**
+ * Drops the index this session is using.
+ */
+void release_history_index(void) {
+    if (history.index_mapped) {
+        munmap(history.index, history.index_size);
+    } else {
+        free(history.index);
+    }
+    history.index = NULL;
+    history.index_size = 0;
+    history.index_mapped = false;
+}
+
+/**
+ * Tells whether the index in use leaves few enough entries to scan.
+ */
+bool history_index_is_fresh(void) {
+    if (!history_index_is_valid(history.index, history.index_size)) {
+        return false;
+    }
+    const HistoryHeader *header = (const HistoryHeader *) history.index;
+    return history.size - header->covered <= HISTORY_REINDEX_BYTES;
+}
+
+/**
+ * Makes sure the session has an index that leaves at most
+ * HISTORY_REINDEX_BYTES of the history file to scan: the one it has, the
+ * shared file, or a freshly built one that is then shared. Without any
+ * the whole file is scanned.
+ */
+void ensure_history_index(void) {
+    if (history_index_is_fresh()) {
+        return;
+    }
+    release_history_index();
+
+    char file[MAX_PATH_STR];
+    bool has_file = history_index_file(file) == 0;
+    if (has_file) {
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data != MAP_FAILED) {
+                history.index = data;
+                history.index_size = st.st_size;
+                history.index_mapped = true;
+            }
+        }
+        if (fd >= 0) close(fd);
+        if (history_index_is_fresh()) {
+            return;
+        }
+        release_history_index();
+    }
+
+    if (history.size <= HISTORY_REINDEX_BYTES) {
+        return;
+    }
+    size_t size;
+    char *data = build_history_index(&size);
+    if (data == NULL) {
+        return;
+    }
+    if (has_file) {
+        replace_file(file, data, size);
+    }
+    history.index = data;
+    history.index_size = size;
+}
+
+void close_history(void) {
+    flush_history();
+    release_history_index();
+    if (history.data != NULL) {
+        munmap(history.data, history.size);
+    }
+    history.data = NULL;
+    history.size = 0;
+    if (history.fd >= 0) close(history.fd);
+    history.fd = -1;
+}
+
+/**
+ * Walks the entries of a range of the history file, newest first.
+ *
+ * @param from Where the range starts.
+ * @param to Where it ends, after the newline of its last entry.
+ * @param text Only entries containing it, or NULL for all.
+ * @param out Filled with the starts and ends of the entries found.
+ * @param num_out The number of entries already in out.
+ * @param max_out How many out has room for.
+ * @return The number of entries in out.
+ */
+size_t scan_history(size_t from, size_t to, const char *text, size_t (*out)[2],
+                    size_t num_out, size_t max_out) {
+    size_t end = to;
+    while (end > from && num_out < max_out) {
+        size_t last = end - 1;  // the newline that ends this entry
+        const char *prev = last > from ?
+            memrchr(history.data + from, '\n', last - from) : NULL;
+        size_t start = prev ? (size_t) (prev - history.data) + 1 : from;
+        if (text == NULL || memmem(history.data + start, last - start,
+                                   text, strlen(text)) != NULL) {
+            out[num_out][0] = start;
+            out[num_out][1] = last;
+            num_out++;
+        }
+        end = start;
+    }
+    return num_out;
+}
+
+/**
+ * Finds the entries of the indexed part of the history file that contain
+ * a text of three bytes or more, newest first, through the postings of
+ * its least common trigram.
+ *
+ * @return The number of entries in out, as scan_history.
+ */
+size_t search_history_index(const char *text, size_t (*out)[2], size_t num_out,
+                            size_t max_out) {
+    const HistoryHeader *header = (const HistoryHeader *) history.index;
+    const uint64_t *entries = (const uint64_t *) (history.index + sizeof(HistoryHeader));
+    const HistoryTrigram *trigrams = (const HistoryTrigram *) (entries + header->num_entries);
+    const uint32_t *postings = (const uint32_t *) (trigrams + header->num_trigrams);
+
+    size_t text_len = strlen(text);
+    const HistoryTrigram *rarest = NULL;
+    for (size_t i = 0; i + 3 <= text_len; i++) {
+        uint32_t wanted = history_trigram(text + i);
+        size_t lo = 0, hi = header->num_trigrams;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (trigrams[mid].trigram < wanted) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == header->num_trigrams || trigrams[lo].trigram != wanted) {
+            return num_out;  // no entry has all of the text's trigrams
+        }
+        if (rarest == NULL || trigrams[lo].count < rarest->count) {
+            rarest = &trigrams[lo];
+        }
+    }
+
+    for (uint32_t i = rarest->count; i > 0 && num_out < max_out; i--) {
+        uint32_t entry = postings[rarest->first + i - 1];
+        if (entry >= header->num_entries) continue;
+        size_t start = entries[entry];
+        size_t last = entry + 1 < header->num_entries ? entries[entry + 1] - 1
+                                                      : header->covered - 1;
+        if (memmem(history.data + start, last - start, text, text_len) != NULL) {
+            out[num_out][0] = start;
+            out[num_out][1] = last;
+            num_out++;
+        }
+    }
+    return num_out;
+}
+
+int builtin_history(Command *command, Variable **root, int out_fd) {
+    const char *text = NULL;
+    long count = HISTORY_DEFAULT_COUNT;
+    int arg = 1;
+    if (command->args[arg] != NULL && strcmp(command->args[arg], HISTORY_SEARCH_FLAG) == 0) {
+        text = command->args[arg + 1];
+        if (text == NULL || *text == '\0') {
+            ERR_PRINT(ERR_HISTORY_USAGE);
+            return W_EXITCODE(2, 0);
+        }
+        arg += 2;
+    }
+    if (command->args[arg] != NULL) {
+        char *end;
+        count = strtol(command->args[arg], &end, 10);
+        if (*end != '\0' || count <= 0 || command->args[arg + 1] != NULL) {
+            ERR_PRINT(ERR_HISTORY_USAGE);
+            return W_EXITCODE(2, 0);
+        }
+    }
+    if (history.fd < 0) {
+        ERR_PRINT(ERR_NO_HISTORY);
+        return W_EXITCODE(1, 0);
+    }
+
+    flush_history();
+    if (map_history() < 0) {
+        perror(history.path);
+        return W_EXITCODE(1, 0);
+    }
+    size_t end = history.size;
+    while (end > 0 && history.data[end - 1] != '\n') end--;
+
+    // every entry takes at least its newline, so there are no more than that
+    if ((size_t) count > end) {
+        count = end;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    size_t (*found)[2] = malloc(sizeof(size_t[2]) * count);
+    if (found == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    size_t num_found;
+    if (text == NULL) {
+        num_found = scan_history(0, end, NULL, found, 0, count);
+    } else {
+        ensure_history_index();
+        size_t covered = history.index ? ((HistoryHeader *) history.index)->covered : 0;
+        num_found = scan_history(covered, end, text, found, 0, count);
+        if (covered > 0) {
+            num_found = strlen(text) >= 3 ?
+                search_history_index(text, found, num_found, count) :
+                scan_history(0, covered, text, found, num_found, count);
+        }
+    }
+
+    // a listing reads oldest first, search results newest first
+    for (size_t i = 0; i < num_found; i++) {
+        size_t *entry = found[text == NULL ? num_found - 1 - i : i];
+        dprintf(out_fd, "%.*s\n", (int) (entry[1] - entry[0]), history.data + entry[0]);
+    }
+    free(found);
+    return 0;
+}
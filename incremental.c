@@ -0,0 +1,118 @@
+#include "cscshell.h"
+
+
+/*
+** The state file being written for one run of a script. It is built
+** under a temporary name and renamed over the previous state at the end.
+*/
+struct IncrementalLog {
+    FILE *file;
+    char tmp_path[MAX_PATH_STR];
+    char path[MAX_PATH_STR];
+};
+
+
+/**
+ * Reads the modification time of a file.
+ *
+ * @param path The file.
+ * @param mtime Set to the modification time on success.
+ * @return True if the file exists.
+ */
+bool file_mtime(const char *path, struct timespec *mtime) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return false;
+    }
+    *mtime = st.st_mtim;
+    return true;
+}
+
+/**
+ * Orders two timestamps.
+ *
+ * @return True if a is strictly later than b.
+ */
+bool later_than(struct timespec a, struct timespec b) {
+    return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+int line_is_up_to_date(Command *head) {
+    struct timespec oldest_output = {0}, newest_input = {0}, mtime;
+    bool has_output = false;
+
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next) {
+        // only plain external commands have all their inputs on disk
+        if (cmd->exec_path == NULL || cmd->exec_replace ||
+            find_builtin(cmd->args[0]) || find_function(cmd->args[0]) ||
+            strcmp(cmd->args[0], CD) == 0) {
+            return 0;
+        }
+
+        if (!file_mtime(cmd->exec_path, &mtime)) return 0;
+        if (later_than(mtime, newest_input)) newest_input = mtime;
+
+        if (cmd->redir_in_path != NULL) {
+            if (!file_mtime(cmd->redir_in_path, &mtime)) return 0;
+            if (later_than(mtime, newest_input)) newest_input = mtime;
+        }
+
+        if (cmd->redir_out_path != NULL) {
+            // appending changes the output on every run
+            if (cmd->redir_append || !file_mtime(cmd->redir_out_path, &mtime)) {
+                return 0;
+            }
+            if (!has_output || later_than(oldest_output, mtime)) oldest_output = mtime;
+            has_output = true;
+        }
+    }
+    return has_output && later_than(oldest_output, newest_input);
+}
+
+IncrementalLog *incremental_open(const char *script_path) {
+    IncrementalLog *log = calloc(1, sizeof(IncrementalLog));
+    if (log == NULL) {
+        return NULL;
+    }
+
+    if (snprintf(log->path, sizeof(log->path), "%s%s", script_path,
+                 INCREMENTAL_STATE_SUFFIX) >= (int) sizeof(log->path) ||
+        snprintf(log->tmp_path, sizeof(log->tmp_path), "%s.XXXXXX",
+                 log->path) >= (int) sizeof(log->tmp_path)) {
+        free(log);
+        return NULL;
+    }
+
+    int fd = mkostemp(log->tmp_path, O_CLOEXEC);
+    if (fd < 0 || (log->file = fdopen(fd, "w")) == NULL) {
+        perror("incremental");
+        if (fd >= 0) {
+            close(fd);
+            unlink(log->tmp_path);
+        }
+        free(log);
+        return NULL;
+    }
+    fprintf(log->file, "# cscshell incremental state for %s\n", script_path);
+    return log;
+}
+
+void incremental_note(IncrementalLog *log, size_t line_no, int ran, int status,
+                      const char *line, size_t line_len) {
+    if (log == NULL) return;
+    while (line_len > 0 && (*line == ' ' || *line == '\t')) {
+        line++;
+        line_len--;
+    }
+    fprintf(log->file, "%zu\t%s\t%d\t%.*s\n", line_no,
+            ran ? INCREMENTAL_RAN : INCREMENTAL_SKIPPED, status, (int) line_len, line);
+}
+
+void incremental_close(IncrementalLog *log) {
+    if (log == NULL) return;
+    if (fclose(log->file) != 0 || rename(log->tmp_path, log->path) < 0) {
+        perror("incremental");
+        unlink(log->tmp_path);
+    }
+    free(log);
+}
@@ -0,0 +1,306 @@
+#include "cscshell.h"
+#include <signal.h>
+
+
+/*
+** A pipeline that was stopped from the terminal or continued in the
+** background. Its stages keep their order; a reaped one has pid 0, as
+** do its builtin stages, whose threads stay in stages until they are
+** finished, and the rings between them stay until the job is done.
+*/
+typedef struct Job {
+    int id;
+    pid_t pgid;
+    pid_t *pids;
+    int *statuses;
+    StageThread **stages;
+    int num_pids;
+    StageRing **rings;
+    int num_rings;
+    char *text;
+    bool stopped;
+    struct termios modes;
+    struct Job *next;
+} Job;
+
+// Jobs by id, most recent first
+static Job *jobs = NULL;
+
+// The shell's own group and terminal modes, restored after every job
+static pid_t shell_pgid;
+static struct termios shell_modes;
+
+// Signals the shell ignores and its jobs get back
+static const int job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+#define NUM_JOB_SIGNALS (sizeof(job_signals) / sizeof(job_signals[0]))
+
+
+int init_job_control(void) {
+    if (!isatty(STDIN_FILENO)) {
+        return -1;
+    }
+
+    // wait until the shell is in the foreground of its terminal
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+        kill(-shell_pgid, SIGTTIN);
+    }
+
+    for (size_t i = 0; i < NUM_JOB_SIGNALS; i++) {
+        signal(job_signals[i], SIG_IGN);
+    }
+
+    // a group of its own, so that stopping a job never stops the shell
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid && setpgid(shell_pgid, shell_pgid) < 0) {
+        perror("setpgid");
+        return -1;
+    }
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_modes);
+    shell_options.job_control = 1;
+    return 0;
+}
+
+void enter_job(void) {
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    for (size_t i = 0; i < NUM_JOB_SIGNALS; i++) {
+        signal(job_signals[i], SIG_DFL);
+    }
+}
+
+void give_terminal(pid_t pgid) {
+    tcsetpgrp(STDIN_FILENO, pgid);
+}
+
+void take_terminal(struct termios *job_modes) {
+    if (job_modes != NULL) {
+        tcgetattr(STDIN_FILENO, job_modes);
+    }
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_modes);
+}
+
+/**
+ * Describes a pipeline the way the user typed it, for job messages.
+ *
+ * @param head The pipeline.
+ * @return A new heap string.
+ */
+char *describe_pipeline(Command *head) {
+    size_t len = 1;
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next) {
+        for (int i = 0; cmd->args[i] != NULL; i++) len += strlen(cmd->args[i]) + 1;
+        len += 2;
+    }
+    char *text = malloc(len);
+    if (text == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    text[0] = '\0';
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next) {
+        for (int i = 0; cmd->args[i] != NULL; i++) {
+            if (i > 0) strcat(text, " ");
+            strcat(text, cmd->args[i]);
+        }
+        if (cmd->next != NULL) strcat(text, " | ");
+    }
+    return text;
+}
+
+int suspend_job(Command *head, pid_t pgid, pid_t *pids, int *statuses,
+                StageThread **stages, int num_pids, StageRing **rings, int num_rings,
+                struct termios *modes) {
+    Job *job = calloc(1, sizeof(Job));
+    if (job == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    job->id = jobs ? jobs->id + 1 : 1;
+    job->pgid = pgid;
+    job->pids = malloc(sizeof(pid_t) * num_pids);
+    job->statuses = malloc(sizeof(int) * num_pids);
+    job->stages = malloc(sizeof(StageThread *) * num_pids);
+    job->rings = malloc(sizeof(StageRing *) * (num_rings + 1));
+    if (job->pids == NULL || job->statuses == NULL || job->stages == NULL ||
+        job->rings == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(job->pids, pids, sizeof(pid_t) * num_pids);
+    memcpy(job->statuses, statuses, sizeof(int) * num_pids);
+    memcpy(job->stages, stages, sizeof(StageThread *) * num_pids);
+    memcpy(job->rings, rings, sizeof(StageRing *) * num_rings);
+    job->num_pids = num_pids;
+    job->num_rings = num_rings;
+    job->text = describe_pipeline(head);
+    job->stopped = true;
+    job->modes = *modes;
+    job->next = jobs;
+    jobs = job;
+
+    printf("\n[%d]+  %-10s %s\n", job->id, JOB_STOPPED, job->text);
+    return job->id;
+}
+
+/**
+ * Unlinks a job from the table and frees it, once all its stages have
+ * finished.
+ */
+void remove_job(Job *job) {
+    for (Job **link = &jobs; *link; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            break;
+        }
+    }
+    for (int i = 0; i < job->num_rings; i++) {
+        stage_ring_free(job->rings[i]);
+    }
+    free(job->rings);
+    free(job->stages);
+    free(job->pids);
+    free(job->statuses);
+    free(job->text);
+    free(job);
+}
+
+void reap_jobs(void) {
+    Job *job = jobs;
+    while (job != NULL) {
+        Job *next = job->next;
+        int remaining = 0, status;
+        for (int i = 0; i < job->num_pids; i++) {
+            if (job->stages[i] != NULL) {
+                // a builtin stage is reaped by joining it, once it returned
+                if (stage_finished(job->stages[i])) {
+                    job->statuses[i] = finish_stage(job->stages[i]);
+                    job->stages[i] = NULL;
+                } else {
+                    remaining++;
+                }
+                continue;
+            }
+            if (job->pids[i] == 0) continue;
+            pid_t pid = waitpid(job->pids[i], &status, WNOHANG | WUNTRACED);
+            if (pid == job->pids[i] && WIFSTOPPED(status)) {
+                if (!job->stopped) {
+                    job->stopped = true;
+                    printf("[%d]+  %-10s %s\n", job->id, JOB_STOPPED, job->text);
+                }
+                remaining++;
+            } else if (pid == job->pids[i] || (pid < 0 && errno == ECHILD)) {
+                job->statuses[i] = pid > 0 ? status : 0;
+                stats_child_reaped(job->pids[i]);
+                job->pids[i] = 0;
+            } else {
+                remaining++;
+            }
+        }
+        if (remaining == 0) {
+            printf("[%d]+  %-10s %s\n", job->id, JOB_DONE, job->text);
+            remove_job(job);
+        }
+        job = next;
+    }
+}
+
+/**
+ * Finds the job a fg or bg argument names: "%N" or "N", or the most
+ * recent job without one.
+ *
+ * @param arg The argument, or NULL.
+ * @return The job, or NULL with an error printed.
+ */
+Job *find_job(const char *arg) {
+    if (arg == NULL) {
+        if (jobs == NULL) {
+            ERR_PRINT(ERR_NO_JOB, "current");
+        }
+        return jobs;
+    }
+    const char *id = arg[0] == '%' ? arg + 1 : arg;
+    char *end;
+    long wanted = strtol(id, &end, 10);
+    for (Job *job = jobs; job != NULL && *end == '\0'; job = job->next) {
+        if (job->id == wanted) return job;
+    }
+    ERR_PRINT(ERR_NO_JOB, arg);
+    return NULL;
+}
+
+/**
+ * Checks that fg and bg can be used at all.
+ */
+bool job_control_usable(const char *builtin) {
+    if (!shell_options.job_control) {
+        ERR_PRINT(ERR_NO_JOB_CONTROL, builtin);
+        return false;
+    }
+    return true;
+}
+
+int builtin_fg(Command *command, Variable **root, int out_fd) {
+    if (!job_control_usable(FG_BUILTIN)) {
+        return W_EXITCODE(1, 0);
+    }
+    Job *job = find_job(command->args[1]);
+    if (job == NULL) {
+        return W_EXITCODE(1, 0);
+    }
+
+    dprintf(out_fd, "%s\n", job->text);
+    give_terminal(job->pgid);
+    if (job->stopped) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &job->modes);
+    }
+    kill(-job->pgid, SIGCONT);
+    job->stopped = false;
+
+    PipelineWait wait = {0};
+    wait.pgid = job->pgid;
+    wait.untraced = true;
+    wait.in_order_failures = shell_options.pipefail;
+    int status = wait_pipeline(job->pids, job->statuses, job->num_pids, &wait);
+    take_terminal(wait.stopped ? &job->modes : NULL);
+
+    if (wait.stopped) {
+        job->stopped = true;
+        printf("\n[%d]+  %-10s %s\n", job->id, JOB_STOPPED, job->text);
+        return status;
+    }
+    // its builtin stages finish once their neighbours have
+    wait.first_failed = finish_stages(job->stages, job->statuses, job->num_pids,
+                                      wait.first_failed);
+    status = job->statuses[job->num_pids - 1];
+    if (shell_options.pipefail && wait.first_failed >= 0) {
+        status = job->statuses[wait.first_failed];
+    }
+    remove_job(job);
+    return status;
+}
+
+int builtin_bg(Command *command, Variable **root, int out_fd) {
+    if (!job_control_usable(BG_BUILTIN)) {
+        return W_EXITCODE(1, 0);
+    }
+    Job *job = find_job(command->args[1]);
+    if (job == NULL) {
+        return W_EXITCODE(1, 0);
+    }
+
+    kill(-job->pgid, SIGCONT);
+    job->stopped = false;
+    dprintf(out_fd, "[%d]+ %s &\n", job->id, job->text);
+    return 0;
+}
+
+int builtin_jobs(Command *command, Variable **root, int out_fd) {
+    // oldest first, as other shells list them
+    int count = 0;
+    for (Job *job = jobs; job != NULL; job = job->next) count++;
+    for (int shown = count; shown > 0; shown--) {
+        Job *job = jobs;
+        for (int i = 1; i < shown; i++) job = job->next;
+        dprintf(out_fd, "[%d]%c  %-10s %s\n", job->id, job == jobs ? '+' : ' ',
+                job->stopped ? JOB_STOPPED : JOB_RUNNING, job->text);
+    }
+    return 0;
+}
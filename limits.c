@@ -0,0 +1,343 @@
+#include "cscshell.h"
+#include <ctype.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// From linux/ioprio.h, which is not always installed
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+
+/*
+** A resource limits can be set for, with the name `limit -r` knows it by,
+** the option `ulimit` knows it by, and the unit values are given in.
+*/
+typedef struct LimitResource {
+    const char *name;
+    char flag;
+    int resource;
+    rlim_t unit;
+} LimitResource;
+
+static const LimitResource resources[] = {
+    {"core", 'c', RLIMIT_CORE, 1024},
+    {"data", 'd', RLIMIT_DATA, 1024},
+    {"fsize", 'f', RLIMIT_FSIZE, 1024},
+    {"memlock", 'l', RLIMIT_MEMLOCK, 1024},
+    {"nofile", 'n', RLIMIT_NOFILE, 1},
+    {"stack", 's', RLIMIT_STACK, 1024},
+    {"cpu", 't', RLIMIT_CPU, 1},
+    {"nproc", 'u', RLIMIT_NPROC, 1},
+    {"as", 'v', RLIMIT_AS, 1024},
+    {NULL, 0, 0, 0}
+};
+
+// I/O scheduling classes, by the names ionice(1) accepts
+static const struct {
+    const char *name;
+    int class;
+    int level;
+} io_classes[] = {
+    {"none", 0, 0},
+    {"rt", 1, 4},
+    {"realtime", 1, 4},
+    {"be", 2, 4},
+    {"best-effort", 2, 4},
+    {"idle", 3, 0},
+    {NULL, 0, 0}
+};
+
+
+/**
+ * Parses a limit value in a resource's unit, or "unlimited".
+ *
+ * @param str The value.
+ * @param unit Bytes per unit of the resource.
+ * @param value Set to the value in the resource's own terms.
+ * @return True if the value is valid.
+ */
+bool parse_limit_value(const char *str, rlim_t unit, rlim_t *value) {
+    if (strcmp(str, LIMIT_UNLIMITED) == 0) {
+        *value = RLIM_INFINITY;
+        return true;
+    }
+    if (!isdigit((unsigned char)*str)) {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(str, &end, 10);
+    if (errno != 0 || *end != '\0' || parsed > (RLIM_INFINITY - 1) / unit) {
+        return false;
+    }
+    *value = (rlim_t) parsed * unit;
+    return true;
+}
+
+/**
+ * Parses a CPU list such as "0-3,6" into a set.
+ *
+ * @param str The list.
+ * @param cpus The set to fill.
+ * @return True if the list is valid.
+ */
+bool parse_cpu_list(const char *str, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    while (*str) {
+        char *end;
+        long first = strtol(str, &end, 10), last = first;
+        if (end == str) return false;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str) return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, cpus);
+
+        if (*end == ',') end++;
+        else if (*end != '\0') return false;
+        str = end;
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+/**
+ * Parses an I/O class such as "idle" or "be:7" into an ioprio value.
+ *
+ * @param str The class, with an optional level.
+ * @param ioprio Set to the ioprio value.
+ * @return True if the class is valid.
+ */
+bool parse_io_class(const char *str, int *ioprio) {
+    size_t name_len = strcspn(str, ":");
+    for (int i = 0; io_classes[i].name != NULL; i++) {
+        if (strlen(io_classes[i].name) != name_len ||
+            strncmp(io_classes[i].name, str, name_len) != 0) {
+            continue;
+        }
+        long level = io_classes[i].level;
+        if (str[name_len] == ':') {
+            char *end;
+            level = strtol(str + name_len + 1, &end, 10);
+            if (end == str + name_len + 1 || *end != '\0' || level < 0 || level > 7) {
+                return false;
+            }
+        }
+        *ioprio = (io_classes[i].class << IOPRIO_CLASS_SHIFT) | (int) level;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Parses NAME=SOFT[:HARD] into one more resource limit.
+ *
+ * @param str The limit.
+ * @param limits The limits to add it to.
+ * @return True if the limit is valid.
+ */
+bool parse_rlimit(const char *str, ProcLimits *limits) {
+    const char *value = strchr(str, '=');
+    if (value == NULL || limits->num_rlimits == MAX_RLIMITS) {
+        return false;
+    }
+    for (int i = 0; resources[i].name != NULL; i++) {
+        if (strlen(resources[i].name) != (size_t) (value - str) ||
+            strncmp(resources[i].name, str, value - str) != 0) {
+            continue;
+        }
+
+        char soft[MAX_USER_BUF];
+        const char *hard = strchr(++value, ':');
+        size_t soft_len = hard ? (size_t) (hard - value) : strlen(value);
+        if (soft_len >= sizeof(soft)) return false;
+        memcpy(soft, value, soft_len);
+        soft[soft_len] = '\0';
+
+        struct rlimit *limit = &limits->rlimits[limits->num_rlimits];
+        if (!parse_limit_value(soft, resources[i].unit, &limit->rlim_cur) ||
+            !parse_limit_value(hard ? hard + 1 : soft, resources[i].unit,
+                               &limit->rlim_max)) {
+            return false;
+        }
+        limits->rlimit_resources[limits->num_rlimits++] = resources[i].resource;
+        return true;
+    }
+    return false;
+}
+
+int parse_limit_prefix(Command *cmd) {
+    if (cmd->limits == NULL) {
+        cmd->limits = calloc(1, sizeof(ProcLimits));
+        if (cmd->limits == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    ProcLimits *limits = cmd->limits;
+
+    int idx = 1;
+    while (cmd->args[idx] != NULL && cmd->args[idx][0] == '-') {
+        const char *flag = cmd->args[idx], *value = cmd->args[idx + 1];
+        if (value == NULL || flag[1] == '\0' || flag[2] != '\0') {
+            return -1;
+        }
+
+        bool ok;
+        switch (flag[1]) {
+        case LIMIT_CPUS_FLAG:
+            ok = parse_cpu_list(value, &limits->cpus);
+            limits->has_cpus = 1;
+            break;
+        case LIMIT_NICE_FLAG: {
+            char *end;
+            long increment = strtol(value, &end, 10);
+            ok = end != value && *end == '\0' && increment >= -40 && increment <= 40;
+            limits->nice = (int) increment;
+            limits->has_nice = 1;
+            break;
+        }
+        case LIMIT_IO_FLAG:
+            ok = parse_io_class(value, &limits->ioprio);
+            limits->has_ioprio = 1;
+            break;
+        case LIMIT_RLIMIT_FLAG:
+            ok = parse_rlimit(value, limits);
+            break;
+        default:
+            ok = false;
+        }
+        if (!ok) {
+            return -1;
+        }
+        idx += 2;
+    }
+    return idx;
+}
+
+int apply_limits(const ProcLimits *limits) {
+    if (limits->has_cpus &&
+        sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) < 0) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+
+    if (limits->has_nice) {
+        errno = 0;
+        if (nice(limits->nice) == -1 && errno != 0) {
+            perror("nice");
+            return -1;
+        }
+    }
+
+    if (limits->has_ioprio) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, limits->ioprio) < 0) {
+            perror("ioprio_set");
+            return -1;
+        }
+#else
+        errno = ENOSYS;
+        perror("ioprio_set");
+        return -1;
+#endif
+    }
+
+    for (int i = 0; i < limits->num_rlimits; i++) {
+        if (setrlimit(limits->rlimit_resources[i], &limits->rlimits[i]) < 0) {
+            perror("setrlimit");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes one limit the way ulimit shows it.
+ *
+ * @param out_fd Where to write.
+ * @param value The limit.
+ * @param unit Bytes per unit of the resource.
+ */
+void print_limit_value(int out_fd, rlim_t value, rlim_t unit) {
+    if (value == RLIM_INFINITY) {
+        dprintf(out_fd, "%s\n", LIMIT_UNLIMITED);
+    } else {
+        dprintf(out_fd, "%llu\n", (unsigned long long) (value / unit));
+    }
+}
+
+int builtin_ulimit(Command *command, Variable **root, int out_fd) {
+    const LimitResource *chosen = NULL, *fallback = NULL;
+    bool soft = false, hard = false, all = false;
+
+    int idx = 1;
+    for (; command->args[idx] != NULL && command->args[idx][0] == '-'; idx++) {
+        for (const char *flag = command->args[idx] + 1; *flag; flag++) {
+            if (*flag == 'S') {
+                soft = true;
+            } else if (*flag == 'H') {
+                hard = true;
+            } else if (*flag == 'a') {
+                all = true;
+            } else {
+                chosen = NULL;
+                for (int i = 0; resources[i].name != NULL; i++) {
+                    if (resources[i].flag == *flag) chosen = &resources[i];
+                }
+                if (chosen == NULL) {
+                    ERR_PRINT(ERR_ULIMIT_USAGE);
+                    return W_EXITCODE(2, 0);
+                }
+            }
+        }
+    }
+    const char *value = command->args[idx];
+    if ((value != NULL && (all || command->args[idx + 1] != NULL))) {
+        ERR_PRINT(ERR_ULIMIT_USAGE);
+        return W_EXITCODE(2, 0);
+    }
+    for (int i = 0; chosen == NULL && resources[i].name != NULL; i++) {
+        if (resources[i].flag == ULIMIT_DEFAULT_FLAG) fallback = &resources[i];
+    }
+    if (chosen == NULL) {
+        chosen = fallback;
+    }
+
+    struct rlimit limit;
+    if (value == NULL) {
+        for (int i = 0; resources[i].name != NULL; i++) {
+            if (!all && &resources[i] != chosen) continue;
+            if (getrlimit(resources[i].resource, &limit) < 0) {
+                perror("ulimit");
+                return W_EXITCODE(1, 0);
+            }
+            if (all) {
+                dprintf(out_fd, "%-8s (-%c) ", resources[i].name, resources[i].flag);
+            }
+            print_limit_value(out_fd, hard && !soft ? limit.rlim_max : limit.rlim_cur,
+                              resources[i].unit);
+        }
+        return 0;
+    }
+
+    rlim_t new_limit;
+    if (!parse_limit_value(value, chosen->unit, &new_limit)) {
+        ERR_PRINT(ERR_ULIMIT_USAGE);
+        return W_EXITCODE(2, 0);
+    }
+    if (getrlimit(chosen->resource, &limit) < 0) {
+        perror("ulimit");
+        return W_EXITCODE(1, 0);
+    }
+    // like other shells, neither -S nor -H sets both
+    if (soft || !hard) limit.rlim_cur = new_limit;
+    if (hard || !soft) limit.rlim_max = new_limit;
+    if (setrlimit(chosen->resource, &limit) < 0) {
+        perror("ulimit");
+        return W_EXITCODE(1, 0);
+    }
+    return 0;
+}
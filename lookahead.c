@@ -0,0 +1,222 @@
+#include "cscshell.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+
+/*
+** One line handed from the reader thread to the script thread, split
+** into stages and words but not expanded or resolved: what those give
+** depends on everything before the line having run. Assignments and
+** function definitions have no tokens and are parsed from their text.
+**
+** end: the reader has stopped; nothing follows.
+*/
+typedef struct ScriptItem {
+    ParsedLine *tokens;
+    char *line;
+    size_t len;
+    size_t line_no;
+    uint8_t last;
+    uint8_t end;
+} ScriptItem;
+
+/*
+** A single-producer single-consumer ring. Only the reader thread moves
+** tail and only the script thread moves head, so handing over an item is
+** one store of tail. The semaphores are only touched when a side has to
+** sleep because the ring is empty or full.
+*/
+typedef struct Lookahead {
+    ScriptItem ring[LOOKAHEAD_QUEUE_DEPTH];
+    size_t head;
+    size_t tail;
+    int reader_sleeping;
+    int runner_sleeping;
+    sem_t space;
+    sem_t items;
+    int stopping;
+    ScriptReader *reader;
+    Variable **root;
+} Lookahead;
+
+
+/**
+ * Sleeps while an index of the ring still has a given value. The other
+ * side clears *sleeping and posts sem after moving the index, and a
+ * stale post only costs an extra check.
+ *
+ * @param index The index the other side moves.
+ * @param value The value to wait out.
+ * @param sleeping Flag telling the other side to post sem.
+ * @param sem The semaphore to sleep on.
+ */
+void wait_while_index(size_t *index, size_t value, int *sleeping, sem_t *sem) {
+    while (__atomic_load_n(index, __ATOMIC_ACQUIRE) == value) {
+        __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value) {
+            while (sem_wait(sem) < 0 && errno == EINTR);
+        }
+        __atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Wakes the other side of the ring if it went to sleep.
+ */
+void wake_peer(int *sleeping, sem_t *sem) {
+    if (__atomic_exchange_n(sleeping, 0, __ATOMIC_SEQ_CST)) {
+        sem_post(sem);
+    }
+}
+
+/**
+ * Adds an item to the ring, sleeping while it is full. Reader side only.
+ */
+void ring_push(Lookahead *la, ScriptItem *item) {
+    size_t tail = la->tail;
+    if (tail - __atomic_load_n(&la->head, __ATOMIC_ACQUIRE) == LOOKAHEAD_QUEUE_DEPTH) {
+        wait_while_index(&la->head, tail - LOOKAHEAD_QUEUE_DEPTH,
+                         &la->reader_sleeping, &la->space);
+    }
+    la->ring[tail % LOOKAHEAD_QUEUE_DEPTH] = *item;
+    __atomic_store_n(&la->tail, tail + 1, __ATOMIC_SEQ_CST);
+    wake_peer(&la->runner_sleeping, &la->items);
+}
+
+/**
+ * Takes the oldest item from the ring, sleeping while it is empty.
+ * Script thread side only.
+ */
+void ring_pop(Lookahead *la, ScriptItem *item) {
+    size_t head = la->head;
+    wait_while_index(&la->tail, head, &la->runner_sleeping, &la->items);
+    *item = la->ring[head % LOOKAHEAD_QUEUE_DEPTH];
+    __atomic_store_n(&la->head, head + 1, __ATOMIC_SEQ_CST);
+    wake_peer(&la->reader_sleeping, &la->space);
+}
+
+/**
+ * Tells whether a line changes how later lines parse as it is parsed,
+ * so it has to go through parse_line from its text.
+ *
+ * @param line The raw line.
+ * @return True for assignments and the start of function definitions.
+ */
+bool parsed_from_text(const char *line) {
+    while (isspace((unsigned char)*line)) line++;
+    return is_function_definition(line) || is_assignment(line);
+}
+
+/**
+ * The reader thread: reads and tokenizes lines ahead of the script
+ * thread.
+ *
+ * @param arg The Lookahead shared with the script thread.
+ * @return NULL.
+ */
+void *read_ahead(void *arg) {
+    Lookahead *la = arg;
+    const char *line;
+    ssize_t len;
+
+    while (!__atomic_load_n(&la->stopping, __ATOMIC_ACQUIRE) &&
+           (len = next_script_line(la->reader, &line)) != -1) {
+        // the script thread gets its own copy of the line, all of it
+        ScriptItem item = {0};
+        item.line = malloc(len + 1);
+        if (item.line == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        memcpy(item.line, line, len);
+        item.line[len] = '\0';
+        item.len = len;
+        if (script_line_cut(la->reader, line, len)) {
+            free(item.line);
+            break;
+        }
+        if (!parsed_from_text(item.line)) {
+            item.tokens = tokenize_line(item.line, len);
+            if (item.tokens == (ParsedLine *) -1) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        item.line_no = la->reader->line_no;
+        item.last = script_reader_at_end(la->reader);
+        ring_push(la, &item);
+    }
+
+    ScriptItem end = {0};
+    end.end = 1;
+    ring_push(la, &end);
+    return NULL;
+}
+
+/**
+ * Parses a line handed over by the reader thread, now that every line
+ * before it has run. Lines inside a function definition go to it as
+ * text, as they would in run_script.
+ *
+ * @param item The line.
+ * @param root Pointer to the head of the variables list.
+ * @return As parse_line.
+ */
+Command *parse_item(ScriptItem *item, Variable **root) {
+    if (item->tokens == NULL || function_definition_pending()) {
+        return parse_line(item->line, root);
+    }
+
+    uint64_t started = stats_now();
+    Command *commands = prepare_line_cached(item->tokens, root);
+    stats_add(STAT_LINES_PARSED, 1);
+    stats_record(HIST_PARSE_LINE, stats_now() - started);
+    return commands;
+}
+
+int run_script_pipelined(ScriptReader *reader, bool tail_exec, IncrementalLog *log,
+                         Variable **root) {
+    Lookahead *la = calloc(1, sizeof(Lookahead));
+    if (la == NULL) {
+        return -1;
+    }
+    la->reader = reader;
+    la->root = root;
+
+    // created now, so the script thread only ever updates it in place
+    if (find_variable(*root, PIPESTATUS_VAR) == NULL) {
+        set_pipestatus(root, "0");
+    }
+    sem_init(&la->space, 0, 0);
+    sem_init(&la->items, 0, 0);
+
+    pthread_t reader_thread;
+    int err = pthread_create(&reader_thread, NULL, read_ahead, la);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create");
+        free(la);
+        return -1;
+    }
+
+    int ret = 0;
+    ScriptItem item;
+    for (ring_pop(la, &item); !item.end; ring_pop(la, &item)) {
+        if (ret == 0) {
+            Command *commands = parse_item(&item, root);
+            if (run_script_line(commands, item.line, item.len,
+                                item.line_no, tail_exec && item.last, log, root) < 0) {
+                // Stop as soon as any line fails, dropping what was read ahead
+                ret = -1;
+                __atomic_store_n(&la->stopping, 1, __ATOMIC_RELEASE);
+            }
+        }
+        free_parsed_line(item.tokens, 0);
+        free(item.line);
+    }
+
+    pthread_join(reader_thread, NULL);
+    sem_destroy(&la->space);
+    sem_destroy(&la->items);
+    free(la);
+    return ret;
+}
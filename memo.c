@@ -0,0 +1,427 @@
+#include "cscshell.h"
+
+extern char **environ;
+
+/*
+** Everything a cached command is keyed on, as bytes. The key file is
+** named after their hash and holds them after the name of the output's
+** blob, so a hit is only taken when they are all the same.
+*/
+typedef struct MemoKey {
+    char *data;
+    size_t len;
+    size_t cap;
+    uint64_t hash;
+} MemoKey;
+
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// the terminator is included so that ("ab", "c") and ("a", "bc") differ
+uint64_t fnv1a_str(uint64_t hash, const char *str) {
+    return fnv1a(hash, str, strlen(str) + 1);
+}
+
+/**
+ * Appends bytes to a key.
+ *
+ * @param key The key.
+ * @param data The bytes.
+ * @param len How many there are.
+ */
+void key_append(MemoKey *key, const void *data, size_t len) {
+    if (key->len + len > key->cap) {
+        key->cap = (key->len + len) * 2;
+        key->data = realloc(key->data, key->cap);
+        if (key->data == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(key->data + key->len, data, len);
+    key->len += len;
+}
+
+// the terminator is included so that ("ab", "c") and ("a", "bc") differ
+void key_append_str(MemoKey *key, const char *str) {
+    key_append(key, str, strlen(str) + 1);
+}
+
+/**
+ * Appends the identity of a file (device, inode, size and modification
+ * time) to a key. A missing file is keyed as such.
+ */
+void key_append_file(MemoKey *key, const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        key_append_str(key, "<missing>");
+        return;
+    }
+    uint64_t fields[] = {
+        st.st_dev, st.st_ino, st.st_size,
+        st.st_mtim.tv_sec, st.st_mtim.tv_nsec
+    };
+    key_append(key, fields, sizeof(fields));
+}
+
+/**
+ * Builds the key a cached command is stored under: the executable and
+ * its file identity, the arguments, the environment, the working
+ * directory, and the identity of the input file.
+ *
+ * @param command The command.
+ * @param key Set to the key, to be freed by the caller.
+ */
+void memo_key(Command *command, MemoKey *key) {
+    memset(key, 0, sizeof(MemoKey));
+    key_append_str(key, command->exec_path);
+    key_append_file(key, command->exec_path);
+
+    for (int i = 0; command->args[i] != NULL; i++) {
+        key_append_str(key, command->args[i]);
+    }
+    key_append_str(key, "<env>");
+    for (char **env = environ; *env != NULL; env++) {
+        key_append_str(key, *env);
+    }
+
+    char cwd[MAX_PATH_STR];
+    key_append_str(key, getcwd(cwd, sizeof(cwd)) ? cwd : "<no cwd>");
+
+    if (command->redir_in_path != NULL) {
+        key_append_str(key, command->redir_in_path);
+        key_append_file(key, command->redir_in_path);
+    }
+    key->hash = fnv1a(FNV_OFFSET, key->data, key->len);
+}
+
+/**
+ * Creates a directory and any missing parents.
+ *
+ * @param path The directory to create.
+ * @return 0 on success, -1 on error.
+ */
+int make_dirs(const char *path) {
+    char buf[MAX_PATH_STR];
+    if (snprintf(buf, sizeof(buf), "%s", path) >= (int) sizeof(buf)) {
+        return -1;
+    }
+    for (char *ptr = buf + 1; *ptr; ptr++) {
+        if (*ptr != '/') continue;
+        *ptr = '\0';
+        if (mkdir(buf, 0755) < 0 && errno != EEXIST) return -1;
+        *ptr = '/';
+    }
+    return (mkdir(buf, 0755) < 0 && errno != EEXIST) ? -1 : 0;
+}
+
+int cache_dir(char *dir) {
+    const char *base = getenv(MEMO_DIR_ENV);
+    int written;
+    if (base != NULL && *base) {
+        written = snprintf(dir, MAX_PATH_STR, "%s", base);
+    } else if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base) {
+        written = snprintf(dir, MAX_PATH_STR, "%s/%s", base, MEMO_SUBDIR);
+    } else if ((base = getenv("HOME")) != NULL && *base) {
+        written = snprintf(dir, MAX_PATH_STR, "%s/.cache/%s", base, MEMO_SUBDIR);
+    } else {
+        return -1;
+    }
+    if (written >= MAX_PATH_STR - 32) {
+        return -1;
+    }
+    return make_dirs(dir);
+}
+
+/**
+ * Finds the cache directory, creating its keys/ and blobs/ directories.
+ *
+ * @param dir Buffer of MAX_PATH_STR bytes for the directory.
+ * @return 0 on success, -1 if there is no usable cache directory.
+ */
+int memo_dir(char *dir) {
+    if (cache_dir(dir) < 0) {
+        return -1;
+    }
+
+    char sub[MAX_PATH_STR];
+    snprintf(sub, sizeof(sub), "%s/keys", dir);
+    if (make_dirs(sub) < 0) return -1;
+    snprintf(sub, sizeof(sub), "%s/blobs", dir);
+    return make_dirs(sub);
+}
+
+/**
+ * Copies everything from one fd to another.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int copy_fd(int from, int to) {
+    char buf[MEMO_COPY_BUF];
+    ssize_t nread;
+    while ((nread = read(from, buf, sizeof(buf))) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (write_all(to, buf, nread) < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads exactly len bytes from a file, or fewer at its end.
+ *
+ * @return The number of bytes read, or -1 on error.
+ */
+ssize_t read_full(int fd, char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t nread = read(fd, buf + done, len - done);
+        if (nread < 0 && errno == EINTR) continue;
+        if (nread < 0) return -1;
+        if (nread == 0) break;
+        done += nread;
+    }
+    return done;
+}
+
+/**
+ * Checks that a key file was written for exactly this key, and not for
+ * another one with the same hash.
+ *
+ * @param key_fd The key file, positioned after the blob name.
+ * @param key The command's key.
+ * @return True if the rest of the file is the key.
+ */
+bool key_matches(int key_fd, const MemoKey *key) {
+    struct stat st;
+    if (fstat(key_fd, &st) < 0 || (size_t) st.st_size != MEMO_HASH_HEX + key->len) {
+        return false;
+    }
+    char *stored = malloc(key->len + 1);
+    if (stored == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    bool same = read_full(key_fd, stored, key->len) == (ssize_t) key->len &&
+        memcmp(stored, key->data, key->len) == 0;
+    free(stored);
+    return same;
+}
+
+/**
+ * Replays a cached output if the key has one.
+ *
+ * @param dir The cache directory.
+ * @param key The command's key.
+ * @param out_fd Where the output goes.
+ * @return 1 on a hit, 0 on a miss.
+ */
+int replay_cached(const char *dir, const MemoKey *key, int out_fd) {
+    char path[MAX_PATH_STR];
+    snprintf(path, sizeof(path), "%s/keys/%016" PRIx64, dir, key->hash);
+
+    char blob[MEMO_HASH_HEX + 1] = {0};
+    int key_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (key_fd < 0) {
+        return 0;
+    }
+    bool found = read_full(key_fd, blob, MEMO_HASH_HEX) == MEMO_HASH_HEX &&
+        key_matches(key_fd, key);
+    close(key_fd);
+    if (!found) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/blobs/%s", dir, blob);
+    int blob_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (blob_fd < 0) {
+        return 0;
+    }
+    int copied = copy_fd(blob_fd, out_fd);
+    close(blob_fd);
+    return copied == 0;
+}
+
+/**
+ * Compares the contents of two files.
+ *
+ * @return True if both could be read and are the same.
+ */
+bool same_contents(const char *path, const char *other_path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int other_fd = open(other_path, O_RDONLY | O_CLOEXEC);
+    struct stat st, other_st;
+    bool same = fd >= 0 && other_fd >= 0 && fstat(fd, &st) == 0 &&
+        fstat(other_fd, &other_st) == 0 && st.st_size == other_st.st_size;
+
+    char buf[MEMO_COPY_BUF / 2], other_buf[MEMO_COPY_BUF / 2];
+    ssize_t nread = 0;
+    while (same && (nread = read_full(fd, buf, sizeof(buf))) > 0) {
+        same = read_full(other_fd, other_buf, nread) == nread &&
+            memcmp(buf, other_buf, nread) == 0;
+    }
+    same = same && nread == 0;
+    if (fd >= 0) close(fd);
+    if (other_fd >= 0) close(other_fd);
+    return same;
+}
+
+/**
+ * Stores a finished output under its content hash and points the key
+ * at it. The blob is linked in, so one already there is never replaced,
+ * and is only shared when its contents are the same; the key goes
+ * through rename. Readers never see partial files.
+ *
+ * @param dir The cache directory.
+ * @param key The command's key.
+ * @param tmp_path The temporary file holding the output.
+ * @param content The hash of the output.
+ */
+void store_cached(const char *dir, const MemoKey *key, const char *tmp_path,
+                  uint64_t content) {
+    char blob_path[MAX_PATH_STR], key_path[MAX_PATH_STR], key_tmp[MAX_PATH_STR];
+    snprintf(blob_path, sizeof(blob_path), "%s/blobs/%016" PRIx64, dir, content);
+    bool stored = link(tmp_path, blob_path) == 0 ||
+        (errno == EEXIST && same_contents(tmp_path, blob_path));
+    unlink(tmp_path);
+    if (!stored) {
+        // a different output with the same hash keeps its blob
+        return;
+    }
+
+    snprintf(key_path, sizeof(key_path), "%s/keys/%016" PRIx64, dir, key->hash);
+    if (snprintf(key_tmp, sizeof(key_tmp), "%s.XXXXXX", key_path) >= (int) sizeof(key_tmp)) {
+        return;
+    }
+    int fd = mkostemp(key_tmp, O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    char blob[MEMO_HASH_HEX + 1];
+    snprintf(blob, sizeof(blob), "%016" PRIx64, content);
+    int written = write_all(fd, blob, MEMO_HASH_HEX);
+    if (written == 0) {
+        written = write_all(fd, key->data, key->len);
+    }
+    close(fd);
+    if (written < 0 || rename(key_tmp, key_path) < 0) {
+        unlink(key_tmp);
+    }
+}
+
+int run_cached(Command *command) {
+    int out_fd = STDOUT_FILENO;
+    if (command->redir_out_path != NULL) {
+        out_fd = open_redirect_out(command);
+        if (out_fd < 0) {
+            perror("open");
+            return -1;
+        }
+    }
+
+    char dir[MAX_PATH_STR];
+    bool usable = command->exec_path != NULL && memo_dir(dir) == 0;
+    MemoKey key = {0};
+    if (usable) {
+        memo_key(command, &key);
+    }
+
+    fflush(stdout);
+    if (usable && replay_cached(dir, &key, out_fd)) {
+        free(key.data);
+        if (out_fd != STDOUT_FILENO) close(out_fd);
+        return 0;
+    }
+
+    char tmp_path[MAX_PATH_STR];
+    int tmp_fd = -1;
+    if (usable && snprintf(tmp_path, sizeof(tmp_path), "%s/blobs/tmp.XXXXXX", dir)
+        < (int) sizeof(tmp_path)) {
+        tmp_fd = mkostemp(tmp_path, O_CLOEXEC);
+    }
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        perror("pipe");
+        if (tmp_fd >= 0) {
+            close(tmp_fd);
+            unlink(tmp_path);
+        }
+        free(key.data);
+        if (out_fd != STDOUT_FILENO) close(out_fd);
+        return -1;
+    }
+
+    // the output may only depend on the key, so stdin is never the terminal
+    Command job = *command;
+    job.next = NULL;
+    job.redir_out_path = NULL;
+    job.stdout_fd = pipefd[1];
+    if (job.redir_in_path == NULL) {
+        job.redir_in_path = (char *) MEMO_NO_INPUT;
+    }
+
+    pid_t pid = run_command(&job);
+    if (pid < 0) {
+        close(pipefd[0]);
+        if (tmp_fd >= 0) {
+            close(tmp_fd);
+            unlink(tmp_path);
+        }
+        free(key.data);
+        if (out_fd != STDOUT_FILENO) close(out_fd);
+        return -1;
+    }
+
+    // tee the output to its destination and the cache
+    uint64_t content = FNV_OFFSET;
+    char buf[MEMO_COPY_BUF];
+    ssize_t nread;
+    while ((nread = read(pipefd[0], buf, sizeof(buf))) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            break;
+        }
+        stats_add(STAT_PIPE_BYTES, nread);
+        if (write_all(out_fd, buf, nread) < 0) {
+            perror("write");
+        }
+        if (tmp_fd >= 0) {
+            content = fnv1a(content, buf, nread);
+            if (write_all(tmp_fd, buf, nread) < 0) {
+                close(tmp_fd);
+                unlink(tmp_path);
+                tmp_fd = -1;
+            }
+        }
+    }
+    close(pipefd[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        status = -1;
+    }
+    stats_child_reaped(pid);
+
+    // only successful runs are worth replaying
+    if (tmp_fd >= 0) {
+        close(tmp_fd);
+        if (status == 0) {
+            store_cached(dir, &key, tmp_path, content);
+        } else {
+            unlink(tmp_path);
+        }
+    }
+    free(key.data);
+    if (out_fd != STDOUT_FILENO) close(out_fd);
+    return status;
+}
@@ -0,0 +1,214 @@
+#include "cscshell.h"
+
+
+/*
+** One running job of a `parallel` invocation.
+*/
+typedef struct Slot {
+    pid_t pid;
+    int out_fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    const char *input;
+} Slot;
+
+
+/**
+ * Starts the job for one input in a free slot, with its output going to
+ * a pipe the shell drains.
+ *
+ * @param slot The free slot to use.
+ * @param exec_path The resolved executable shared by every job.
+ * @param job_args The command's arguments, with a free slot for the input.
+ * @param input_idx Index of the input slot in job_args.
+ * @param input The input for this job.
+ * @return 0 on success, -1 if the job could not be started.
+ */
+int start_job(Slot *slot, char *exec_path, char **job_args, int input_idx,
+              const char *input) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    job_args[input_idx] = (char *) input;
+    Command job = {0};
+    job.exec_path = exec_path;
+    job.args = job_args;
+    job.stdin_fd = STDIN_FILENO;
+    job.stdout_fd = pipefd[1];
+
+    pid_t pid = run_command(&job);
+    if (pid < 0) {
+        close(pipefd[0]);
+        return -1;
+    }
+
+    slot->pid = pid;
+    slot->out_fd = pipefd[0];
+    slot->len = 0;
+    slot->input = input;
+    return 0;
+}
+
+/**
+ * Reads whatever a job has written so far into its buffer.
+ *
+ * @param slot The job's slot.
+ * @return The number of bytes read, 0 at end of file, -1 on error.
+ */
+ssize_t drain_job(Slot *slot) {
+    if (slot->cap - slot->len < PARALLEL_READ_BUF) {
+        size_t new_cap = slot->cap ? slot->cap * 2 : PARALLEL_READ_BUF * 4;
+        char *grown = realloc(slot->buf, new_cap);
+        if (grown == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        slot->buf = grown;
+        slot->cap = new_cap;
+    }
+
+    ssize_t nread = read(slot->out_fd, slot->buf + slot->len, slot->cap - slot->len);
+    if (nread > 0) {
+        slot->len += nread;
+        stats_add(STAT_PIPE_BYTES, nread);
+    }
+    return nread;
+}
+
+/**
+ * Finishes a job whose output has been fully read: prints its output in
+ * one piece and reaps it.
+ *
+ * @param slot The job's slot.
+ * @param out_fd Where the job's output goes.
+ * @return The wait status of the job.
+ */
+int finish_job(Slot *slot, int out_fd) {
+    close(slot->out_fd);
+    slot->out_fd = -1;
+
+    if (write_all(out_fd, slot->buf, slot->len) < 0) {
+        perror("parallel");
+    }
+
+    int status;
+    if (waitpid(slot->pid, &status, 0) < 0) {
+        perror("waitpid");
+        status = -1;
+    }
+    stats_child_reaped(slot->pid);
+    slot->pid = 0;
+    return status;
+}
+
+int builtin_parallel(Command *command, Variable **root, int out_fd) {
+    char **args = command->args;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int idx = 1;
+
+    if (args[idx] && strcmp(args[idx], PARALLEL_JOBS_FLAG) == 0) {
+        char *end;
+        jobs = args[idx + 1] ? strtol(args[idx + 1], &end, 10) : 0;
+        if (jobs <= 0 || *end != '\0') {
+            ERR_PRINT(ERR_PARALLEL_USAGE);
+            return W_EXITCODE(2, 0);
+        }
+        idx += 2;
+    }
+    if (jobs <= 0) jobs = 1;
+
+    int cmd_start = idx;
+    while (args[idx] && strcmp(args[idx], PARALLEL_ARGS_MARKER) != 0) idx++;
+    int num_cmd_args = idx - cmd_start;
+    if (args[idx] == NULL || num_cmd_args == 0) {
+        ERR_PRINT(ERR_PARALLEL_USAGE);
+        return W_EXITCODE(2, 0);
+    }
+    char **inputs = &args[idx + 1];
+
+    // the command is resolved once and shared by every job
+    char *exec_path = resolve_executable(args[cmd_start], find_path_variable(*root));
+    if (exec_path == NULL) {
+        ERR_PRINT(ERR_NO_EXECU, args[cmd_start]);
+        return W_EXITCODE(127, 0);
+    }
+
+    // every job gets the command's args, its input and a NULL
+    char **job_args = malloc(sizeof(char *) * (num_cmd_args + 2));
+    Slot *slots = calloc(jobs, sizeof(Slot));
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * jobs);
+    int *fd_slot = malloc(sizeof(int) * jobs);
+    if (job_args == NULL || slots == NULL || fds == NULL || fd_slot == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(job_args, &args[cmd_start], sizeof(char *) * num_cmd_args);
+    job_args[num_cmd_args + 1] = NULL;
+
+    int total = 0, failed = 0, running = 0;
+    bool start_failed = false;
+    char **next_input = inputs;
+
+    while (running > 0 || (*next_input != NULL && !start_failed)) {
+        // fill every free slot before waiting on output
+        for (int i = 0; i < jobs && *next_input != NULL && !start_failed; i++) {
+            if (slots[i].pid != 0) continue;
+            if (start_job(&slots[i], exec_path, job_args, num_cmd_args, *next_input) < 0) {
+                start_failed = true;
+                break;
+            }
+            next_input++;
+            running++;
+            total++;
+        }
+
+        int nfds = 0;
+        for (int i = 0; i < jobs; i++) {
+            if (slots[i].pid == 0) continue;
+            fds[nfds].fd = slots[i].out_fd;
+            fds[nfds].events = POLLIN;
+            fd_slot[nfds++] = i;
+        }
+        if (nfds == 0) break;
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            Slot *slot = &slots[fd_slot[i]];
+            ssize_t nread = drain_job(slot);
+            if (nread > 0 || (nread < 0 && errno == EINTR)) continue;
+
+            int status = finish_job(slot, out_fd);
+            running--;
+            if (status != 0) {
+                failed++;
+                ERR_PRINT(ERR_PARALLEL_JOB, slot->input,
+                          WIFEXITED(status) ? WEXITSTATUS(status) : status);
+            }
+        }
+    }
+
+    if (failed > 0 || start_failed) {
+        ERR_PRINT(ERR_PARALLEL_FAILED, failed, total);
+    }
+
+    for (int i = 0; i < jobs; i++) free(slots[i].buf);
+    free(slots);
+    free(fds);
+    free(fd_slot);
+    free(job_args);
+    free(exec_path);
+
+    if (start_failed) {
+        return -1;
+    }
+    return W_EXITCODE(failed < PARALLEL_MAX_EXIT ? failed : PARALLEL_MAX_EXIT, 0);
+}
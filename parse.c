@@ -4,9 +4,19 @@
 
 #define CONTINUE_SEARCH NULL
 
+// Gives every stored value a version no other value has had
+static uint64_t variable_clock = 0;
 
-// COMPLETE
-char *resolve_executable(const char *command_name, Variable *path){
+
+/**
+ * Searches the directories of PATH for an executable, in order.
+ * This is the original body of resolve_executable.
+ *
+ * @param command_name The command to look for.
+ * @param path The PATH variable.
+ * @return As resolve_executable.
+ */
+char *search_path(const char *command_name, Variable *path){
 
     if (command_name == NULL || path == NULL){
         return NULL;
@@ -38,7 +48,8 @@ char *resolve_executable(const char *command_name, Variable *path){
         perror("resolve_executable");
         return NULL;
     }
-    char *current_path = strtok(path_to_toke, ":");
+    char *savePtr;
+    char *current_path = strtok_r(path_to_toke, ":", &savePtr);
 
     do {
         DIR *dir = opendir(current_path);
@@ -82,13 +93,37 @@ char *resolve_executable(const char *command_name, Variable *path){
         // if this isn't null, stop checking paths
         if (possible_file) break;
 
-    } while ((current_path = strtok(CONTINUE_SEARCH, ":")));
+    } while ((current_path = strtok_r(CONTINUE_SEARCH, ":", &savePtr)));
 
 res_ex_cleanup:
     free(path_to_toke);
     return exec_path;
 }
 
+char *resolve_executable(const char *command_name, Variable *path){
+    uint64_t started = stats_now();
+    uint64_t generation;
+    char *exec_path;
+
+    // plain names are answered by the shared index when it is usable
+    if (command_name != NULL && path != NULL && strchr(command_name, '/') == NULL &&
+        strcmp(command_name, CD) != 0 && strcmp(path->name, PATH_VAR_NAME) == 0 &&
+        path_index_lookup(command_name, path->value, &exec_path, &generation)) {
+        stats_add(STAT_PATH_HITS, 1);
+        note_parse_variable(path->name, strlen(path->name), path);
+        note_parse_path(generation);
+    } else {
+        exec_path = search_path(command_name, path);
+        stats_add(STAT_PATH_MISSES, 1);
+        // only the index can tell when a directory search would change
+        if (command_name == NULL || strchr(command_name, '/') == NULL) {
+            note_parse_uncacheable();
+        }
+    }
+    stats_record(HIST_RESOLVE, stats_now() - started);
+    return exec_path;
+}
+
 /**
  * Searches for the "PATH" variable within a linked list of environment variables.
  *
@@ -110,123 +145,408 @@ Variable *find_path_variable(Variable *variables) {
 }
 
 /**
- * Finds the first command in a line.
- * 
- * @param line The command line string.
- * @return Dynamically allocated string of the first command or NULL on failure.
+ * Checks whether a word is one of the redirection operators.
+ *
+ * @param word The word to check.
+ * @return True if the word is '<', '>' or '>>'.
  */
-char *find_first_command(char *line) {
-    char *start = line;
-    char *end = start;
+bool is_redirection(const char *word) {
+    return !strcmp(word, "<") || !strcmp(word, ">") || !strcmp(word, ">>");
+}
 
-    // Find the end of the first command
-    while (*end != ' ' && *end != '<' && *end != '>' && *end != '\0' && *end != '|') {
-        end++;
+/**
+ * Appends a heap string to a growable NULL-terminated array of strings.
+ *
+ * @param list Pointer to the array, reallocated as needed.
+ * @param count Pointer to the number of strings currently in the array.
+ * @param capacity Pointer to the number of slots allocated for the array.
+ * @param str The string to append. Ownership moves to the array.
+ * @return True on success, False if the allocation failed.
+ */
+bool append_string(char ***list, size_t *count, size_t *capacity, char *str) {
+    if (*count + 1 >= *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 8;
+        char **grown = realloc(*list, sizeof(char *) * new_capacity);
+        if (grown == NULL) {
+            return false;
+        }
+        *list = grown;
+        *capacity = new_capacity;
     }
-
-    // Extract the first command
-    char *first_command = malloc((end - start + 1) * sizeof(char));
-    strncpy(first_command, start, end - start);
-    first_command[end - start] = '\0';
-
-    return first_command;
+    (*list)[(*count)++] = str;
+    (*list)[*count] = NULL;
+    return true;
 }
 
 /**
- * Initializes command with executable path and handles redirection.
- * This function was created with help from Github Copilot.
- * The following link contains prompt #1 that was used to create this function:
- * https://docs.google.com/document/d/1Z8r5L1gA5MtiVTdLJAWj3TX0uQaEWlSS9jbzDqdxf20/edit?usp=sharing
- * 
- * @param cmd Command to be initialized.
- * @param variables Environment variables for path resolution.
- * @param line "Command line" input.
- * @return True if successfully initialized, otherwise False.
+ * Splits a single pipeline stage into words on spaces and tabs.
+ *
+ * @param start Start of the stage text.
+ * @param end One past the last character of the stage.
+ * @return Heap NULL-terminated array of heap words, or NULL on failure.
  */
-bool handle_redirection_command_initialization(Command *cmd, Variable **variables, char **line) {
-    // assign first parameter as executable path
-    char *first_command = cmd->args[0];
-    cmd->exec_path = resolve_executable(first_command, find_path_variable(*variables)); 
+char **split_stage_words(const char *start, const char *end) {
+    char **words = NULL;
+    size_t count = 0, capacity = 0;
+
+    const char *ptr = start;
+    while (ptr < end) {
+        while (ptr < end && strchr(WORD_DELIMS, *ptr)) ptr++;
+        if (ptr == end) break;
+
+        const char *word_end = ptr;
+        while (word_end < end && !strchr(WORD_DELIMS, *word_end)) word_end++;
+
+        char *word = strndup(ptr, word_end - ptr);
+        if (word == NULL || !append_string(&words, &count, &capacity, word)) {
+            free(word);
+            goto split_fail;
+        }
+        ptr = word_end;
+    }
+
+    // a stage without any words still gets an (empty) array
+    if (words == NULL) {
+        words = calloc(1, sizeof(char *));
+    }
+    return words;
+
+split_fail:
+    for (size_t i = 0; i < count; i++) free(words[i]);
+    free(words);
+    return NULL;
+}
 
-    int found = 0; // flag to indicate if < or > is found
+ParsedLine *tokenize_line(const char *line, size_t len) {
+    const char *end = line + len;
+    while (line < end && isspace((unsigned char)*line)) line++;
+    while (end > line && isspace((unsigned char)*(end - 1))) end--;
 
-    for (int i = 0; line[i] != NULL; i++) {
-        if (!strcmp(line[i], ">") || !strcmp(line[i], ">>") || !strcmp(line[i], "<")) {
-            found = 1; // set flag to 1 if < or > is found
+    // a comment runs from a word starting with '#' to the end of the line
+    for (const char *ptr = line; ptr < end; ptr++) {
+        if (*ptr == COMMENT_MARKER && (ptr == line || strchr(WORD_DELIMS, *(ptr - 1)))) {
+            end = ptr;
+            while (end > line && isspace((unsigned char)*(end - 1))) end--;
             break;
         }
     }
+    if (line == end) {
+        return NULL;
+    }
 
-    if (!found) { // no redirection found
-        cmd->redir_in_path = NULL;
-        cmd->redir_out_path = NULL;
-        cmd->redir_append = 0;
+    ParsedLine *parsed = calloc(1, sizeof(ParsedLine));
+    if (parsed == NULL) {
+        return (ParsedLine *) -1;
+    }
+    parsed->text = strndup(line, end - line);
+    if (parsed->text == NULL) {
+        free(parsed);
+        return (ParsedLine *) -1;
     }
 
-    for (int index = 0; cmd->args[index]; index++) {
-        // Output redirection
-        if (!strcmp(cmd->args[index], ">")) { // If no file after operand, return error
-            if (cmd->args[index + 1] == NULL) {
-                ERR_PRINT(ERR_EXECUTE_LINE);
-                return false;
-            }
-            else {
-                cmd->redir_out_path = strdup(cmd->args[index + 1]);
-                cmd->redir_append = 0;
-                cmd->args[index] = NULL; 
-            }
+    size_t num_stages = 1;
+    for (const char *ptr = line; ptr < end; ptr++) {
+        if (*ptr == PIPE_MARKER) num_stages++;
+    }
+    parsed->stages = calloc(num_stages + 1, sizeof(char **));
+    if (parsed->stages == NULL) {
+        free_parsed_line(parsed, 0);
+        return (ParsedLine *) -1;
+    }
+
+    const char *stage_start = line;
+    for (size_t i = 0; i < num_stages; i++) {
+        const char *stage_end = memchr(stage_start, PIPE_MARKER, end - stage_start);
+        if (stage_end == NULL) stage_end = end;
+
+        parsed->stages[i] = split_stage_words(stage_start, stage_end);
+        if (parsed->stages[i] == NULL) {
+            free_parsed_line(parsed, 0);
+            return (ParsedLine *) -1;
         }
-        // Append operation
-        else if (!strcmp(cmd->args[index], ">>")) { // If no file after operand, return error
-            if (cmd->args[index + 1] == NULL) {
-                ERR_PRINT(ERR_EXECUTE_LINE);
-                return false;
+        stage_start = stage_end + 1;
+    }
+    return parsed;
+}
+
+void free_parsed_line(ParsedLine *line, uint8_t recursive) {
+    while (line != NULL) {
+        ParsedLine *next = line->next;
+        if (line->stages != NULL) {
+            for (int i = 0; line->stages[i] != NULL; i++) {
+                for (int j = 0; line->stages[i][j] != NULL; j++) {
+                    free(line->stages[i][j]);
+                }
+                free(line->stages[i]);
             }
-            else {
-                cmd->redir_out_path = strdup(cmd->args[index + 1]);
-                cmd->redir_append = 1;
-                cmd->args[index] = NULL;
+            free(line->stages);
+        }
+        free(line->text);
+        free(line);
+        if (!recursive) break;
+        line = next;
+    }
+}
+
+/**
+ * Appends one field of a word to an argument list, expanding it if it is
+ * a glob pattern. A pattern that matches nothing is kept as written.
+ *
+ * @param field The field to add.
+ * @param args Pointer to the argument array being built.
+ * @param count Pointer to the number of arguments so far.
+ * @param capacity Pointer to the allocated size of the argument array.
+ * @param cache Directory listings already read for this line.
+ * @return True on success, False on an allocation error.
+ */
+bool append_field(const char *field, char ***args, size_t *count, size_t *capacity,
+                  DirListing **cache) {
+    if (has_glob_chars(field)) {
+        note_parse_uncacheable();
+        char **matches = expand_glob(field, cache);
+        if (matches == (char **) -1) {
+            return false;
+        }
+        if (matches[0] != NULL) {
+            for (int i = 0; matches[i] != NULL; i++) {
+                if (!append_string(args, count, capacity, matches[i])) {
+                    for (; matches[i] != NULL; i++) free(matches[i]);
+                    free(matches);
+                    return false;
+                }
             }
+            free(matches);
+            return true;
+        }
+        free(matches);
+    }
+
+    char *copy = strdup(field);
+    if (copy == NULL || !append_string(args, count, capacity, copy)) {
+        free(copy);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Replaces the variables used in a single word and appends the result to
+ * an argument list. Values that contain spaces become separate arguments,
+ * and each of them is glob expanded.
+ *
+ * @param word The word as written in the line.
+ * @param args Pointer to the argument array being built.
+ * @param count Pointer to the number of arguments so far.
+ * @param capacity Pointer to the allocated size of the argument array.
+ * @param variables Head of the variables list.
+ * @param cache Directory listings already read for this line.
+ * @return True on success, False on a replacement or allocation error.
+ */
+bool expand_word(const char *word, char ***args, size_t *count, size_t *capacity,
+                 Variable *variables, DirListing **cache) {
+    if (strchr(word, VARIABLE_PARSE_MARKER) == NULL) {
+        return append_field(word, args, count, capacity, cache);
+    }
+
+    char *replaced = replace_variables_mk_line(word, variables);
+    if (replaced == NULL || replaced == (char *) -1) {
+        return false;
+    }
+
+    char *savePtr;
+    char *token = strtok_r(replaced, WORD_DELIMS, &savePtr);
+    while (token != NULL) {
+        if (!append_field(token, args, count, capacity, cache)) {
+            free(replaced);
+            return false;
         }
-        // Input redirection
-        else if (!strcmp(cmd->args[index], "<")) { // If no file after operand, return error
-            if (cmd->args[index + 1] == NULL) {
-                ERR_PRINT(ERR_EXECUTE_LINE);
+        token = strtok_r(NULL, WORD_DELIMS, &savePtr);
+    }
+    free(replaced);
+    return true;
+}
+
+/**
+ * Removes the first n arguments of a command, freeing them.
+ *
+ * @param cmd The command.
+ * @param n How many arguments to drop.
+ */
+void drop_args(Command *cmd, int n) {
+    int total = 0;
+    while (cmd->args[total] != NULL) total++;
+
+    for (int i = 0; i < n; i++) free(cmd->args[i]);
+    memmove(cmd->args, cmd->args + n, sizeof(char *) * (total - n + 1));
+}
+
+/**
+ * Consumes the prefix words (such as `batch -P 4`) at the start of a
+ * command's arguments, recording them in the command's fields.
+ *
+ * @param cmd The command whose arguments are checked.
+ * @return True on success, False on a malformed prefix.
+ */
+bool consume_prefixes(Command *cmd) {
+    while (cmd->args[0] != NULL) {
+        const char *prefix;
+        int used = 1;
+
+        if (strcmp(cmd->args[0], EXEC_PREFIX) == 0) {
+            prefix = EXEC_PREFIX;
+            cmd->exec_replace = 1;
+        } else if (strcmp(cmd->args[0], MEMO_PREFIX) == 0) {
+            prefix = MEMO_PREFIX;
+            cmd->cached = 1;
+        } else if (strcmp(cmd->args[0], BATCH_PREFIX) == 0) {
+            prefix = BATCH_PREFIX;
+            long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            if (cmd->args[1] && strcmp(cmd->args[1], BATCH_JOBS_FLAG) == 0) {
+                char *end;
+                jobs = cmd->args[2] ? strtol(cmd->args[2], &end, 10) : 0;
+                if (jobs <= 0 || *end != '\0') {
+                    ERR_PRINT(ERR_PREFIX_USAGE, prefix);
+                    return false;
+                }
+                used = 3;
+            }
+            cmd->batch_jobs = jobs > 0 ? jobs : 1;
+        } else if (strcmp(cmd->args[0], TIMEOUT_PREFIX) == 0) {
+            prefix = TIMEOUT_PREFIX;
+            used = parse_timeout_prefix(cmd);
+            if (used < 0) {
+                ERR_PRINT(ERR_TIMEOUT_USAGE);
                 return false;
             }
-            else { 
-                cmd->redir_in_path = strdup(cmd->args[index + 1]);
-                cmd->redir_append = 0;
-                cmd->args[index] = NULL;
+        } else if (strcmp(cmd->args[0], LIMIT_PREFIX) == 0) {
+            prefix = LIMIT_PREFIX;
+            used = parse_limit_prefix(cmd);
+            if (used < 0) {
+                ERR_PRINT(ERR_LIMIT_USAGE);
+                return false;
             }
+        } else {
+            break;
+        }
+
+        drop_args(cmd, used);
+        if (cmd->args[0] == NULL) {
+            ERR_PRINT(ERR_PREFIX_USAGE, prefix);
+            return false;
         }
     }
+    return true;
+}
+
+/**
+ * Builds a single Command from the words of one pipeline stage.
+ * Redirection operators and their targets are taken out of the argument
+ * list and stored in the redirection fields instead.
+ *
+ * @param cmd Zeroed command to fill in.
+ * @param words The words of the stage, as tokenized.
+ * @param variables Pointer to the head of the variables list.
+ * @param cache Directory listings already read for this line.
+ * @return True if successfully initialized, otherwise False.
+ */
+bool prepare_command(Command *cmd, char **words, Variable **variables,
+                     DirListing **cache) {
+    size_t count = 0, capacity = 0;
     cmd->stdin_fd = STDIN_FILENO;
     cmd->stdout_fd = STDOUT_FILENO;
-    return true;    
+
+    for (int i = 0; words[i] != NULL; i++) {
+        if (!is_redirection(words[i])) {
+            if (!expand_word(words[i], &cmd->args, &count, &capacity,
+                             *variables, cache)) {
+                return false;
+            }
+            continue;
+        }
+
+        // If no file after operand, return error
+        if (words[i + 1] == NULL) {
+            ERR_PRINT(ERR_REDIR_TARGET, words[i]);
+            return false;
+        }
+        char *target = strchr(words[i + 1], VARIABLE_PARSE_MARKER) ?
+            replace_variables_mk_line(words[i + 1], *variables) :
+            strdup(words[i + 1]);
+        if (target == NULL || target == (char *) -1) {
+            return false;
+        }
+
+        if (words[i][0] == '<') {
+            free(cmd->redir_in_path);
+            cmd->redir_in_path = target;
+        } else {
+            free(cmd->redir_out_path);
+            cmd->redir_out_path = target;
+            cmd->redir_append = (words[i][1] == '>');
+        }
+        i++;
+    }
+
+    if (cmd->args == NULL) {
+        ERR_PRINT(ERR_EMPTY_STAGE);
+        return false;
+    }
+
+    if (!consume_prefixes(cmd)) {
+        return false;
+    }
+
+    // functions and builtins run inside the shell, they have nothing to
+    // resolve, unless exec asks for the real command in their place, or
+    // a prefix for the utility a stage builtin stands in for
+    if (!cmd->exec_replace &&
+        (find_function(cmd->args[0]) != NULL || shell_builtin(cmd) != NULL)) {
+        if (cmd->limits != NULL || cmd->timeout_ms) {
+            ERR_PRINT(ERR_PREFIX_INTERNAL,
+                      cmd->limits ? LIMIT_PREFIX : TIMEOUT_PREFIX, cmd->args[0]);
+            return false;
+        }
+        // a function runs in the shell, there is no command to batch or cache
+        if (find_function(cmd->args[0]) != NULL && (cmd->batch_jobs || cmd->cached)) {
+            ERR_PRINT(ERR_PREFIX_INTERNAL,
+                      cmd->batch_jobs ? BATCH_PREFIX : MEMO_PREFIX, cmd->args[0]);
+            return false;
+        }
+        cmd->exec_path = strdup(cmd->args[0]);
+    } else {
+        cmd->exec_path = resolve_executable(cmd->args[0], find_path_variable(*variables));
+    }
+    return true;
 }
 
 /**
- * Creates a linked list of Command structures from an array of command strings.
- * Each command is parsed for arguments and environment variables are replaced. 
- * Redirections within each command are handled during initialization.
- * The linked list iteration (lines 225 - 239) was created with help from Github Copilot.
- * The following link contains prompt #2 that was used to create this function:
- * https://docs.google.com/document/d/1Z8r5L1gA5MtiVTdLJAWj3TX0uQaEWlSS9jbzDqdxf20/edit?usp=sharing
+ * Finds a prefix on a command that needs the whole line to itself.
  *
- * @param line Array of command strings, split by pipes.
- * @param variables Pointer to the head of the list of environment variables.
- * @return Pointer to the head of the linked list of Command structures.
+ * @param cmd The command.
+ * @return The name of the prefix, or NULL if there is none.
  */
-Command *set_linked_list(char **line, Variable **variables) {
+const char *own_line_prefix(Command *cmd) {
+    if (cmd->exec_replace) return EXEC_PREFIX;
+    if (cmd->batch_jobs) return BATCH_PREFIX;
+    if (cmd->cached) return MEMO_PREFIX;
+    return NULL;
+}
+
+Command *prepare_line(ParsedLine *line, Variable **variables) {
+    if (find_path_variable(*variables) == NULL) {
+        ERR_PRINT(ERR_EXECUTE_LINE);
+        return (Command *) -1;
+    }
+
+    // Listings are shared by every pattern on the line
+    DirListing *cache = NULL;
+
     Command *head = NULL, *curr = NULL;
-    // Assuming 'commands_split' is an array of command strings ending with a NULL marker
-    for (int i = 0; line[i] != NULL; i++) {
-        Command *new_cmd = malloc(sizeof(Command));
+    for (int i = 0; line->stages[i] != NULL; i++) {
+        Command *new_cmd = calloc(1, sizeof(Command));
         if (new_cmd == NULL) {
             exit(EXIT_FAILURE); // Handle allocation failure
         }
-        memset(new_cmd, 0, sizeof(Command)); // Initialize command structure
 
         if (head == NULL) {
             head = new_cmd; // First command becomes the head
@@ -235,194 +555,231 @@ Command *set_linked_list(char **line, Variable **variables) {
         }
         curr = new_cmd; // Move 'curr' to the last command in the list
 
-        char **list_split_by_spaces = malloc(sizeof(char*) * MAX_SINGLE_LINE);
-        if (list_split_by_spaces == NULL) {
-            exit(EXIT_FAILURE);
+        if (!prepare_command(curr, line->stages[i], variables, &cache)) {
+            free_dir_listings(cache);
+            free_command(head);
+            return (Command *) -1;
+        }
+
+        bool in_pipeline = head != curr || line->stages[i + 1] != NULL;
+        const char *own_line = own_line_prefix(curr);
+        if ((curr->timeout_ms && (head != curr || own_line))) {
+            if (own_line) {
+                ERR_PRINT(ERR_TIMEOUT_PREFIX, own_line);
+            } else {
+                ERR_PRINT(ERR_TIMEOUT_STAGE);
+            }
+            free_dir_listings(cache);
+            free_command(head);
+            return (Command *) -1;
         }
-        
-        char *replaced = replace_variables_mk_line(line[i], *variables);
-        memset(list_split_by_spaces, 0, sizeof(char*) * MAX_SINGLE_LINE);
-        
-        int j = 0;
-        char *savePtr;
-        char *token = strtok_r(replaced, " ", &savePtr);
-        
-        while (token != NULL) {
-            list_split_by_spaces[j++] = token; // Assign the token to the array and increment number of tokens
-            token = strtok_r(NULL, " ", &savePtr); // Continue splitting line
-        }
-        
-        list_split_by_spaces[j] = NULL; // Null-terminate the array of tokens
-
-        curr->args = list_split_by_spaces;
-
-        // process for redirection
-        bool initialized = handle_redirection_command_initialization(curr, variables, line);
-        if (!initialized) {
+        const Builtin *builtin = shell_builtin(curr);
+        bool function = !curr->exec_replace && find_function(curr->args[0]) != NULL;
+        if (in_pipeline &&
+            (own_line || function || (builtin != NULL && builtin->stage == NULL))) {
+            if (own_line) {
+                ERR_PRINT(ERR_PREFIX_PIPELINE, own_line);
+            } else if (function) {
+                ERR_PRINT(ERR_FUNCTION_PIPELINE, curr->args[0]);
+            } else {
+                ERR_PRINT(ERR_BUILTIN_PIPELINE, curr->args[0]);
+            }
+            free_dir_listings(cache);
+            free_command(head);
             return (Command *) -1;
         }
-        
     }
-
+    free_dir_listings(cache);
     return head;
 }
 
 /**
- * Parses a command line, splits it by pipes, and creates a linked list of Command structures.
- * Handles the parsing of the command line, replacing environment variables, and managing redirections.
- * Lines 298 - 310 were generated from pseudocode provided in Piazza post @2549
- * 
- * @param start The command line string to be parsed.
- * @param num_args The number of arguments in the command line. Currently unused.
- * @param variables Pointer to the head of the environment variables list.
- * @return Head of the linked list of Command structures representing the parsed command line.
+ * Handles a `NAME=VALUE` line by setting the variable, or a `NAME+=VALUE`
+ * line by appending to it. The value is everything after the first '=',
+ * leading spaces included.
+ *
+ * @param line The trimmed assignment line.
+ * @param variables Pointer to the head of the variables list.
+ * @return NULL on success or (Command *) -1 on an invalid name.
  */
-Command *parse_command(char *start, int num_args, Variable **variables) {
-    if (find_path_variable(*variables) == NULL) {
-        ERR_PRINT(ERR_EXECUTE_LINE);
+Command *parse_assignment(const char *line, Variable **variables) {
+    const char *equalsPtr = strchr(line, '=');
+
+    // If '=' is the first non-whitespace character, it's an error
+    if (equalsPtr == line) {
+        ERR_PRINT(ERR_VAR_START);
         return (Command *) -1;
     }
 
-    // split the command line into tokens and accounting for pipes
-    char **list_of_split_commands = malloc(sizeof(char*) * MAX_SINGLE_LINE);
-    if (list_of_split_commands == NULL) {
+    const char *name_end = equalsPtr;
+    bool append = *(equalsPtr - 1) == VAR_APPEND_MARKER;
+    if (append) name_end--;
+    if (name_end == line) {
+        ERR_PRINT(ERR_VAR_START);
+        return (Command *) -1;
+    }
+
+    char *name = strndup(line, name_end - line);
+    if (name == NULL) {
         exit(EXIT_FAILURE);
     }
-   
-    memset(list_of_split_commands, 0, sizeof(char*) * MAX_SINGLE_LINE);
-    int idx = 0;
-    char *savePtr;
-    char *command = strtok_r(start, "|", &savePtr);
-    
-    while (command != NULL) {
-        list_of_split_commands[idx++] = command; // Assign the command to the array and increment number of commands
-        command = strtok_r(NULL, "|", &savePtr); // Continue splitting commandLine
+
+    // Validate variable name
+    for (char *ptr = name; *ptr; ptr++) {
+        if (!isalpha((unsigned char)*ptr) && *ptr != '_') {
+            ERR_PRINT(ERR_VAR_NAME, name);
+            free(name);
+            return (Command *) -1;
+        }
     }
-    list_of_split_commands[idx] = NULL; // Null-terminate the array of commands
 
-    Command *head = set_linked_list(list_of_split_commands, variables);
-    
-    return head;
+    int ret = append ? append_variable(variables, name, equalsPtr + 1)
+                     : set_variable(variables, name, equalsPtr + 1);
+    if (ret < 0) {
+        exit(EXIT_FAILURE);
+    }
+    free(name);
+    return NULL;
 }
 
 /**
- * Counts the number of arguments in a command line.
- * 
- * This function takes into consideration spaces as separators between arguments and ignores spaces 
- * adjacent to redirection operators ('<' and '>'). It returns the total number of arguments found.
- * 
- * @param line The command line string to count arguments from.
- * @return The number of arguments in the command line.
+ * Checks whether a trimmed line is a variable assignment, that is, its
+ * first word contains an '='.
+ *
+ * @param line The trimmed line.
+ * @return True if the line assigns a variable.
  */
-int count_args(char *line) {
-    int num_args = 1;
-    char *ptr = line;
-    while (*ptr) {
-        if (isspace((unsigned char)*ptr)) {
-            // Check if the next character is not a redirection operator
-            if (*(ptr + 1) != '<' && *(ptr + 1) != '>') {
-                num_args++;
-            }
-            while (isspace((unsigned char)*ptr)) ptr++;
-        } else {
-            ptr++;
-        }
+bool is_assignment(const char *line) {
+    size_t first_word_len = strcspn(line, WORD_DELIMS);
+    return memchr(line, '=', first_word_len) != NULL;
+}
+
+/**
+ * Tokenizes and prepares a line that runs commands, unless the parse
+ * cache still has it.
+ *
+ * @param line The line, not necessarily NUL-terminated.
+ * @param len Its length.
+ * @param variables Pointer to the head of the variables list.
+ * @return As parse_line.
+ */
+Command *parse_command_span(const char *line, size_t len, Variable **variables) {
+    Command *cmd = parse_cache_lookup(line, len, *variables);
+    if (cmd != NULL) {
+        return cmd;
+    }
+
+    ParsedLine *parsed = tokenize_line(line, len);
+    if (parsed == (ParsedLine *) -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (parsed == NULL) {
+        return NULL;
     }
-    return num_args;
+
+    parse_cache_begin();
+    cmd = prepare_line(parsed, variables);
+    parse_cache_end(line, len, cmd);
+    free_parsed_line(parsed, 0);
+    return cmd;
 }
 
-Command *parse_line(char *line, Variable **variables) {
-    if (line == NULL || *line == '\0' || *line == '#') {
-        return NULL; // Handle empty lines or comments immediately
+Command *prepare_line_cached(ParsedLine *line, Variable **variables) {
+    size_t len = strlen(line->text);
+    Command *cmd = parse_cache_lookup(line->text, len, *variables);
+    if (cmd != NULL) {
+        return cmd;
     }
 
-    while(isspace((unsigned char)*line)) line++;
+    parse_cache_begin();
+    cmd = prepare_line(line, variables);
+    parse_cache_end(line->text, len, cmd);
+    return cmd;
+}
 
-    char *trimmed_line = strdup(line);
-    if(trimmed_line == NULL) {
-        exit(EXIT_FAILURE);
+/**
+ * Parses a line as described for parse_line, without timing it.
+ *
+ * @param line The line to parse.
+ * @param variables Pointer to the head of the variables list.
+ * @return As parse_line.
+ */
+Command *parse_line_text(char *line, Variable **variables) {
+    if (line == NULL) {
+        return NULL;
     }
 
-    if (*trimmed_line == '#') {
-        return NULL; // Handle comments
+    if (function_definition_pending()) {
+        return continue_function_definition(line) < 0 ? (Command *) -1 : NULL;
     }
 
-    if (*trimmed_line == '\0') {
-        return NULL; // Handle empty lines
+    while(isspace((unsigned char)*line)) line++;
+
+    if (*line == '\0' || *line == COMMENT_MARKER) {
+        return NULL; // Handle empty lines or comments immediately
     }
 
-    char *equalsPtr = strchr(trimmed_line, '=');
+    if (is_function_definition(line)) {
+        return start_function_definition(line) < 0 ? (Command *) -1 : NULL;
+    }
 
     // variable assignment
-    if (equalsPtr) {
-        // If '=' is the first non-whitespace character, it's an error
-        if (equalsPtr == trimmed_line) {
-            ERR_PRINT(ERR_VAR_START);
-            return (Command *) -1;
-        }
-
-        *equalsPtr = '\0'; // Split name and value
-        char *name = trimmed_line;
-        char *value = equalsPtr + 1; // Include leading spaces in the value
+    if (is_assignment(line)) {
+        return parse_assignment(line, variables);
+    }
 
-        // Validate variable name
-        for (char *ptr = name; *ptr; ptr++) {
-            if (!isalpha((unsigned char)*ptr) && *ptr != '_') {
-                ERR_PRINT(ERR_VAR_NAME, name);
-                return (Command *) -1;
-            }
-        }
+    return parse_command_span(line, strlen(line), variables);
+}
 
-        // Update or add variable
-        for (Variable *current = *variables; current; current = current->next) {
-            if (strcmp(current->name, name) == 0) {
-                free(current->value);
-                current->value = strdup(value);
-                return NULL;
-            }
-        }
+/**
+ * Parses a line that is not NUL-terminated as parse_line_text would.
+ * Lines that run commands are tokenized straight from the span; only
+ * assignments and function definitions, which keep parts of their text,
+ * are copied out first.
+ *
+ * @param line The line.
+ * @param len Its length.
+ * @param variables Pointer to the head of the variables list.
+ * @return As parse_line.
+ */
+Command *parse_span_text(const char *line, size_t len, Variable **variables) {
+    const char *end = line + len;
+    while (line < end && isspace((unsigned char)*line)) line++;
+    if (!function_definition_pending() && (line == end || *line == COMMENT_MARKER)) {
+        return NULL;
+    }
 
-        // Add new variable
-        Variable *new_var = (Variable *)malloc(sizeof(Variable));
-        if (!new_var) {
+    const char *word_end = line;
+    while (word_end < end && !strchr(WORD_DELIMS, *word_end)) word_end++;
+    if (function_definition_pending() || memchr(line, '=', word_end - line) != NULL ||
+        memmem(line, end - line, FUNC_PARENS, strlen(FUNC_PARENS)) != NULL) {
+        char *text = strndup(line, end - line);
+        if (text == NULL) {
             exit(EXIT_FAILURE);
         }
-        new_var->name = strdup(name);
-        new_var->value = strdup(value);
-        new_var->next = *variables;
-        *variables = new_var;
-        return NULL;
-        }
+        Command *cmd = parse_line_text(text, variables);
+        free(text);
+        return cmd;
+    }
+    return parse_command_span(line, end - line, variables);
+}
 
-    // Handle cases where the line is not a variable assignment
-    if (!equalsPtr) {
-        // first we need to check if we need to do variable replacement
-        // this is done by checking if the line contains a '$'
-        if (strchr(trimmed_line, '$')) {
-            char *new_line = replace_variables_mk_line(trimmed_line, *variables);
-            if (new_line == NULL) {
-                return (Command *) -1;
-            } else if (new_line == (char *) -1) {
-                return (Command *) -1;
-            } 
-            int num_args = count_args(new_line);
-            Command *cmd = parse_command(new_line, num_args, variables);
-            free(new_line);
-            return cmd;
-        }
+Command *parse_line(char *line, Variable **variables) {
+    uint64_t started = stats_now();
+    Command *commands = parse_line_text(line, variables);
 
-        // If no variable replacement is needed, we can proceed with parsing the command
-        char *ptr = trimmed_line;
-        int num_args = count_args(ptr);
-        // This could be the place where you handle commands or other types of input
-        // For now, we just print a placeholder message
+    stats_add(STAT_LINES_PARSED, 1);
+    stats_record(HIST_PARSE_LINE, stats_now() - started);
+    return commands;
+}
 
-        Command *cmd = parse_command(ptr, num_args, variables);
-        return cmd; // This will return a single command
-    }
+Command *parse_line_span(const char *line, size_t len, Variable **variables) {
+    uint64_t started = stats_now();
+    Command *commands = parse_span_text(line, len, variables);
 
-    free(trimmed_line);
-    return NULL;
+    stats_add(STAT_LINES_PARSED, 1);
+    stats_record(HIST_PARSE_LINE, stats_now() - started);
+    return commands;
 }
 
 /**
@@ -433,6 +790,7 @@ Command *parse_line(char *line, Variable **variables) {
  * @return A pointer to the found Variable structure, or NULL if not found.
  */
 Variable *find_variable(Variable *variables, const char *name) {
+    stats_add(STAT_VAR_LOOKUPS, 1);
     for (Variable *current = variables; current; current = current->next) {
         if (strcmp(current->name, name) == 0) {
             return current;
@@ -442,91 +800,234 @@ Variable *find_variable(Variable *variables, const char *name) {
 }
 
 /**
- * Extracts a variable name from a given position in a string.
+ * Stores a value in a variable, or appends it to the current one, growing
+ * the buffer to at least twice its size when it is full so that repeated
+ * appends stay linear. The value may point into the variable's buffer.
  *
- * This function handles both braced (${VAR}) and non-braced ($VAR) variable names.
- * It copies the extracted variable name into a provided buffer.
- *
- * @param ptr A pointer to the character in the string immediately before the variable name.
- * @param var_name A buffer where the extracted variable name will be stored.
- * @return A pointer to the character immediately following the variable name in the string.
+ * @param var The variable; value may be NULL for a new one.
+ * @param value The value to copy in.
+ * @param len Its length.
+ * @param append True to add to the current value instead of replacing it.
+ * @return 0 on success, -1 if an allocation failed.
  */
-const char *extract_var_name(const char *ptr, char *var_name) {
-    int is_braced = *(ptr + 1) == '{';
-    const char *var_start;
-    if (is_braced) {
-        var_start = ptr + 2; // Skip past the '$' and '{'
+int store_variable_value(Variable *var, const char *value, size_t len, bool append) {
+    size_t start = append ? var->value_len : 0;
+    if (start + len + 1 > var->value_cap) {
+        size_t new_cap = var->value_cap * 2;
+        if (new_cap < start + len + 1) new_cap = start + len + 1;
+        char *grown = malloc(new_cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        memcpy(grown, var->value, start);
+        memcpy(grown + start, value, len);
+        free(var->value);
+        var->value = grown;
+        var->value_cap = new_cap;
     } else {
-        var_start = ptr + 1; // Skip past the '$'
+        memmove(var->value + start, value, len);
+    }
+    var->value_len = start + len;
+    var->value[var->value_len] = '\0';
+    var->version = __atomic_add_fetch(&variable_clock, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Updates a variable, or adds it to the front of the list if it is new.
+ *
+ * @param variables Pointer to the head of the variables list.
+ * @param name The name of the variable.
+ * @param value The value to copy into the variable.
+ * @param append True to add value to the end of the current value.
+ * @return 0 on success, -1 if an allocation failed.
+ */
+int update_variable(Variable **variables, const char *name, const char *value, bool append) {
+    // Update or add variable
+    Variable *current = find_variable(*variables, name);
+    if (current) {
+        return store_variable_value(current, value, strlen(value), append);
+    }
+
+    // Add new variable
+    Variable *new_var = (Variable *)calloc(1, sizeof(Variable));
+    if (!new_var) {
+        return -1;
+    }
+    new_var->name = strdup(name);
+    if (new_var->name == NULL ||
+        store_variable_value(new_var, value, strlen(value), false) < 0) {
+        free(new_var->name);
+        free(new_var);
+        return -1;
+    }
+    new_var->next = *variables;
+    *variables = new_var;
+    return 0;
+}
+
+int set_variable(Variable **variables, const char *name, const char *value) {
+    return update_variable(variables, name, value, false);
+}
+
+int append_variable(Variable **variables, const char *name, const char *value) {
+    return update_variable(variables, name, value, true);
+}
+
+void set_pipestatus(Variable **root, const char *codes) {
+    if (find_variable(*root, PIPESTATUS_VAR) != NULL) {
+        if (set_variable(root, PIPESTATUS_VAR, codes) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        return;
     }
+    if (set_variable(root, PIPESTATUS_VAR, codes) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // keep PATH at the head, where the init file is expected to put it
+    Variable *var = *root;
+    if (var->next == NULL) return;
+    *root = var->next;
+    Variable *tail = *root;
+    while (tail->next != NULL) tail = tail->next;
+    tail->next = var;
+    var->next = NULL;
+}
+
+/**
+ * Unlinks a variable from the list without freeing it.
+ *
+ * @param variables Pointer to the head of the variables list.
+ * @param name The name of the variable to remove.
+ * @return The unlinked variable, or NULL if it was not in the list.
+ */
+Variable *remove_variable(Variable **variables, const char *name) {
+    for (Variable **link = variables; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            Variable *found = *link;
+            *link = found->next;
+            found->next = NULL;
+            return found;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Finds the name of a variable usage: $NAME or ${NAME}.
+ *
+ * @param ptr The '$' starting the usage.
+ * @param name Set to the start of the name.
+ * @param name_len Set to the length of the name.
+ * @return A pointer to the character immediately following the usage, or
+ *         NULL if a brace is not closed.
+ */
+const char *scan_var_name(const char *ptr, const char **name, size_t *name_len) {
+    int is_braced = *(ptr + 1) == '{';
+    const char *var_start = ptr + (is_braced ? 2 : 1);
     const char *var_end = var_start;
 
-    while (*var_end && (isalnum((unsigned char)*var_end) || *var_end == '_')) var_end++;
+    while (isalnum((unsigned char)*var_end) || *var_end == '_') var_end++;
     if (is_braced && *var_end != '}') return NULL;
 
-    size_t var_name_len = var_end - var_start;
-    strncpy(var_name, var_start, var_name_len);
-    var_name[var_name_len] = '\0';
+    *name = var_start;
+    *name_len = var_end - var_start;
+    return is_braced ? var_end + 1 : var_end;
+}
 
-    if (is_braced) {
-        return var_end + 1;
-    } else {
-        return var_end;
+Variable *find_variable_span(Variable *variables, const char *name, size_t name_len) {
+    stats_add(STAT_VAR_LOOKUPS, 1);
+    for (Variable *current = variables; current; current = current->next) {
+        if (strncmp(current->name, name, name_len) == 0 &&
+            current->name[name_len] == '\0') {
+            return current;
+        }
     }
+    return NULL;
 }
 
 /*
-** This function is partially implemented for you, but you may
-** scrap the implementation as long as it produces the same result.
-**
-** Creates a new line on the heap with all named variable *usages*
-** replaced with their associated values.
-**
-** Returns NULL if replacement parsing had an error, or (char *) -1 if
-** system calls fail and the shell needs to exit.
+** One variable usage in a line: where it starts and ends, and the value
+** it is replaced with.
+*/
+typedef struct VarUsage {
+    const char *start;
+    const char *end;
+    const char *value;
+    size_t value_len;
+} VarUsage;
+
+/*
+** Every usage is resolved first, so the new line is allocated once at
+** its final size, and the text between usages is copied in whole runs
+** found with memchr.
 */
 char *replace_variables_mk_line(const char *line, Variable *variables) {
-    size_t new_line_length = strlen(line) + 1;
-    char *new_line = (char *)malloc(new_line_length);
-    if (new_line == NULL) {
-        return (char *) -1;
-    }
+    size_t line_len = strlen(line);
+    const char *line_end = line + line_len;
 
-    const char *ptr = line;
-    int new_idx = 0;
+    VarUsage local[REPLACE_LOCAL_USAGES];
+    VarUsage *usages = local;
+    size_t num_usages = 0, max_usages = REPLACE_LOCAL_USAGES;
+    size_t new_len = line_len;
 
-    // Iterate through the line and replace variables with their values
-    while (*ptr) {
-        // Check if the current character is a variable
-        if (*ptr == '$') {
-            char var_name[MAX_SINGLE_LINE];
-            ptr = extract_var_name(ptr, var_name);
-            if (ptr == NULL) {
-                ERR_PRINT(ERR_EXECUTE_LINE);
-                free(new_line);
-                return NULL;
-            }
+    for (const char *ptr = memchr(line, '$', line_len); ptr != NULL;
+         ptr = memchr(ptr, '$', line_end - ptr)) {
+        const char *name;
+        size_t name_len;
+        const char *end = scan_var_name(ptr, &name, &name_len);
+        Variable *var = NULL;
+        if (end != NULL) {
+            var = find_variable_span(variables, name, name_len);
+            note_parse_variable(name, name_len, var);
+        }
+        if (var == NULL) {
+            ERR_PRINT(ERR_EXECUTE_LINE);
+            if (usages != local) free(usages);
+            return NULL;
+        }
 
-            // Find the variable in the list and replace it with its value
-            Variable *var = find_variable(variables, var_name);
-            // If the variable is not found, return an error
-            if (var) {
-                size_t var_value_len = strlen(var->value);
-                new_line = realloc(new_line, new_line_length - strlen(var_name) + var_value_len);
-                strcpy(new_line + new_idx, var->value);
-                new_idx += var_value_len;
-            } else {
-                ERR_PRINT(ERR_EXECUTE_LINE);
-                free(new_line);
-                return NULL;
+        if (num_usages == max_usages) {
+            max_usages *= 2;
+            VarUsage *grown = malloc(sizeof(VarUsage) * max_usages);
+            if (grown == NULL) {
+                if (usages != local) free(usages);
+                return (char *) -1;
             }
-        } else {
-            // Copy the character to the new line
-            new_line[new_idx++] = *ptr++;
+            memcpy(grown, usages, sizeof(VarUsage) * num_usages);
+            if (usages != local) free(usages);
+            usages = grown;
         }
+        VarUsage *usage = &usages[num_usages++];
+        usage->start = ptr;
+        usage->end = end;
+        usage->value = var->value;
+        usage->value_len = var->value_len;
+        new_len = new_len - (end - ptr) + usage->value_len;
+        ptr = end;
+    }
+
+    char *new_line = malloc(new_len + 1);
+    if (new_line == NULL) {
+        if (usages != local) free(usages);
+        return (char *) -1;
+    }
+
+    char *out = new_line;
+    const char *copied = line;
+    for (size_t i = 0; i < num_usages; i++) {
+        memcpy(out, copied, usages[i].start - copied);
+        out += usages[i].start - copied;
+        memcpy(out, usages[i].value, usages[i].value_len);
+        out += usages[i].value_len;
+        copied = usages[i].end;
     }
+    memcpy(out, copied, line_end - copied);
+    out[line_end - copied] = '\0';
 
-    new_line[new_idx] = '\0';
+    if (usages != local) free(usages);
     return new_line;
 }
 
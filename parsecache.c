@@ -0,0 +1,290 @@
+#include "cscshell.h"
+#include <pthread.h>
+
+
+/*
+** A variable a line read while it was prepared, by its name in a names
+** buffer, and the version it had then; 0 if it did not exist.
+*/
+typedef struct ParseDep {
+    uint32_t name_off;
+    uint32_t name_len;
+    uint64_t version;
+} ParseDep;
+
+/*
+** What preparing a line has depended on so far. path_generation is 0
+** until a stage is resolved through the PATH index.
+*/
+typedef struct ParseDeps {
+    ParseDep vars[PARSE_DEPS_MAX];
+    int num_vars;
+    char names[PARSE_DEPS_NAMES];
+    size_t names_len;
+    uint64_t path_generation;
+    uint64_t functions_version;
+    bool uncacheable;
+} ParseDeps;
+
+/*
+** A cached line: its text, the commands it was prepared into, never run
+** themselves but copied out on every hit, and what they depend on.
+*/
+typedef struct ParseEntry {
+    char *text;
+    size_t len;
+    uint64_t hash;
+    Command *commands;
+    ParseDep *vars;
+    int num_vars;
+    char *names;
+    uint64_t path_generation;
+    uint64_t functions_version;
+    struct ParseEntry *chain;
+    struct ParseEntry *newer;
+    struct ParseEntry *older;
+} ParseEntry;
+
+static ParseEntry *buckets[PARSE_CACHE_BUCKETS];
+static ParseEntry *newest = NULL;
+static ParseEntry *oldest = NULL;
+static int num_entries = 0;
+
+// the reader thread of a pipelined script parses next to the script thread
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while this thread prepares a line for the cache
+static __thread ParseDeps deps;
+static __thread bool recording = false;
+
+
+void note_parse_variable(const char *name, size_t name_len, const Variable *var) {
+    if (!recording || deps.uncacheable) return;
+    for (int i = 0; i < deps.num_vars; i++) {
+        if (deps.vars[i].name_len == name_len &&
+            memcmp(deps.names + deps.vars[i].name_off, name, name_len) == 0) {
+            return;
+        }
+    }
+    if (deps.num_vars == PARSE_DEPS_MAX || deps.names_len + name_len > PARSE_DEPS_NAMES) {
+        deps.uncacheable = true;
+        return;
+    }
+    ParseDep *dep = &deps.vars[deps.num_vars++];
+    dep->name_off = deps.names_len;
+    dep->name_len = name_len;
+    dep->version = var != NULL ? var->version : 0;
+    memcpy(deps.names + deps.names_len, name, name_len);
+    deps.names_len += name_len;
+}
+
+void note_parse_path(uint64_t generation) {
+    if (!recording) return;
+    // stages resolved by different indexes cannot be checked together
+    if (deps.path_generation != 0 && deps.path_generation != generation) {
+        deps.uncacheable = true;
+    }
+    deps.path_generation = generation;
+}
+
+void note_parse_uncacheable(void) {
+    if (recording) deps.uncacheable = true;
+}
+
+/**
+ * Copies a string that may be NULL.
+ *
+ * @return The copy, or NULL for NULL.
+ */
+char *copy_optional(const char *str) {
+    if (str == NULL) return NULL;
+    char *copy = strdup(str);
+    if (copy == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+Command *copy_commands(const Command *head) {
+    Command *copy_head = NULL, **tail = &copy_head;
+    for (const Command *cmd = head; cmd != NULL; cmd = cmd->next) {
+        Command *copy = malloc(sizeof(Command));
+        if (copy == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        *copy = *cmd;
+        copy->next = NULL;
+        copy->exec_path = copy_optional(cmd->exec_path);
+        copy->redir_in_path = copy_optional(cmd->redir_in_path);
+        copy->redir_out_path = copy_optional(cmd->redir_out_path);
+
+        int argc = 0;
+        while (cmd->args[argc] != NULL) argc++;
+        copy->args = malloc(sizeof(char *) * (argc + 1));
+        if (copy->args == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < argc; i++) {
+            copy->args[i] = copy_optional(cmd->args[i]);
+        }
+        copy->args[argc] = NULL;
+
+        if (cmd->limits != NULL) {
+            copy->limits = malloc(sizeof(ProcLimits));
+            if (copy->limits == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            *copy->limits = *cmd->limits;
+        }
+        *tail = copy;
+        tail = &copy->next;
+    }
+    return copy_head;
+}
+
+/**
+ * Checks that nothing a cached line was prepared from has changed.
+ *
+ * @param entry The cached line.
+ * @param variables Head of the variables list.
+ * @return True if preparing it again would give the same commands.
+ */
+bool entry_is_current(const ParseEntry *entry, Variable *variables) {
+    if (entry->functions_version != functions_version()) {
+        return false;
+    }
+    for (int i = 0; i < entry->num_vars; i++) {
+        const ParseDep *dep = &entry->vars[i];
+        Variable *var = find_variable_span(variables, entry->names + dep->name_off,
+                                           dep->name_len);
+        if ((var != NULL ? var->version : 0) != dep->version) {
+            return false;
+        }
+    }
+    if (entry->path_generation != 0) {
+        // the index checks its directories; PATH itself is one of the variables
+        Variable *path = find_path_variable(variables);
+        if (path == NULL || path_index_generation(path->value) != entry->path_generation) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Unlinks a cached line from the LRU list.
+ */
+void unlink_entry(ParseEntry *entry) {
+    if (entry->newer) entry->newer->older = entry->older;
+    else newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+/**
+ * Links a cached line in as the most recently used.
+ */
+void link_newest(ParseEntry *entry) {
+    entry->older = newest;
+    entry->newer = NULL;
+    if (newest) newest->newer = entry;
+    newest = entry;
+    if (oldest == NULL) oldest = entry;
+}
+
+/**
+ * Takes a cached line out of the cache and frees it.
+ */
+void drop_entry(ParseEntry *entry) {
+    ParseEntry **link = &buckets[entry->hash % PARSE_CACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+    unlink_entry(entry);
+    num_entries--;
+
+    free_command(entry->commands);
+    free(entry->text);
+    free(entry->vars);
+    free(entry->names);
+    free(entry);
+}
+
+/**
+ * Finds a cached line by its text.
+ *
+ * @return The entry, or NULL.
+ */
+ParseEntry *find_entry(const char *line, size_t len, uint64_t hash) {
+    for (ParseEntry *entry = buckets[hash % PARSE_CACHE_BUCKETS]; entry; entry = entry->chain) {
+        if (entry->hash == hash && entry->len == len && memcmp(entry->text, line, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+Command *parse_cache_lookup(const char *line, size_t len, Variable *variables) {
+    uint64_t hash = fnv1a(FNV_OFFSET, line, len);
+    Command *commands = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    ParseEntry *entry = find_entry(line, len, hash);
+    if (entry != NULL && !entry_is_current(entry, variables)) {
+        drop_entry(entry);
+    } else if (entry != NULL) {
+        unlink_entry(entry);
+        link_newest(entry);
+        commands = copy_commands(entry->commands);
+        stats_add(STAT_PARSE_HITS, 1);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return commands;
+}
+
+void parse_cache_begin(void) {
+    deps.num_vars = 0;
+    deps.names_len = 0;
+    deps.path_generation = 0;
+    deps.uncacheable = false;
+    // taken first, so a definition made while preparing is never missed
+    deps.functions_version = functions_version();
+    recording = true;
+}
+
+void parse_cache_end(const char *line, size_t len, Command *commands) {
+    recording = false;
+    if (commands == NULL || commands == (Command *) -1 || deps.uncacheable) {
+        return;
+    }
+
+    ParseEntry *entry = calloc(1, sizeof(ParseEntry));
+    if (entry == NULL || (entry->text = malloc(len)) == NULL ||
+        (entry->vars = malloc(sizeof(ParseDep) * (deps.num_vars + 1))) == NULL ||
+        (entry->names = malloc(deps.names_len + 1)) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry->text, line, len);
+    entry->len = len;
+    entry->hash = fnv1a(FNV_OFFSET, line, len);
+    memcpy(entry->vars, deps.vars, sizeof(ParseDep) * deps.num_vars);
+    entry->num_vars = deps.num_vars;
+    memcpy(entry->names, deps.names, deps.names_len);
+    entry->path_generation = deps.path_generation;
+    entry->functions_version = deps.functions_version;
+    entry->commands = copy_commands(commands);
+
+    pthread_mutex_lock(&cache_lock);
+    ParseEntry *old = find_entry(line, len, entry->hash);
+    if (old != NULL) {
+        drop_entry(old);
+    }
+    ParseEntry **bucket = &buckets[entry->hash % PARSE_CACHE_BUCKETS];
+    entry->chain = *bucket;
+    *bucket = entry;
+    link_newest(entry);
+    if (++num_entries > PARSE_CACHE_SIZE) {
+        drop_entry(oldest);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
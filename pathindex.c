@@ -0,0 +1,432 @@
+#include "cscshell.h"
+#include <pthread.h>
+#include <sys/mman.h>
+
+
+/*
+** An index file is laid out as the header, the PATH directories, the
+** hash table of command names and the strings they point into:
+**
+**     IndexHeader | IndexDir[num_dirs] | IndexBucket[num_buckets] | strings
+**
+** Offsets are into the strings, which start with an empty string so that
+** a name offset of 0 marks an empty bucket. A name is only stored for the
+** first directory of PATH that has it, which is the one a search finds.
+*/
+typedef struct IndexHeader {
+    char magic[8];
+    uint32_t num_dirs;
+    uint32_t num_buckets;
+    uint32_t path_off;
+    uint32_t strings_len;
+} IndexHeader;
+
+typedef struct IndexDir {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t path_off;
+    uint32_t present;
+} IndexDir;
+
+typedef struct IndexBucket {
+    uint32_t name_off;
+    uint32_t dir;
+} IndexBucket;
+
+/*
+** The index this process is using, either mapped from the file or built
+** in memory when the file could not be written.
+*/
+typedef struct PathIndex {
+    char *data;
+    size_t size;
+    bool mapped;
+} PathIndex;
+
+static PathIndex current = {0};
+// Bumped whenever current stops being current
+static uint64_t current_generation = 1;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Records the identity and modification time of a PATH directory.
+ *
+ * @param dir The record to fill.
+ * @param path The directory.
+ */
+void stat_index_dir(IndexDir *dir, const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        dir->present = 0;
+        dir->dev = dir->ino = 0;
+        dir->mtime_sec = dir->mtime_nsec = 0;
+        return;
+    }
+    dir->present = 1;
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->mtime_sec = st.st_mtim.tv_sec;
+    dir->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+/**
+ * Checks that an index is well formed, was built for this PATH and that
+ * none of its directories changed since.
+ *
+ * @param data The index.
+ * @param size Its size in bytes.
+ * @param path_value The current value of PATH.
+ * @return True if the index can answer lookups.
+ */
+bool index_is_current(const char *data, size_t size, const char *path_value) {
+    if (data == NULL || size < sizeof(IndexHeader)) {
+        return false;
+    }
+    const IndexHeader *header = (const IndexHeader *) data;
+    // lookups mask with num_buckets - 1, so it has to be a power of two
+    if (memcmp(header->magic, PATH_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->num_buckets == 0 ||
+        (header->num_buckets & (header->num_buckets - 1)) != 0) {
+        return false;
+    }
+
+    // the directories and buckets have to fit before the strings, which
+    // run to the end of the file
+    size_t strings_start = sizeof(IndexHeader) +
+        (size_t) header->num_dirs * sizeof(IndexDir) +
+        (size_t) header->num_buckets * sizeof(IndexBucket);
+    if (strings_start > size || size - strings_start != header->strings_len ||
+        header->strings_len == 0 || data[strings_start] != '\0' ||
+        data[size - 1] != '\0' || header->path_off >= header->strings_len) {
+        return false;
+    }
+
+    const char *strings = data + strings_start;
+    if (strcmp(strings + header->path_off, path_value) != 0) {
+        return false;
+    }
+
+    const IndexDir *dirs = (const IndexDir *) (data + sizeof(IndexHeader));
+    for (uint32_t i = 0; i < header->num_dirs; i++) {
+        if (dirs[i].path_off >= header->strings_len) {
+            return false;
+        }
+        IndexDir now;
+        stat_index_dir(&now, strings + dirs[i].path_off);
+        if (now.present != dirs[i].present || now.dev != dirs[i].dev ||
+            now.ino != dirs[i].ino || now.mtime_sec != dirs[i].mtime_sec ||
+            now.mtime_nsec != dirs[i].mtime_nsec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Appends a string to the string area of an index being built.
+ *
+ * @return Its offset, or 0 if the allocation failed.
+ */
+uint32_t add_index_string(char **strings, size_t *len, size_t *cap, const char *str) {
+    size_t str_len = strlen(str) + 1;
+    if (*len + str_len > *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 4096;
+        while (new_cap < *len + str_len) new_cap *= 2;
+        char *grown = realloc(*strings, new_cap);
+        if (grown == NULL) {
+            return 0;
+        }
+        *strings = grown;
+        *cap = new_cap;
+    }
+    memcpy(*strings + *len, str, str_len);
+    *len += str_len;
+    return (uint32_t) (*len - str_len);
+}
+
+/**
+ * Builds an index by listing every directory of PATH.
+ *
+ * @param path_value The value of PATH.
+ * @param size Set to the size of the index.
+ * @return The index on the heap, or NULL on error.
+ */
+char *build_path_index(const char *path_value, size_t *size) {
+    char *strings = NULL, *data = NULL;
+    size_t strings_len = 0, strings_cap = 0;
+    IndexDir *dirs = NULL;
+    IndexBucket *names = NULL;
+    size_t num_dirs = 0, num_names = 0, names_cap = 0;
+
+    char *path_copy = strdup(path_value);
+    if (path_copy == NULL || add_index_string(&strings, &strings_len, &strings_cap, "") != 0) {
+        goto build_fail;
+    }
+    uint32_t path_off = add_index_string(&strings, &strings_len, &strings_cap, path_value);
+    if (path_off == 0) {
+        goto build_fail;
+    }
+
+    dirs = malloc(sizeof(IndexDir) * (strlen(path_value) / 2 + 1));
+    if (dirs == NULL) {
+        goto build_fail;
+    }
+
+    char *savePtr;
+    for (char *dir_path = strtok_r(path_copy, ":", &savePtr); dir_path != NULL;
+         dir_path = strtok_r(NULL, ":", &savePtr)) {
+        IndexDir *dir = &dirs[num_dirs];
+        dir->path_off = add_index_string(&strings, &strings_len, &strings_cap, dir_path);
+        if (dir->path_off == 0) {
+            goto build_fail;
+        }
+        // taken before listing, so a change during the listing is noticed
+        stat_index_dir(dir, dir_path);
+
+        DIR *listing = opendir(dir_path);
+        if (listing == NULL) {
+            ERR_PRINT(ERR_BAD_PATH, dir_path);
+            num_dirs++;
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(listing)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            if (num_names == names_cap) {
+                names_cap = names_cap ? names_cap * 2 : 1024;
+                IndexBucket *grown = realloc(names, sizeof(IndexBucket) * names_cap);
+                if (grown == NULL) {
+                    closedir(listing);
+                    goto build_fail;
+                }
+                names = grown;
+            }
+            names[num_names].name_off =
+                add_index_string(&strings, &strings_len, &strings_cap, entry->d_name);
+            names[num_names].dir = (uint32_t) num_dirs;
+            if (names[num_names].name_off == 0) {
+                closedir(listing);
+                goto build_fail;
+            }
+            num_names++;
+        }
+        closedir(listing);
+        num_dirs++;
+    }
+
+    size_t num_buckets = 16;
+    while (num_buckets < num_names * 2) num_buckets *= 2;
+
+    size_t strings_start = sizeof(IndexHeader) + num_dirs * sizeof(IndexDir) +
+        num_buckets * sizeof(IndexBucket);
+    *size = strings_start + strings_len;
+    data = calloc(1, *size);
+    if (data == NULL) {
+        goto build_fail;
+    }
+
+    IndexHeader *header = (IndexHeader *) data;
+    memcpy(header->magic, PATH_INDEX_MAGIC, sizeof(header->magic));
+    header->num_dirs = (uint32_t) num_dirs;
+    header->num_buckets = (uint32_t) num_buckets;
+    header->path_off = path_off;
+    header->strings_len = (uint32_t) strings_len;
+    memcpy(data + sizeof(IndexHeader), dirs, num_dirs * sizeof(IndexDir));
+    memcpy(data + strings_start, strings, strings_len);
+
+    // names are added in PATH order, so an earlier directory keeps a name
+    IndexBucket *buckets = (IndexBucket *) (data + sizeof(IndexHeader) +
+                                            num_dirs * sizeof(IndexDir));
+    for (size_t i = 0; i < num_names; i++) {
+        const char *name = strings + names[i].name_off;
+        size_t slot = fnv1a_str(FNV_OFFSET, name) & (num_buckets - 1);
+        while (buckets[slot].name_off != 0 &&
+               strcmp(strings + buckets[slot].name_off, name) != 0) {
+            slot = (slot + 1) & (num_buckets - 1);
+        }
+        if (buckets[slot].name_off == 0) {
+            buckets[slot] = names[i];
+        }
+    }
+
+    free(path_copy);
+    free(strings);
+    free(dirs);
+    free(names);
+    return data;
+
+build_fail:
+    free(path_copy);
+    free(strings);
+    free(dirs);
+    free(names);
+    free(data);
+    return NULL;
+}
+
+/**
+ * Finds the file the index for a PATH value is kept in.
+ *
+ * @param path_value The value of PATH.
+ * @param file Buffer of MAX_PATH_STR bytes for the file name.
+ * @return 0 on success, -1 if there is no usable cache directory.
+ */
+int path_index_file(const char *path_value, char *file) {
+    char dir[MAX_PATH_STR];
+    if (cache_dir(dir) < 0) {
+        return -1;
+    }
+    int written = snprintf(file, MAX_PATH_STR, "%s/%s%016" PRIx64, dir,
+                           PATH_INDEX_PREFIX, fnv1a_str(FNV_OFFSET, path_value));
+    return written < MAX_PATH_STR ? 0 : -1;
+}
+
+/**
+ * Maps an index file.
+ *
+ * @param file The index file.
+ * @param index Filled in with the mapping on success.
+ * @return True if the file could be mapped.
+ */
+bool map_path_index(const char *file, PathIndex *index) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    index->data = data;
+    index->size = st.st_size;
+    index->mapped = true;
+    return true;
+}
+
+void replace_file(const char *file, const char *data, size_t size) {
+    char tmp_path[MAX_PATH_STR];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", file) >= (int) sizeof(tmp_path)) {
+        return;
+    }
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    int written = write_all(fd, data, size);
+    if (close(fd) < 0 || written < 0 || rename(tmp_path, file) < 0) {
+        unlink(tmp_path);
+    }
+}
+
+/**
+ * Drops the index this process is using.
+ */
+void release_path_index(PathIndex *index) {
+    if (index->mapped) {
+        munmap(index->data, index->size);
+    } else {
+        free(index->data);
+    }
+    index->data = NULL;
+    index->size = 0;
+    index->mapped = false;
+}
+
+/**
+ * Makes sure the process has an index that is current for a PATH value:
+ * the one it has, the shared file, or a freshly built one that is then
+ * shared.
+ *
+ * @param path_value The value of PATH.
+ * @return True if current holds a usable index.
+ */
+bool ensure_path_index(const char *path_value) {
+    if (index_is_current(current.data, current.size, path_value)) {
+        return true;
+    }
+    release_path_index(&current);
+    current_generation++;
+
+    char file[MAX_PATH_STR];
+    bool has_file = path_index_file(path_value, file) == 0;
+    if (has_file && map_path_index(file, &current)) {
+        if (index_is_current(current.data, current.size, path_value)) {
+            return true;
+        }
+        release_path_index(&current);
+    }
+
+    size_t size;
+    char *data = build_path_index(path_value, &size);
+    if (data == NULL) {
+        return false;
+    }
+    if (has_file) {
+        replace_file(file, data, size);
+    }
+    current.data = data;
+    current.size = size;
+    current.mapped = false;
+    return true;
+}
+
+int path_index_lookup(const char *name, const char *path_value, char **exec_path,
+                      uint64_t *generation) {
+    pthread_mutex_lock(&index_lock);
+    if (!ensure_path_index(path_value)) {
+        pthread_mutex_unlock(&index_lock);
+        return 0;
+    }
+    *generation = current_generation;
+
+    const IndexHeader *header = (const IndexHeader *) current.data;
+    const IndexDir *dirs = (const IndexDir *) (current.data + sizeof(IndexHeader));
+    const IndexBucket *buckets = (const IndexBucket *) (dirs + header->num_dirs);
+    const char *strings = (const char *) (buckets + header->num_buckets);
+    uint32_t mask = header->num_buckets - 1;
+
+    *exec_path = NULL;
+    size_t slot = fnv1a_str(FNV_OFFSET, name) & mask;
+    for (uint32_t probes = 0; probes <= mask && buckets[slot].name_off != 0;
+         probes++, slot = (slot + 1) & mask) {
+        if (buckets[slot].name_off >= header->strings_len ||
+            buckets[slot].dir >= header->num_dirs) {
+            break;
+        }
+        if (strcmp(strings + buckets[slot].name_off, name) != 0) {
+            continue;
+        }
+
+        const char *dir = strings + dirs[buckets[slot].dir].path_off;
+        size_t dir_len = strlen(dir);
+        bool needs_slash = dir_len > 0 && dir[dir_len - 1] != '/';
+        *exec_path = malloc(dir_len + needs_slash + strlen(name) + 1);
+        if (*exec_path == NULL) {
+            perror("resolve_executable");
+            break;
+        }
+        strcpy(*exec_path, dir);
+        if (needs_slash) strcat(*exec_path, "/");
+        strcat(*exec_path, name);
+        break;
+    }
+    pthread_mutex_unlock(&index_lock);
+    return 1;
+}
+
+uint64_t path_index_generation(const char *path_value) {
+    pthread_mutex_lock(&index_lock);
+    uint64_t generation = ensure_path_index(path_value) ? current_generation : 0;
+    pthread_mutex_unlock(&index_lock);
+    return generation;
+}
@@ -0,0 +1,215 @@
+#include "cscshell.h"
+#include <ctype.h>
+#include <sys/mman.h>
+
+
+// Readers whose file is mapped, for the SIGBUS handler to find
+static ScriptReader *mapped[MAPPED_SCRIPTS_MAX];
+static bool bus_handler_installed = false;
+static uintptr_t page_size;
+
+
+/**
+ * Handles a read past the end of a mapped script that shrank while it
+ * ran. The rest of the mapping is replaced with zeros, so the read that
+ * faulted can finish, and the reader is marked as truncated. A fault
+ * anywhere else gets the default action once the handler returns.
+ */
+void script_bus_handler(int sig, siginfo_t *info, void *context) {
+    (void) context;
+    const char *addr = info->si_addr;
+    for (int i = 0; i < MAPPED_SCRIPTS_MAX; i++) {
+        ScriptReader *reader = __atomic_load_n(&mapped[i], __ATOMIC_ACQUIRE);
+        if (reader == NULL || addr < reader->data || addr >= reader->data + reader->size) {
+            continue;
+        }
+        uintptr_t page = (uintptr_t) addr & ~(page_size - 1);
+        uintptr_t end = (uintptr_t) reader->data + reader->size;
+        if (mmap((void *) page, end - page, PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            break;
+        }
+        reader->truncated = 1;
+        return;
+    }
+    signal(sig, SIG_DFL);
+}
+
+/**
+ * Maps a script's file if it is a regular file and a slot is free for
+ * it, leaving the reader to read a line at a time otherwise.
+ *
+ * @param reader The reader, already open on its file.
+ */
+void map_script(ScriptReader *reader) {
+    struct stat st;
+    int fd = fileno(reader->file);
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return;
+    }
+
+    int slot = 0;
+    while (slot < MAPPED_SCRIPTS_MAX && mapped[slot] != NULL) slot++;
+    if (slot == MAPPED_SCRIPTS_MAX) {
+        return;
+    }
+    if (!bus_handler_installed) {
+        struct sigaction action = {0};
+        action.sa_sigaction = script_bus_handler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGBUS, &action, NULL) < 0) {
+            return;
+        }
+        page_size = sysconf(_SC_PAGESIZE);
+        bus_handler_installed = true;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    reader->data = data;
+    reader->size = st.st_size;
+    reader->slot = slot;
+    __atomic_store_n(&mapped[slot], reader, __ATOMIC_RELEASE);
+}
+
+void open_script_reader(ScriptReader *reader, FILE *file) {
+    memset(reader, 0, sizeof(ScriptReader));
+    reader->file = file;
+    reader->slot = -1;
+    map_script(reader);
+}
+
+/**
+ * Finds the next physical line of the mapped part of a file, without
+ * its newline.
+ *
+ * @param reader The reader.
+ * @param line Set to the start of the line in the mapping.
+ * @return Its length, or -1 at the end of the mapping.
+ */
+ssize_t read_mapped_line(ScriptReader *reader, const char **line) {
+    if (reader->pos >= reader->size) {
+        return -1;
+    }
+    const char *start = reader->data + reader->pos;
+    size_t left = reader->size - reader->pos;
+    const char *newline = memchr(start, '\n', left);
+    size_t len = newline != NULL ? (size_t) (newline - start) : left;
+
+    reader->pos += len + (newline != NULL);
+    *line = start;
+    return len;
+}
+
+/**
+ * Reads the next physical line into the buffer the last line did not go
+ * to, stripping its newline.
+ *
+ * @param reader The reader.
+ * @param line Set to the line.
+ * @return Its length, or -1 at the end of the file.
+ */
+ssize_t read_buffered_line(ScriptReader *reader, const char **line) {
+    int buf = reader->next_buf;
+    ssize_t read = getline(&reader->bufs[buf], &reader->caps[buf], reader->file);
+    if (read == -1) {
+        return -1;
+    }
+    if (read > 0 && reader->bufs[buf][read - 1] == '\n') {
+        reader->bufs[buf][--read] = '\0';
+    }
+    reader->next_buf = !buf;
+    *line = reader->bufs[buf];
+    return read;
+}
+
+/**
+ * Reads the next physical line of the script. Lines written after the
+ * end of the mapping, by a script that appends to itself, are read from
+ * the file as they would be without one.
+ *
+ * @param reader The reader.
+ * @param line Set to the line.
+ * @return Its length, or -1 at the end of the file.
+ */
+ssize_t read_physical_line(ScriptReader *reader, const char **line) {
+    if (reader->truncated) {
+        return -1;
+    }
+    if (reader->data != NULL && !reader->past_mapping) {
+        ssize_t len = read_mapped_line(reader, line);
+        // zeros stand in for what was cut off; the script ends there
+        if (len != -1 || reader->truncated) {
+            return reader->truncated ? -1 : len;
+        }
+        if (fseeko(reader->file, reader->size, SEEK_SET) < 0) {
+            return -1;
+        }
+        reader->past_mapping = true;
+    }
+    return read_buffered_line(reader, line);
+}
+
+/**
+ * Reads ahead to the next line that could run anything, skipping blank
+ * and comment-only lines.
+ *
+ * @param reader The reader.
+ */
+void fill_pending_line(ScriptReader *reader) {
+    ssize_t len;
+    while ((len = read_physical_line(reader, &reader->pending)) != -1) {
+        reader->lines_read++;
+        const char *start = reader->pending, *end = start + len;
+        while (start < end && isspace((unsigned char)*start)) start++;
+        if (start < end && *start != COMMENT_MARKER) break;
+    }
+    reader->pending_len = len;
+    reader->pending_no = reader->lines_read;
+    reader->has_pending = true;
+}
+
+ssize_t next_script_line(ScriptReader *reader, const char **line) {
+    if (!reader->has_pending) {
+        fill_pending_line(reader);
+    }
+    reader->has_pending = false;
+    *line = reader->pending;
+    reader->line_no = reader->pending_no;
+    return reader->pending_len;
+}
+
+bool script_line_cut(ScriptReader *reader, const char *line, size_t len) {
+    if (reader->data == NULL || reader->truncated) {
+        return reader->truncated;
+    }
+    // a cut inside the last page reads as zeros without any fault, but a
+    // zero byte may just as well be in the file
+    struct stat st;
+    if (memchr(line, '\0', len) != NULL && fstat(fileno(reader->file), &st) == 0 &&
+        (size_t) st.st_size < reader->size) {
+        reader->truncated = 1;
+    }
+    return reader->truncated;
+}
+
+bool script_reader_at_end(ScriptReader *reader) {
+    if (!reader->has_pending) {
+        fill_pending_line(reader);
+    }
+    return reader->pending_len == -1;
+}
+
+void close_script_reader(ScriptReader *reader) {
+    if (reader->data != NULL) {
+        __atomic_store_n(&mapped[reader->slot], NULL, __ATOMIC_RELEASE);
+        munmap((void *) reader->data, reader->size);
+    }
+    free(reader->bufs[0]);
+    free(reader->bufs[1]);
+    memset(reader, 0, sizeof(ScriptReader));
+}
@@ -1,5 +1,6 @@
 #include "cscshell.h"
 #include <unistd.h>
+#include <ctype.h>
 
 
 // COMPLETE
@@ -22,6 +23,7 @@ int cd_cscshell(const char *target_dir){
         perror("cd_cscshell");
         return -1;
     }
+    fd_cache_chdir();
     return 0;
 }
 
@@ -36,80 +38,262 @@ int cd_cscshell(const char *target_dir){
 ** -- If there were any errors starting any commands,
 **    returns (pointer value) -1
 */
+/**
+ * Tells whether a builtin stage would read the terminal under job
+ * control: read, with nothing in front of it and no `<` redirection.
+ *
+ * @param builtin The stage's builtin.
+ * @param command The stage.
+ * @param ring_in The ring from the stage before it, or NULL.
+ * @return True if it has to run in the foreground job.
+ */
+bool stage_reads_terminal(const Builtin *builtin, Command *command, StageRing *ring_in) {
+    return shell_options.job_control && builtin->stage == builtin_read &&
+           ring_in == NULL && command->stdin_fd == STDIN_FILENO &&
+           command->redir_in_path == NULL;
+}
+
 int *execute_line(Command *head) {
+    Variable *variables = NULL;
+    int *status = execute_pipeline(head, &variables);
+    free_variable(variables, NON_ZERO_BYTE);
+    return status;
+}
+
+int *execute_pipeline(Command *head, Variable **root) {
     if (head == NULL) {
         // No commands to execute
         return NULL;
     }
 
+    // a timed line runs in its own process group, so all of it can be
+    // signalled at once
+    Command *first = head;
+    PipelineWait wait = {0};
+    wait.timeout_ms = head->timeout_ms ? head->timeout_ms : shell_options.line_timeout_ms;
+    wait.kill_after_ms = head->timeout_ms ? head->kill_after_ms : TIMEOUT_KILL_AFTER_MS;
+    wait.teardown = shell_options.pipe_teardown && head->next != NULL;
+    wait.in_order_failures = shell_options.pipefail && head->next != NULL;
+    pid_t pgid = wait.timeout_ms || wait.teardown ? PGID_NEW : 0;
+
+    // with job control every pipeline is a job of its own, and the wait
+    // ends early if it is stopped from the terminal
+    if (shell_options.job_control) {
+        pgid = PGID_NEW;
+        wait.untraced = true;
+    }
+
+    // stages that never start keep -1
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next) {
+        cmd->status = -1;
+    }
+
     int *status = malloc(sizeof(int));
     if (status == NULL) {
         exit(EXIT_FAILURE);
     }
+    *status = 0;
 
     int pipefd[2]; // Pipe file descriptors
     pid_t pid;   // Process ID
-    pid_t *pids = malloc(sizeof(pid_t)); // Array of child PIDs
+    pid_t *pids = NULL; // Array of child PIDs
     int num_pids = 0; // Number of child PIDs
 
+    // Builtin stages run on threads and hold 0 in pids; adjacent ones
+    // are joined by rings instead of pipes
+    StageThread **stages = calloc(1, sizeof(StageThread *));
+    StageRing **rings = NULL;
+    int num_rings = 0;
+    StageRing *ring_in = NULL;
+    if (stages == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
     while (head != NULL) { // Loop through all the commands in the line
         if (strcmp(head->args[0], "cd") == 0) { 
             // Handle 'cd' command separately
             *status = cd_cscshell(head->args[1]);
-            return status;
+            head->status = *status;
+            break;
         }
 
-        // Create a pipe
-        if (pipe(pipefd) == -1) {
-            perror("pipe");
+        if (head->exec_replace) {
+            // the parser only allows exec on a line of its own;
+            // on success this never returns
+            fflush(NULL);
+            stats_add(STAT_EXECS, 1);
+            exec_command(head);
             *status = -1;
-            return status;
+            break;
+        }
+
+        if (head->batch_jobs) {
+            // the parser only allows batch on a line of its own
+            *status = run_batched(head);
+            break;
+        }
+
+        if (head->cached) {
+            // likewise for cached
+            *status = run_cached(head);
+            break;
+        }
+
+        const Builtin *builtin = shell_builtin(head);
+        if (builtin != NULL) {
+            // only the foreground job may read the terminal, and the
+            // shell's thread is not in it
+            bool forked = stage_reads_terminal(builtin, head, ring_in);
+            StageIO io = {head->stdin_fd, STDOUT_FILENO, ring_in, NULL,
+                          shell_options.interactive ? stdin : NULL};
+            head->stdin_fd = STDIN_FILENO;
+            ring_in = NULL;
+            if (!forked && head->next != NULL && shell_builtin(head->next) != NULL) {
+                rings = realloc(rings, (num_rings + 1) * sizeof(StageRing *));
+                if (rings == NULL) {
+                    exit(EXIT_FAILURE);
+                }
+                rings[num_rings++] = ring_in = io.out_ring = stage_ring_new();
+            } else if (head->next != NULL) {
+                if (pipe2(pipefd, O_CLOEXEC) == -1) {
+                    perror("pipe");
+                    close_stage_io(&io);
+                    *status = -1;
+                    break;
+                }
+                io.out_fd = pipefd[1];
+                head->next->stdin_fd = pipefd[0];
+            }
+
+            StageThread *stage = NULL;
+            pid = 0;
+            if (forked) {
+                head->pgid = pgid;
+                pid = fork_stage(builtin, head, root, &io);
+                if (pid != -1 && pgid == PGID_NEW) {
+                    pgid = pid;
+                    give_terminal(pgid);
+                }
+            } else {
+                stage = start_stage(builtin, head, root, &io);
+            }
+            if (pid == -1 || (!forked && stage == NULL)) {
+                *status = -1;
+                break;
+            }
+            pids = realloc(pids, (num_pids + 1) * sizeof(pid_t));
+            stages = realloc(stages, (num_pids + 1) * sizeof(StageThread *));
+            if (pids == NULL || stages == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            stages[num_pids] = stage;
+            pids[num_pids++] = pid;
+            head = head->next;
+            continue;
+        }
+
+        // Connect this command's output to the next command's input.
+        // Both ends are close-on-exec so only the dup'd copies survive.
+        if (head->next != NULL) {
+            if (pipe2(pipefd, O_CLOEXEC) == -1) {
+                perror("pipe");
+                *status = -1;
+                break;
+            }
+            head->stdout_fd = pipefd[1];
+            head->next->stdin_fd = pipefd[0];
         }
 
         // Run the command
+        head->pgid = pgid;
         pid = run_command(head);
         if (pid == -1) {
             // Error starting the command
             *status = -1;
-            return status;
+            break;
+        }
+        if (pgid == PGID_NEW) {
+            pgid = pid;
+            if (shell_options.job_control) give_terminal(pgid);
         }
 
         // Add the PID to the array
         pids = realloc(pids, (num_pids + 1) * sizeof(pid_t));
-        if (pids == NULL) {
+        stages = realloc(stages, (num_pids + 1) * sizeof(StageThread *));
+        if (pids == NULL || stages == NULL) {
             exit(EXIT_FAILURE);
         }
+        stages[num_pids] = NULL;
         pids[num_pids++] = pid;
 
-        // Close the write end of the pipe in the parent
-        if (close(pipefd[1]) == -1) {
-            perror("pipe");
-            *status = -1;
-            return status;
+        head = head->next;
+    }
+
+    // A failed start leaves the read end for the next command open
+    for (; head != NULL; head = head->next) {
+        if (head->stdin_fd != STDIN_FILENO) {
+            close(head->stdin_fd);
+            head->stdin_fd = STDIN_FILENO;
         }
+    }
+    if (ring_in != NULL) {
+        stage_ring_close(ring_in, false);
+    }
 
-        // Make the read end of the pipe the standard input for the next command
-        if (dup2(pipefd[0], STDIN_FILENO) == -1) {
-            perror("dup2");
-            *status = -1;
-            return status;
+    // Wait for all child processes to finish
+    if (num_pids > 0) {
+        int *statuses = calloc(num_pids, sizeof(int));
+        if (statuses == NULL) {
+            exit(EXIT_FAILURE);
         }
+        wait.pgid = pgid;
+        int child_status = wait_pipeline(pids, statuses, num_pids, &wait);
 
-        // Close the read end of the pipe
-        if (close(pipefd[0]) == -1) {
-            perror("pipe");
-            *status = -1;
-            return status;
+        // builtin stages finish once their neighbours have, which those
+        // of a stopped job may never do; its job finishes them instead
+        if (!wait.stopped) {
+            wait.first_failed = finish_stages(stages, statuses, num_pids, wait.first_failed);
+        }
+        child_status = statuses[num_pids - 1];
+
+        if (shell_options.job_control) {
+            struct termios job_modes;
+            take_terminal(wait.stopped ? &job_modes : NULL);
+            if (wait.stopped) {
+                suspend_job(first, pgid, pids, statuses, stages, num_pids,
+                            rings, num_rings, &job_modes);
+                num_rings = 0;
+                for (int i = 0; i < num_pids; i++) {
+                    if (WIFSTOPPED(statuses[i])) child_status = statuses[i];
+                }
+            }
         }
 
-        head = head->next;
+        Command *stage = first;
+        for (int i = 0; i < num_pids; i++, stage = stage->next) {
+            stage->status = statuses[i];
+            if (i == wait.first_failed && wait.torn_down) {
+                ERR_PRINT(ERR_PIPE_TEARDOWN, stage->args[0]);
+            }
+        }
+        if (shell_options.pipefail && wait.first_failed >= 0) {
+            child_status = statuses[wait.first_failed];
+        }
+        if (wait.timed_out) {
+            ERR_PRINT(ERR_TIMED_OUT, first->args[0]);
+            child_status = W_EXITCODE(TIMEOUT_EXIT_STATUS, 0);
+        }
+        if (*status != -1) {
+            *status = child_status;
+        }
+        free(statuses);
     }
 
-    // Wait for all child processes to finish
-    for (int i = 0; i < num_pids; i++) {
-        waitpid(pids[i], status, 0);
+    for (int i = 0; i < num_rings; i++) {
+        stage_ring_free(rings[i]);
     }
-
+    free(rings);
+    free(stages);
     free(pids);
 
     return status;
@@ -136,6 +320,124 @@ int *execute_line(Command *head) {
 }
 
 
+/*
+** Closes the pipe ends execute_pipeline attached to a command, once a child
+** owns its own copies of them (or will never be started).
+*/
+void close_command_fds(Command *command) {
+    if (command->redir_out_fd > 0) {
+        close(command->redir_out_fd);
+        command->redir_out_fd = 0;
+    }
+    if (command->stdin_fd != STDIN_FILENO) {
+        close(command->stdin_fd);
+        command->stdin_fd = STDIN_FILENO;
+    }
+    if (command->stdout_fd != STDOUT_FILENO) {
+        close(command->stdout_fd);
+        command->stdout_fd = STDOUT_FILENO;
+    }
+}
+
+
+/*
+** Sets up the file descriptors of a command in the current process and
+** execs it. Used by forked children, and by the shell itself to replace
+** its own process for `exec` and for the last command of a script.
+**
+** Returns -1 if the command could not be exec'd.
+*/
+int exec_command(Command *command) {
+    if (command->exec_path == NULL) {
+        ERR_PRINT(ERR_NO_EXECU, command->args[0]);
+        return -1;
+    }
+
+    // the job's group must have the terminal before the command can read
+    // it, whichever of the shell and the child gets there first
+    if (shell_options.job_control) {
+        enter_job();
+    }
+
+    if (command->limits != NULL && apply_limits(command->limits) < 0) {
+        return -1;
+    }
+
+    // Pipes to neighbouring commands come first, so that
+    // redirections to files take precedence over them
+    if (command->stdin_fd != STDIN_FILENO &&
+        dup2(command->stdin_fd, STDIN_FILENO) < 0) {
+        perror("dup2");
+        return -1;
+    }
+    if (command->stdout_fd != STDOUT_FILENO &&
+        dup2(command->stdout_fd, STDOUT_FILENO) < 0) {
+        perror("dup2");
+        return -1;
+    }
+
+    // Input redirection
+    if (command->redir_in_path != NULL) {
+        // Open the file for reading
+        // O_RDONLY is used to open the file for reading only
+        int in_fd = open(command->redir_in_path, O_RDONLY, 0777);
+        if (in_fd < 0) {
+            perror("open");
+            return -1;
+        }
+
+        // Redirect stdin to the file
+        if (dup2(in_fd, STDIN_FILENO) < 0) {
+            perror("dup2");
+            if (close(in_fd) < 0) {
+                perror("close");
+            }
+            return -1;
+        }
+
+        // Close the file descriptor
+        if (close(in_fd) < 0) {
+            perror("close");
+            return -1;
+        }
+    }
+
+    // Output redirection
+    if (command->redir_out_path != NULL) {
+        // run_command opens appending redirections in the shell, whose
+        // cache keeps the file open for the next command
+        int out_fd = command->redir_out_fd > 0 ? command->redir_out_fd
+                                               : open_redirect_out(command);
+        if (out_fd < 0) {
+            perror("open");
+            return -1;
+        }
+
+        // Redirect stdout to the file
+        if (dup2(out_fd, STDOUT_FILENO) < 0) {
+            perror("dup2");
+            if (close(out_fd) < 0) {
+                perror("close");
+            }
+            return -1;
+        }
+
+        if (close(out_fd) < 0) {
+            perror("close");
+            return -1;
+        }
+
+    }
+
+    // Execute the command using execv
+    execv(command->exec_path, command->args);
+    
+    // execv only returns if an error occurred
+    perror("execv");
+    return -1;
+}
+
+
 /*
 ** Forks a new process and execs the command
 ** making sure all file descriptors are set up correctly.
@@ -152,18 +454,21 @@ int run_command(Command *command){
     }
 
     if (command->exec_path == NULL) { // Check if the executable path is NULL
+        ERR_PRINT(ERR_NO_EXECU, command->args[0]);
+        close_command_fds(command);
         return -1; 
     }
 
     if (command->args[0] == NULL) { // This means arguments weren't initialized properly
+        close_command_fds(command);
         return -1; // args[0] should be the executable path
     }
 
-    int pipe_fds[2];
-    if (command->stdout_fd != STDOUT_FILENO) {
-        // A pipe is needed if the stdout file descriptor is not STDOUT_FILENO
-        if (pipe(pipe_fds) < 0) {
-            perror("pipe");
+    if (command->redir_out_path != NULL && command->redir_append) {
+        command->redir_out_fd = open_redirect_out(command);
+        if (command->redir_out_fd < 0) {
+            perror("open");
+            close_command_fds(command);
             return -1;
         }
     }
@@ -174,127 +479,28 @@ int run_command(Command *command){
     if (pid < 0) {
         // Fork failed
         perror("fork");
+        close_command_fds(command);
         return -1;
     } else if (pid == 0) {
         // Child process
-
-        // Input redirection
-        if (command->redir_in_path != NULL) {
-            // Open the file for reading
-            // O_RDONLY is used to open the file for reading only
-            int in_fd = open(command->redir_in_path, O_RDONLY, 0777);
-            if (in_fd < 0) {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-
-            // Redirect stdin to the file
-            if (dup2(in_fd, STDIN_FILENO) < 0) {
-                perror("dup2");
-                if (close(in_fd) < 0) {
-                    perror("close");
-                }
-                exit(EXIT_FAILURE);
-            }
-
-            // Close the file descriptor
-            if (close(in_fd) < 0) {
-                perror("close");
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        // Output redirection
-        if (command->redir_out_path != NULL) {
-            int flags = O_WRONLY | O_CREAT; // Default flags
-            // O_WRONGLY is used to open the file for writing only
-            // O_CREAT is used to create the file if it does not exist
-            if (command->redir_append) {
-                flags |= O_APPEND; // Append to the file if it exists
-            } else {
-                flags |= O_TRUNC; // Truncate the file if it exists
-            }
-
-            // Open the file for writing
-            int out_fd = open(command->redir_out_path, flags, 0777);
-            // 0777 is the permission mode for the file
-            if (out_fd < 0) {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-
-            // Redirect stdout to the file
-            if (dup2(out_fd, STDOUT_FILENO) < 0) {
-                perror("dup2");
-                if (close(out_fd) < 0) {
-                    perror("close");
-                }
-                exit(EXIT_FAILURE);
-            }
-
-            if (close(out_fd) < 0) {
-                perror("close");
-                exit(EXIT_FAILURE);
-            }
-
-        // If stdout_fd is not STDOUT_FILENO, output needs to go to a pipe
-        } else if (command->stdout_fd != STDOUT_FILENO) {
-            // Output needs to go to a pipe
-            if (close(pipe_fds[0]) < 0) {
-                perror("close");
-                exit(EXIT_FAILURE);
-            } // Close unused read end
-
-            if (dup2(pipe_fds[1], STDOUT_FILENO) < 0) {
-                perror("dup2");
-                if (close(pipe_fds[1]) < 0) {
-                    perror("close");
-                }
-                exit(EXIT_FAILURE);
-            }
-
-            if (close(pipe_fds[1]) < 0) {
-                perror("close");
-                exit(EXIT_FAILURE);
-            }
-
-        } else if (command->stdin_fd != STDIN_FILENO) {
-            // Input needs to come from a pipe
-            if (close(pipe_fds[1]) < 0) {
-                perror("close");
-                exit(EXIT_FAILURE);
-            } // Close unused write end
-
-            if (dup2(command->stdin_fd, STDIN_FILENO) < 0) {
-                perror("dup2");
-                if (close(command->stdin_fd) < 0) {
-                    perror("close");
-                }
-                exit(EXIT_FAILURE);
-            }
-
-            if (close(command->stdin_fd) < 0) {
-                perror("close");
-                exit(EXIT_FAILURE);
-            }
+        if (command->pgid != 0) {
+            setpgid(0, command->pgid == PGID_NEW ? 0 : command->pgid);
         }
 
-        // Execute the command using execv
-        execv(command->exec_path, command->args);
-        
-        // execv only returns if an error occurred
-        perror("execv");
-        exit(EXIT_FAILURE);
+        // _exit, so the shell's unflushed output is not written twice
+        exec_command(command);
+        _exit(EXIT_FAILURE);
    
     } else {
-        // Parent process
-        if (command->stdout_fd != STDOUT_FILENO) {
-            if (close(pipe_fds[1]) < 0) {
-                perror("close");
-                return -1;
-            } // Close unused write end
-            command->stdin_fd = pipe_fds[0]; // Next command reads from here
+        // Parent process: the child has its own copies of the pipe ends.
+        // The group is set on both sides, whichever runs first.
+        if (command->pgid != 0) {
+            setpgid(pid, command->pgid == PGID_NEW ? pid : command->pgid);
         }
+        close_command_fds(command);
+        stats_add(STAT_FORKS, 1);
+        stats_add(STAT_EXECS, 1);
+        stats_child_started(pid);
         return pid; // Return child's PID to the caller
     }
 
@@ -325,6 +531,103 @@ int run_command(Command *command){
     #endif
 }
 
+int exit_code(int status) {
+    if (status < 0) {
+        return 1;
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : status;
+}
+
+int *execute_shell_line(Command *head, Variable **root) {
+    if (head == NULL) {
+        return NULL;
+    }
+
+    int *status;
+    bool per_stage = false;
+    Function *fn = find_function(head->args[0]);
+    const Builtin *builtin = shell_builtin(head);
+    if (fn != NULL && head->next == NULL) {
+        // prepare_line keeps functions out of pipelines and prefixes
+        status = call_function(fn, head->args, root);
+    } else if (builtin != NULL && head->next == NULL) {
+        status = run_builtin(builtin, head, root);
+    } else {
+        status = execute_pipeline(head, root);
+        per_stage = true;
+    }
+    if (status == NULL || status == (int *) -1) {
+        return status;
+    }
+
+    char codes[MAX_SINGLE_LINE];
+    size_t used = 0;
+    for (Command *cmd = head; cmd != NULL && used < sizeof(codes); cmd = cmd->next) {
+        used += snprintf(codes + used, sizeof(codes) - used, "%s%d", used ? " " : "",
+                         exit_code(per_stage ? cmd->status : *status));
+        if (!per_stage) break;
+    }
+    set_pipestatus(root, codes);
+    return status;
+}
+
+/*
+** Turns the last command of a script into an exec of the shell itself
+** when nothing in the shell needs to run after it: a single external
+** command, with no function definition left open.
+*/
+void mark_tail_exec(Command *command) {
+    if (command->next != NULL || command->batch_jobs || command->cached ||
+        command->timeout_ms || shell_options.line_timeout_ms ||
+        command->exec_path == NULL || function_definition_pending() ||
+        strcmp(command->args[0], CD) == 0 ||
+        shell_builtin(command) || find_function(command->args[0])) {
+        return;
+    }
+    command->exec_replace = 1;
+}
+
+int run_script_line(Command *command, const char *line, size_t line_len,
+                    size_t line_no, bool exec_in_place, IncrementalLog *log,
+                    Variable **root) {
+    if (command == (Command *) -1){
+        ERR_PRINT(ERR_PARSING_LINE);
+        return 0;
+    }
+    if (command == NULL) {
+        return 0;
+    }
+    if (log != NULL && line_is_up_to_date(command)) {
+        incremental_note(log, line_no, 0, 0, line, line_len);
+        free_command(command);
+        return 0;
+    }
+
+    if (exec_in_place) {
+        mark_tail_exec(command);
+    }
+
+    // Execute the command
+    int *status_ptr = execute_shell_line(command, root);
+    free_command(command);
+    if (status_ptr == (int *) -1) {
+        incremental_note(log, line_no, 1, -1, line, line_len);
+        return -1;
+    }
+
+    // Check the status of the executed command
+    int status = *status_ptr;
+    free(status_ptr);
+    incremental_note(log, line_no, 1, status, line, line_len);
+    return status != 0 ? -1 : 0;
+}
+
 /*
 ** Executes an entire script line-by-line.
 ** Stops and indicates an error as soon as any line fails.
@@ -332,86 +635,98 @@ int run_command(Command *command){
 ** Returns 0 on success, -1 on error
 */
 
+int run_line(char *line, Variable **root) {
+    bool tail_exec = shell_options.exec_last_command;
+    shell_options.exec_last_command = 0;
+
+    int ret = run_script_line(parse_line(line, root), line, strlen(line), 1,
+                              tail_exec, NULL, root);
+    if (ret < 0) {
+        ERR_PRINT(ERR_EXECUTE_LINE);
+    }
+    return ret;
+}
+
 int run_script(char *file_path, Variable **root) {
-    // Open the file
-    FILE *file = fopen(file_path, "r");
+    // Only the script main() runs directly gets its last command exec'd,
+    // not the init file or any script it runs in turn
+    bool tail_exec = shell_options.exec_last_command;
+    shell_options.exec_last_command = 0;
+
+    // Open the file, keeping it out of the commands we exec
+    FILE *file = fopen(file_path, "re");
     if (file == NULL) {
         return -1; // Error opening the file
     }
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
+    IncrementalLog *log = NULL;
+    if (shell_options.incremental) {
+        log = incremental_open(file_path);
+        // the state file is written after the last line
+        tail_exec = false;
+    }
 
-    // Read the file line by line
-    while ((read = getline(&line, &len, file)) != -1) {
-        line[strlen(line) - 1] = '\0';
+    ScriptReader reader;
+    open_script_reader(&reader, file);
 
-        Command *command = parse_line(line, root);
-        if (command == (Command *) -1){
-            ERR_PRINT(ERR_PARSING_LINE);
-            continue;
-        }
-        if (command == NULL) continue;
-
-        // Execute the command
-        int *status_ptr = execute_line(command);
-        if (status_ptr == (int *) -1) {
-            // Free resources and return -1 if an error occurred
-            free_command(command);
-            free(line);
-            fclose(file);
-            ERR_PRINT(ERR_EXECUTE_LINE);
-            return -1;
-        }
-
-        // Check the status of the executed command
-        int status = *status_ptr;
-        if (status != 0) {
-            free_command(command);
-            free(line);
-            fclose(file);
-            ERR_PRINT(ERR_EXECUTE_LINE);
-            return -1;  // Stop and return -1 as soon as any line fails
+    int ret = 0;
+    if (shell_options.pipelined) {
+        ret = run_script_pipelined(&reader, tail_exec, log, root);
+    } else {
+        const char *line;
+        ssize_t len;
+        while ((len = next_script_line(&reader, &line)) != -1) {
+            // the file shrank under us; the rest of the script is gone
+            if (script_line_cut(&reader, line, len)) {
+                break;
+            }
+            size_t line_no = reader.line_no;
+            Command *command = parse_line_span(line, len, root);
+
+            // Peeking at what follows tells us when we are on the last command
+            bool last = tail_exec && script_reader_at_end(&reader);
+            if (run_script_line(command, line, len, line_no, last, log, root) < 0) {
+                ret = -1;  // Stop and return -1 as soon as any line fails
+                break;
+            }
         }
-
-        free_command(command);
     }
 
-    free(line);
+    if (ret == 0 && reader.truncated) {
+        ERR_PRINT(ERR_SCRIPT_CUT, file_path);
+        ret = -1;
+    } else if (ret < 0) {
+        ERR_PRINT(ERR_EXECUTE_LINE);
+    }
+    incremental_close(log);
+    close_script_reader(&reader);
     fclose(file);
-    return 0;
+    return ret;
 }
 
 void free_command(Command *command) {
-    if (command == NULL) {
-        return;
-    }
+    while (command != NULL) {
+        Command *next = command->next;
 
-    // Free the executable path if it's dynamically allocated
-    if (command->exec_path != NULL) {
+        // Free the executable path if it's dynamically allocated
         free(command->exec_path);
-    }
 
-    // Free input redirection path if present
-    if (command->redir_in_path != NULL) {
+        // Free input and output redirection paths if present
         free(command->redir_in_path);
-    }
-
-    // Free output redirection path if present
-    if (command->redir_out_path != NULL) {
         free(command->redir_out_path);
-    }
+        free(command->limits);
 
-    // Free each argument in the args array
-    if (command->args != NULL) {
-        for (int i = 0; command->args[i] != NULL; i++) {
-            free(command->args[i]);
+        // Free each argument in the args array
+        if (command->args != NULL) {
+            for (int i = 0; command->args[i] != NULL; i++) {
+                free(command->args[i]);
+            }
+            // Free the args array itself
+            free(command->args);
         }
-        // Free the args array itself
-        free(command->args);
-    }
 
-    // Finally, free the command itself
-    free(command);
+        // Finally, free the command itself, then the rest of the pipeline
+        free(command);
+        command = next;
+    }
 }
@@ -0,0 +1,359 @@
+#include "cscshell.h"
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+/*
+** What a client asks the server to run. It travels as one packet, with
+** the client's stdin, stdout and stderr attached as SCM_RIGHTS.
+**
+** kind: SERVER_RUN_SCRIPT with a script path in text, or SERVER_RUN_LINE
+**       with a single line.
+** cwd:  the client's working directory, relative paths are resolved in.
+*/
+typedef struct ServerRequest {
+    char kind;
+    char cwd[MAX_PATH_STR];
+    char text[MAX_SINGLE_LINE];
+} ServerRequest;
+
+/*
+** A request being run by a worker. The server answers on conn once the
+** worker exits; pidfd is -1 without kernel support, and hung_up is set
+** once the client has gone and the worker was told to stop.
+*/
+typedef struct Worker {
+    pid_t pid;
+    int conn;
+    int pidfd;
+    bool hung_up;
+} Worker;
+
+
+/**
+ * Fills in the address of a socket path.
+ *
+ * @param path The socket path.
+ * @param addr The address to fill.
+ * @return 0 on success, -1 if the path is too long.
+ */
+int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        ERR_PRINT(ERR_SERVER_PATH, path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Connects to a server socket.
+ *
+ * @param path The socket path.
+ * @return The connected socket, or -1.
+ */
+int connect_server(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Binds and listens on a server socket, replacing a stale one that no
+ * server answers on any more.
+ *
+ * @param path The socket path.
+ * @return The listening socket, or -1 with the error printed.
+ */
+int listen_server(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int live = connect_server(path);
+        if (live >= 0) {
+            close(live);
+            ERR_PRINT(ERR_SERVER_IN_USE, path);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Runs one request in a worker: receives it with the client's stdio,
+ * takes the stdio over and runs the script or line in the client's
+ * directory. The shell state is the server's, as of the fork.
+ *
+ * @param conn The client's connection.
+ * @param root The variables.
+ * @return The exit code of the shell for the request.
+ */
+int serve_request(int conn, Variable **root) {
+    ServerRequest *req = calloc(1, sizeof(ServerRequest));
+    if (req == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SERVER_NUM_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {req, sizeof(ServerRequest)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (got != sizeof(ServerRequest) || cmsg == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * SERVER_NUM_FDS)) {
+        ERR_PRINT(ERR_SERVER_REQUEST);
+        free(req);
+        return -1;
+    }
+
+    // the client's stdio becomes the worker's
+    int fds[SERVER_NUM_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    for (int i = 0; i < SERVER_NUM_FDS; i++) {
+        dup2(fds[i], i);
+    }
+    for (int i = 0; i < SERVER_NUM_FDS; i++) {
+        if (fds[i] >= SERVER_NUM_FDS) close(fds[i]);
+    }
+    req->cwd[MAX_PATH_STR - 1] = '\0';
+    req->text[MAX_SINGLE_LINE - 1] = '\0';
+
+    if (chdir(req->cwd) < 0) {
+        perror(req->cwd);
+        free(req);
+        return -1;
+    }
+
+    // as if the client had run the shell itself
+    shell_options.exec_last_command = 1;
+    int ret = req->kind == SERVER_RUN_LINE ? run_line(req->text, root)
+                                           : run_script(req->text, root);
+    free(req);
+    return ret;
+}
+
+/**
+ * Starts a worker for a new connection.
+ *
+ * @param listen_fd The server socket, which the worker does not keep.
+ * @param conn The connection.
+ * @param root The variables.
+ * @return The worker's pid, or -1.
+ */
+pid_t start_worker(int listen_fd, int conn, Variable **root) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        // a group of its own, so a client that goes away takes it along
+        setpgid(0, 0);
+        signal(SIGPIPE, SIG_DFL);
+        close(listen_fd);
+        int ret = serve_request(conn, root);
+        fflush(NULL);
+        _exit(ret & 0xff);
+    }
+    setpgid(pid, pid);
+    stats_add(STAT_FORKS, 1);
+    return pid;
+}
+
+/**
+ * Sends a finished worker's exit code to its client.
+ *
+ * @param worker The worker, already reaped.
+ * @param status Its wait status.
+ */
+void answer_client(Worker *worker, int status) {
+    int32_t code = exit_code(status);
+    if (send(worker->conn, &code, sizeof(code), MSG_NOSIGNAL) < 0 && errno != EPIPE) {
+        perror("send");
+    }
+    close(worker->conn);
+    if (worker->pidfd >= 0) close(worker->pidfd);
+}
+
+int run_server(const char *socket_path, Variable **root) {
+    int listen_fd = listen_server(socket_path);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    // a client that leaves early must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    Worker *workers = NULL;
+    struct pollfd *fds = NULL;
+    int num_workers = 0;
+
+    while (1) {
+        fds = realloc(fds, sizeof(struct pollfd) * (2 * num_workers + 1));
+        if (fds == NULL) {
+            exit(EXIT_FAILURE);
+        }
+
+        // pidfds report workers exiting and conns report clients leaving,
+        // without reading the request the worker has yet to take
+        bool use_pidfds = true;
+        int nfds = 0;
+        fds[nfds].fd = listen_fd;
+        fds[nfds++].events = POLLIN;
+        for (int i = 0; i < num_workers; i++) {
+            fds[nfds].fd = workers[i].hung_up ? -1 : workers[i].conn;
+            fds[nfds++].events = 0;
+            fds[nfds].fd = workers[i].pidfd;
+            fds[nfds++].events = POLLIN;
+            if (workers[i].pidfd < 0) use_pidfds = false;
+        }
+
+        if (poll(fds, nfds, use_pidfds ? -1 : TIMEOUT_POLL_MS) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (int i = 0; i < num_workers; i++) {
+            int status;
+            if (fds[1 + 2 * i].revents & (POLLHUP | POLLERR)) {
+                workers[i].hung_up = true;
+                kill(-workers[i].pid, SIGTERM);
+            }
+            if (waitpid(workers[i].pid, &status, WNOHANG) != workers[i].pid) {
+                continue;
+            }
+            answer_client(&workers[i], status);
+            // keep fds in step with workers for the rest of this pass
+            workers[i] = workers[num_workers - 1];
+            fds[1 + 2 * i] = fds[1 + 2 * (num_workers - 1)];
+            num_workers--;
+            i--;
+        }
+
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+            continue;
+        }
+        pid_t pid = start_worker(listen_fd, conn, root);
+        if (pid < 0) {
+            close(conn);
+            continue;
+        }
+
+        workers = realloc(workers, sizeof(Worker) * (num_workers + 1));
+        if (workers == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        workers[num_workers].pid = pid;
+        workers[num_workers].conn = conn;
+        workers[num_workers].pidfd = open_pidfd(pid);
+        workers[num_workers].hung_up = false;
+        num_workers++;
+    }
+
+    close(listen_fd);
+    free(workers);
+    free(fds);
+    return -1;
+}
+
+int run_client(const char *socket_path, char kind, const char *text) {
+    ServerRequest *req = calloc(1, sizeof(ServerRequest));
+    if (req == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    req->kind = kind;
+    if (getcwd(req->cwd, MAX_PATH_STR) == NULL) {
+        perror("getcwd");
+        free(req);
+        return -1;
+    }
+    if (strlen(text) >= MAX_SINGLE_LINE) {
+        ERR_PRINT(ERR_SERVER_TOO_LONG);
+        free(req);
+        return -1;
+    }
+    strcpy(req->text, text);
+
+    int fd = connect_server(socket_path);
+    if (fd < 0) {
+        ERR_PRINT(ERR_SERVER_CONNECT, socket_path, strerror(errno));
+        free(req);
+        return -1;
+    }
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SERVER_NUM_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {req, sizeof(ServerRequest)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SERVER_NUM_FDS);
+    int fds[SERVER_NUM_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t code = -1;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(ServerRequest)) {
+        ERR_PRINT(ERR_SERVER_CONNECT, socket_path, strerror(errno));
+    } else if (recv(fd, &code, sizeof(code), 0) != sizeof(code)) {
+        // the server went away before the request finished
+        ERR_PRINT(ERR_SERVER_LOST, socket_path);
+        code = -1;
+    }
+    close(fd);
+    free(req);
+    return code;
+}
@@ -0,0 +1,231 @@
+#include "cscshell.h"
+#include <ctype.h>
+
+
+/*
+** A sourced file, tokenized the way function bodies are, and the version
+** of the file it was read from. A file that is sourced again while it
+** runs, after it changed, is dropped from the cache but freed only once
+** its last run finishes.
+*/
+typedef struct SourceScript {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    ParsedLine *lines;
+    int active;
+    bool dropped;
+    struct SourceScript *next;
+} SourceScript;
+
+// Cached files, most recently sourced first
+static SourceScript *scripts = NULL;
+static int num_scripts = 0;
+
+// How many sourced files are currently running
+static int source_depth = 0;
+
+
+/**
+ * Frees a cached file and its lines.
+ */
+void free_source_script(SourceScript *script) {
+    free_parsed_line(script->lines, NON_ZERO_BYTE);
+    free(script);
+}
+
+/**
+ * Takes a file out of the cache, freeing it unless it is running.
+ *
+ * @param link The link that points to it.
+ */
+void drop_source_script(SourceScript **link) {
+    SourceScript *script = *link;
+    *link = script->next;
+    num_scripts--;
+    if (script->active > 0) {
+        script->dropped = true;
+    } else {
+        free_source_script(script);
+    }
+}
+
+/**
+ * Tells whether a line ends with the brace closing a function body.
+ */
+bool ends_function_body(const char *line) {
+    const char *end = line + strlen(line);
+    while (end > line && isspace((unsigned char)*(end - 1))) end--;
+    return end > line && *(end - 1) == FUNC_BODY_END;
+}
+
+/**
+ * Reads and tokenizes a file. Assignments and function definitions keep
+ * their text and go through parse_line on every run, as in function
+ * bodies, since they change the shell as they are parsed.
+ *
+ * @param file The open file.
+ * @param path Its path, for errors.
+ * @param lines Set to the lines.
+ * @return 0 on success, -1 with the error printed on a line that could
+ *         not be tokenized or a file that shrank while it was read.
+ */
+int read_source_script(FILE *file, const char *path, ParsedLine **lines) {
+    ParsedLine **tail = lines;
+    ScriptReader reader;
+    const char *span;
+    ssize_t len;
+    bool in_definition = false;
+    *lines = NULL;
+
+    open_script_reader(&reader, file);
+    while ((len = next_script_line(&reader, &span)) != -1) {
+        // read once per version of the file, so copying each line is cheap
+        char *line = malloc(len + 1);
+        if (line == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        memcpy(line, span, len);
+        line[len] = '\0';
+        if (script_line_cut(&reader, span, len)) {
+            free(line);
+            break;
+        }
+        char *start = line;
+        while (isspace((unsigned char)*start)) start++;
+
+        // a definition stays open until a line ends with its brace
+        bool keep_text = true;
+        if (in_definition) {
+            in_definition = !ends_function_body(start);
+        } else if (is_function_definition(start)) {
+            in_definition = strchr(start, FUNC_BODY_START) != NULL &&
+                !ends_function_body(start);
+        } else {
+            keep_text = is_assignment(start);
+        }
+
+        ParsedLine *parsed;
+        if (keep_text) {
+            parsed = calloc(1, sizeof(ParsedLine));
+            if (parsed == NULL || (parsed->text = strdup(start)) == NULL) {
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            parsed = tokenize_line(start, len - (start - line));
+        }
+        free(line);
+        if (parsed == (ParsedLine *) -1) {
+            ERR_PRINT(ERR_PARSING_LINE);
+            close_script_reader(&reader);
+            return -1;
+        }
+        if (parsed == NULL) continue;
+
+        *tail = parsed;
+        tail = &parsed->next;
+    }
+    // what was read is not the whole file, as any version of it
+    bool cut = reader.truncated;
+    close_script_reader(&reader);
+    if (cut) {
+        ERR_PRINT(ERR_SCRIPT_CUT, path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Finds a file in the cache, reading it in if it is not there or changed
+ * since it was read.
+ *
+ * @param path The file.
+ * @return The file, or NULL with the error printed.
+ */
+SourceScript *load_source_script(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    for (SourceScript **link = &scripts; *link; link = &(*link)->next) {
+        SourceScript *script = *link;
+        if (script->dev != st.st_dev || script->ino != st.st_ino) {
+            continue;
+        }
+        if (script->size == st.st_size && script->mtime.tv_sec == st.st_mtim.tv_sec &&
+            script->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            *link = script->next;
+            script->next = scripts;
+            scripts = script;
+            stats_add(STAT_SOURCE_HITS, 1);
+            return script;
+        }
+        drop_source_script(link);
+        break;
+    }
+
+    FILE *file = fopen(path, "re");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    SourceScript *script = calloc(1, sizeof(SourceScript));
+    if (script == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    // the version read is the one the open file has
+    fstat(fileno(file), &st);
+    script->dev = st.st_dev;
+    script->ino = st.st_ino;
+    script->mtime = st.st_mtim;
+    script->size = st.st_size;
+    int ret = read_source_script(file, path, &script->lines);
+    fclose(file);
+    if (ret < 0) {
+        free_source_script(script);
+        return NULL;
+    }
+
+    script->next = scripts;
+    scripts = script;
+    if (++num_scripts > SOURCE_CACHE_SIZE) {
+        SourceScript **link = &scripts;
+        while ((*link)->next != NULL) link = &(*link)->next;
+        drop_source_script(link);
+    }
+    return script;
+}
+
+int builtin_source(Command *command, Variable **root, int out_fd) {
+    if (command->args[1] == NULL || command->args[2] != NULL) {
+        ERR_PRINT(ERR_SOURCE_USAGE, command->args[0]);
+        return W_EXITCODE(2, 0);
+    }
+    if (source_depth >= MAX_FUNC_DEPTH) {
+        ERR_PRINT(ERR_SOURCE_DEPTH, command->args[1]);
+        return W_EXITCODE(1, 0);
+    }
+
+    SourceScript *script = load_source_script(command->args[1]);
+    if (script == NULL) {
+        return W_EXITCODE(1, 0);
+    }
+
+    int status = 0;
+    script->active++;
+    source_depth++;
+    if (run_parsed_lines(script->lines, root, &status) < 0) {
+        ERR_PRINT(ERR_EXECUTE_LINE);
+        status = W_EXITCODE(1, 0);
+    }
+    source_depth--;
+    script->active--;
+
+    if (script->dropped && script->active == 0) {
+        free_source_script(script);
+    }
+    return status;
+}
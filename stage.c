@@ -0,0 +1,335 @@
+#include "cscshell.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+
+
+/*
+** The bytes passed between two adjacent builtin stages of a pipeline.
+** Only the writing thread moves tail and only the reading one moves
+** head, both counting bytes since the start, so neither takes a lock.
+** The semaphores are only touched when a side has to sleep because the
+** ring is empty or full.
+**
+** writer_done: the writer has finished; the reader gets EOF once empty.
+** reader_done: the reader has finished; writes fail as on a closed pipe.
+*/
+struct StageRing {
+    char buf[STAGE_RING_SIZE];
+    size_t head;
+    size_t tail;
+    int writer_done;
+    int reader_done;
+    int reader_sleeping;
+    int writer_sleeping;
+    sem_t data;
+    sem_t space;
+};
+
+/*
+** A builtin stage running on a thread of its own, on its own copy of the
+** command. done is set once the builtin has returned.
+*/
+struct StageThread {
+    pthread_t thread;
+    const Builtin *builtin;
+    Command *command;
+    Variable **root;
+    StageIO io;
+    int status;
+    int done;
+};
+
+
+StageRing *stage_ring_new(void) {
+    StageRing *ring = calloc(1, sizeof(StageRing));
+    if (ring == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    sem_init(&ring->data, 0, 0);
+    sem_init(&ring->space, 0, 0);
+    return ring;
+}
+
+void stage_ring_free(StageRing *ring) {
+    sem_destroy(&ring->data);
+    sem_destroy(&ring->space);
+    free(ring);
+}
+
+/**
+ * Sleeps while an index of a ring still has a given value and a flag is
+ * clear. The other side clears *sleeping and posts sem after moving the
+ * index or setting the flag.
+ *
+ * @param index The index the other side moves.
+ * @param value The value to wait out.
+ * @param done The other side's done flag.
+ * @param sleeping Flag telling the other side to post sem.
+ * @param sem The semaphore to sleep on.
+ */
+void stage_ring_wait(size_t *index, size_t value, int *done, int *sleeping, sem_t *sem) {
+    while (__atomic_load_n(index, __ATOMIC_ACQUIRE) == value &&
+           !__atomic_load_n(done, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value &&
+            !__atomic_load_n(done, __ATOMIC_SEQ_CST)) {
+            while (sem_wait(sem) < 0 && errno == EINTR);
+        }
+        __atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Wakes the other side of a ring if it went to sleep.
+ */
+void stage_ring_wake(int *sleeping, sem_t *sem) {
+    if (__atomic_exchange_n(sleeping, 0, __ATOMIC_SEQ_CST)) {
+        sem_post(sem);
+    }
+}
+
+/**
+ * Reads up to len bytes from a ring, sleeping while it is empty.
+ *
+ * @return The number of bytes read, 0 at the end of the input.
+ */
+ssize_t stage_ring_read(StageRing *ring, char *buf, size_t len) {
+    size_t head = ring->head;
+    stage_ring_wait(&ring->tail, head, &ring->writer_done,
+                    &ring->reader_sleeping, &ring->data);
+    size_t avail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+    if (avail == 0) {
+        return 0;
+    }
+
+    size_t n = avail < len ? avail : len;
+    size_t at = head % STAGE_RING_SIZE;
+    size_t first = n < STAGE_RING_SIZE - at ? n : STAGE_RING_SIZE - at;
+    memcpy(buf, ring->buf + at, first);
+    memcpy(buf + first, ring->buf, n - first);
+    __atomic_store_n(&ring->head, head + n, __ATOMIC_SEQ_CST);
+    stage_ring_wake(&ring->writer_sleeping, &ring->space);
+    return n;
+}
+
+/**
+ * Writes all of buf to a ring, sleeping while it is full.
+ *
+ * @return 0 on success, -1 with errno EPIPE if the reader has finished.
+ */
+int stage_ring_write(StageRing *ring, const char *buf, size_t len) {
+    while (len > 0) {
+        size_t tail = ring->tail;
+        size_t used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (used == STAGE_RING_SIZE) {
+            stage_ring_wait(&ring->head, tail - STAGE_RING_SIZE, &ring->reader_done,
+                            &ring->writer_sleeping, &ring->space);
+            used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        }
+        if (__atomic_load_n(&ring->reader_done, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        size_t n = STAGE_RING_SIZE - used < len ? STAGE_RING_SIZE - used : len;
+        size_t at = tail % STAGE_RING_SIZE;
+        size_t first = n < STAGE_RING_SIZE - at ? n : STAGE_RING_SIZE - at;
+        memcpy(ring->buf + at, buf, first);
+        memcpy(ring->buf, buf + first, n - first);
+        __atomic_store_n(&ring->tail, tail + n, __ATOMIC_SEQ_CST);
+        stage_ring_wake(&ring->reader_sleeping, &ring->data);
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Marks one side of a ring as finished and wakes the other.
+ */
+void stage_ring_close(StageRing *ring, bool writer) {
+    if (writer) {
+        __atomic_store_n(&ring->writer_done, 1, __ATOMIC_SEQ_CST);
+        stage_ring_wake(&ring->reader_sleeping, &ring->data);
+    } else {
+        __atomic_store_n(&ring->reader_done, 1, __ATOMIC_SEQ_CST);
+        stage_ring_wake(&ring->writer_sleeping, &ring->space);
+    }
+}
+
+ssize_t stage_read(StageIO *io, void *buf, size_t len) {
+    if (io->in_ring != NULL) {
+        return stage_ring_read(io->in_ring, buf, len);
+    }
+    if (io->in_file != NULL && io->in_fd == STDIN_FILENO) {
+        size_t got = fread(buf, 1, len, io->in_file);
+        bool failed = got == 0 && ferror(io->in_file);
+        // an end of input typed at the terminal ends the read, not the shell
+        clearerr(io->in_file);
+        return failed ? -1 : (ssize_t) got;
+    }
+    ssize_t got;
+    while ((got = read(io->in_fd, buf, len)) < 0 && errno == EINTR);
+    return got;
+}
+
+int stage_write(StageIO *io, const void *buf, size_t len) {
+    if (io->out_ring != NULL) {
+        return stage_ring_write(io->out_ring, buf, len);
+    }
+    return write_all(io->out_fd, buf, len);
+}
+
+/**
+ * Opens a stage's redirections over its pipeline ends.
+ *
+ * @param command The stage.
+ * @param io Its input and output.
+ * @return 0 on success, -1 with the error printed.
+ */
+int open_stage_redirections(Command *command, StageIO *io) {
+    if (command->redir_in_path != NULL) {
+        int in_fd = open(command->redir_in_path, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) {
+            perror("open");
+            return -1;
+        }
+        if (io->in_fd != STDIN_FILENO) close(io->in_fd);
+        io->in_fd = in_fd;
+        if (io->in_ring != NULL) stage_ring_close(io->in_ring, false);
+        io->in_ring = NULL;
+    }
+    if (command->redir_out_path != NULL) {
+        int out_fd = open_redirect_out(command);
+        if (out_fd < 0) {
+            perror("open");
+            return -1;
+        }
+        if (io->out_fd != STDOUT_FILENO) close(io->out_fd);
+        io->out_fd = out_fd;
+        if (io->out_ring != NULL) stage_ring_close(io->out_ring, true);
+        io->out_ring = NULL;
+    }
+    return 0;
+}
+
+void close_stage_io(StageIO *io) {
+    if (io->in_fd != STDIN_FILENO) close(io->in_fd);
+    if (io->out_fd != STDOUT_FILENO) close(io->out_fd);
+    if (io->in_ring != NULL) stage_ring_close(io->in_ring, false);
+    if (io->out_ring != NULL) stage_ring_close(io->out_ring, true);
+}
+
+/**
+ * The body of a stage thread: runs the builtin, then closes its ends.
+ *
+ * @param arg The StageThread.
+ * @return NULL.
+ */
+void *run_stage(void *arg) {
+    StageThread *stage = arg;
+
+    // a reader that went away must fail the write, not stop the shell
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+    if (open_stage_redirections(stage->command, &stage->io) < 0) {
+        stage->status = W_EXITCODE(1, 0);
+    } else {
+        stage->status = stage->builtin->stage(stage->command, stage->root, &stage->io);
+    }
+
+    close_stage_io(&stage->io);
+    __atomic_store_n(&stage->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+StageThread *start_stage(const Builtin *builtin, Command *command, Variable **root,
+                         StageIO *io) {
+    StageThread *stage = calloc(1, sizeof(StageThread));
+    if (stage == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    // the line is freed once it returns, also when its job was stopped
+    Command alone = *command;
+    alone.next = NULL;
+    stage->builtin = builtin;
+    stage->command = copy_commands(&alone);
+    stage->root = root;
+    stage->io = *io;
+
+    // whatever the shell has buffered goes out before the stage's output
+    fflush(stdout);
+    int err = pthread_create(&stage->thread, NULL, run_stage, stage);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create");
+        close_stage_io(io);
+        free_command(stage->command);
+        free(stage);
+        return NULL;
+    }
+    stats_add(STAT_THREAD_STAGES, 1);
+    return stage;
+}
+
+pid_t fork_stage(const Builtin *builtin, Command *command, Variable **root, StageIO *io) {
+    // whatever the shell has buffered goes out before the stage's output
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close_stage_io(io);
+        return -1;
+    }
+    if (pid == 0) {
+        if (command->pgid != 0) {
+            setpgid(0, command->pgid == PGID_NEW ? 0 : command->pgid);
+        }
+        enter_job();
+        // a copy of the shell's stdin buffer would be read twice
+        io->in_file = NULL;
+        int status = W_EXITCODE(1, 0);
+        if (open_stage_redirections(command, io) == 0) {
+            status = builtin->stage(command, root, io);
+        }
+        close_stage_io(io);
+        _exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+    }
+
+    // the group is set on both sides, whichever runs first
+    if (command->pgid != 0) {
+        setpgid(pid, command->pgid == PGID_NEW ? pid : command->pgid);
+    }
+    close_stage_io(io);
+    stats_add(STAT_FORKS, 1);
+    stats_child_started(pid);
+    return pid;
+}
+
+int finish_stage(StageThread *stage) {
+    pthread_join(stage->thread, NULL);
+    int status = stage->status;
+    free_command(stage->command);
+    free(stage);
+    return status;
+}
+
+bool stage_finished(StageThread *stage) {
+    return __atomic_load_n(&stage->done, __ATOMIC_ACQUIRE);
+}
+
+int finish_stages(StageThread **stages, int *statuses, int num_stages, int first_failed) {
+    for (int i = 0; i < num_stages; i++) {
+        if (stages[i] == NULL) continue;
+        statuses[i] = finish_stage(stages[i]);
+        stages[i] = NULL;
+        if (statuses[i] != 0 && (first_failed < 0 || i < first_failed)) {
+            first_failed = i;
+        }
+    }
+    return first_failed;
+}
@@ -0,0 +1,214 @@
+#include "cscshell.h"
+#include <time.h>
+
+/*
+** Histograms are log-linear in the style of HdrHistogram: values below
+** 2^HIST_SUB_BITS get a bucket each, and every power of two above that
+** is split into 2^HIST_SUB_BITS equal buckets, which bounds the error of
+** a reported value to about 1 / 2^HIST_SUB_BITS.
+*/
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+// Children whose fork time is remembered until they are reaped
+#define CHILD_TABLE_SIZE 1024
+
+typedef struct Histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+typedef struct ChildStart {
+    pid_t pid;
+    uint64_t started;
+} ChildStart;
+
+static const char *counter_names[NUM_STATS] = {
+    "lines_parsed",
+    "forks",
+    "execs",
+    "path_cache_hits",
+    "path_cache_misses",
+    "variable_lookups",
+    "pipe_bytes",
+    "thread_stages",
+    "source_cache_hits",
+    "parse_cache_hits",
+};
+
+static const char *histogram_names[NUM_HISTS] = {
+    "parse_line",
+    "resolve_executable",
+    "fork_to_exit",
+};
+
+// Updated with relaxed atomics, so they are safe to bump from any thread
+static uint64_t counters[NUM_STATS];
+static Histogram histograms[NUM_HISTS];
+static ChildStart children[CHILD_TABLE_SIZE];
+
+
+uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void stats_add(StatCounter counter, uint64_t amount) {
+    __atomic_fetch_add(&counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * Maps a value to its histogram bucket.
+ *
+ * @param value The value in nanoseconds.
+ * @return The bucket index.
+ */
+int bucket_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return (int) value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - HIST_SUB_BITS;
+    int sub = (int) ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+    return (shift + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+/**
+ * Maps a bucket back to the middle of the values it holds.
+ *
+ * @param index The bucket index.
+ * @return A representative value in nanoseconds.
+ */
+uint64_t bucket_value(int index) {
+    if (index < HIST_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / HIST_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t) (HIST_SUB_BUCKETS + index % HIST_SUB_BUCKETS) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+void stats_record(StatHistogram hist, uint64_t value) {
+    Histogram *h = &histograms[hist];
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+
+    uint64_t seen = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > seen &&
+           !__atomic_compare_exchange_n(&h->max, &seen, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    seen = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while ((seen == 0 || value < seen) &&
+           !__atomic_compare_exchange_n(&h->min, &seen, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void stats_child_started(pid_t pid) {
+    ChildStart *slot = &children[pid % CHILD_TABLE_SIZE];
+    slot->pid = pid;
+    slot->started = stats_now();
+}
+
+void stats_child_reaped(pid_t pid) {
+    ChildStart *slot = &children[pid % CHILD_TABLE_SIZE];
+    // a colliding child may have taken the slot; then this one is not timed
+    if (slot->pid == pid) {
+        stats_record(HIST_FORK_TO_EXIT, stats_now() - slot->started);
+        slot->pid = 0;
+    }
+}
+
+/**
+ * Finds the value below which a given fraction of a histogram lies.
+ *
+ * @param h The histogram.
+ * @param fraction The fraction, between 0 and 1.
+ * @return The value in nanoseconds, or 0 for an empty histogram.
+ */
+uint64_t percentile(Histogram *h, double fraction) {
+    uint64_t target = (uint64_t) (h->count * fraction);
+    if (target == 0) target = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t value = bucket_value(i);
+            return value > h->max ? h->max : value;
+        }
+    }
+    return h->max;
+}
+
+void stats_print(FILE *out) {
+    for (int i = 0; i < NUM_STATS; i++) {
+        fprintf(out, "%-20s %" PRIu64 "\n", counter_names[i],
+                __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+
+    fprintf(out, "\n%-20s %10s %10s %10s %10s %10s %10s\n", "latency (us)",
+            "count", "mean", "p50", "p90", "p99", "max");
+    for (int i = 0; i < NUM_HISTS; i++) {
+        Histogram *h = &histograms[i];
+        double mean = h->count ? (double) h->sum / h->count : 0;
+        fprintf(out, "%-20s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                histogram_names[i], h->count, mean / 1000,
+                percentile(h, 0.5) / 1000.0, percentile(h, 0.9) / 1000.0,
+                percentile(h, 0.99) / 1000.0, h->max / 1000.0);
+    }
+}
+
+void stats_print_json(FILE *out) {
+    fprintf(out, "{\n  \"counters\": {");
+    for (int i = 0; i < NUM_STATS; i++) {
+        fprintf(out, "%s\n    \"%s\": %" PRIu64, i ? "," : "", counter_names[i],
+                __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+    fprintf(out, "\n  },\n  \"histograms_ns\": {");
+    for (int i = 0; i < NUM_HISTS; i++) {
+        Histogram *h = &histograms[i];
+        fprintf(out, "%s\n    \"%s\": {\"count\": %" PRIu64 ", \"min\": %" PRIu64
+                ", \"mean\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+                ", \"p99\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+                i ? "," : "", histogram_names[i], h->count, h->min,
+                h->count ? h->sum / h->count : 0, percentile(h, 0.5),
+                percentile(h, 0.9), percentile(h, 0.99), h->max);
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+int stats_dump_json(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror("stats");
+        return -1;
+    }
+    stats_print_json(out);
+    return fclose(out);
+}
+
+int builtin_stats(Command *command, Variable **root, int out_fd) {
+    bool json = command->args[1] && strcmp(command->args[1], STATS_JSON_FLAG) == 0;
+
+    int fd = dup(out_fd);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+    if (out == NULL) {
+        perror("stats");
+        if (fd >= 0) close(fd);
+        return W_EXITCODE(1, 0);
+    }
+
+    if (json) {
+        stats_print_json(out);
+    } else {
+        stats_print(out);
+    }
+    fclose(out);
+    return 0;
+}
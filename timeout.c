@@ -0,0 +1,219 @@
+#include "cscshell.h"
+#include <signal.h>
+#include <sys/timerfd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+
+bool parse_duration(const char *str, uint64_t *ms) {
+    char *end;
+    errno = 0;
+    double value = strtod(str, &end);
+    if (end == str || errno != 0 || value < 0) {
+        return false;
+    }
+
+    // suffixes as timeout(1) takes them
+    double scale = 1000;
+    if (*end == 's') scale = 1000, end++;
+    else if (*end == 'm') scale = 60 * 1000, end++;
+    else if (*end == 'h') scale = 60 * 60 * 1000, end++;
+    else if (*end == 'd') scale = 24 * 60 * 60 * 1000, end++;
+    if (*end != '\0' || value * scale > (double) UINT32_MAX * 1000) {
+        return false;
+    }
+
+    *ms = (uint64_t) (value * scale + 0.5);
+    if (*ms == 0 && value > 0) *ms = 1;
+    return true;
+}
+
+int parse_timeout_prefix(Command *cmd) {
+    int idx = 1;
+    cmd->kill_after_ms = TIMEOUT_KILL_AFTER_MS;
+    if (cmd->args[idx] && strcmp(cmd->args[idx], TIMEOUT_KILL_FLAG) == 0) {
+        if (cmd->args[idx + 1] == NULL ||
+            !parse_duration(cmd->args[idx + 1], &cmd->kill_after_ms)) {
+            return -1;
+        }
+        idx += 2;
+    }
+    if (cmd->args[idx] == NULL || !parse_duration(cmd->args[idx], &cmd->timeout_ms)) {
+        return -1;
+    }
+    return idx + 1;
+}
+
+/**
+ * Arms a timer to expire once after a number of milliseconds.
+ *
+ * @param tfd The timerfd.
+ * @param ms When to expire; 0 disarms the timer.
+ * @return 0 on success, -1 on error.
+ */
+int arm_timer(int tfd, uint64_t ms) {
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+    return timerfd_settime(tfd, 0, &spec, NULL);
+}
+
+int open_pidfd(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Records what waitpid reported for one stage of a pipeline, tearing the
+ * pipeline down if the stage failed and wait asks for it.
+ *
+ * @param wait The wait in progress.
+ * @param pids The pipeline's children; a reaped one is set to 0.
+ * @param statuses The stages' wait statuses.
+ * @param idx The stage waitpid reported on.
+ * @param status What it reported.
+ * @param remaining The number of stages not reaped yet.
+ */
+void note_stage(PipelineWait *wait, pid_t *pids, int *statuses, int idx,
+                int status, int *remaining) {
+    if (WIFSTOPPED(status)) {
+        // the whole job counts as stopped; the stage is still there
+        wait->stopped = true;
+        statuses[idx] = status;
+        return;
+    }
+    statuses[idx] = status;
+    stats_child_reaped(pids[idx]);
+    pids[idx] = 0;
+    (*remaining)--;
+
+    if (status == 0 || wait->first_failed >= 0) return;
+    wait->first_failed = idx;
+    // what is still running would only feed a failed pipeline
+    if (wait->teardown && *remaining > 0 && !wait->timed_out) {
+        wait->torn_down = true;
+        kill(-wait->pgid, SIGTERM);
+        kill(-wait->pgid, SIGCONT);
+    }
+}
+
+int wait_pipeline(pid_t *pids, int *statuses, int num_pids, PipelineWait *wait) {
+    int *pidfds = malloc(sizeof(int) * num_pids);
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * (num_pids + 1));
+    if (pidfds == NULL || fds == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    wait->first_failed = -1;
+    wait->timed_out = false;
+    wait->torn_down = false;
+    wait->stopped = false;
+
+    int tfd = wait->timeout_ms ? timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC) : -1;
+    if (tfd >= 0 && arm_timer(tfd, wait->timeout_ms) < 0) {
+        close(tfd);
+        tfd = -1;
+    }
+    if (wait->timeout_ms && tfd < 0) {
+        perror("timerfd");
+    }
+
+    // children are reaped as they exit when the order of failures, a
+    // timeout or stops matter, otherwise one after another
+    bool watch = tfd >= 0 || wait->in_order_failures || wait->untraced;
+    int flags = wait->untraced ? WUNTRACED : 0;
+
+    // pidfds only report exits, so stops and kernels without pidfds are
+    // noticed by polling at a short interval
+    bool use_pidfds = !wait->untraced;
+    for (int i = 0; i < num_pids; i++) {
+        pidfds[i] = watch && use_pidfds ? open_pidfd(pids[i]) : -1;
+        if (pidfds[i] < 0) use_pidfds = false;
+    }
+
+    int remaining = 0;
+    for (int i = 0; i < num_pids; i++) {
+        if (pids[i] != 0) remaining++;
+    }
+
+    bool killed = false;
+    while (remaining > 0 && watch && !wait->stopped) {
+        if (tfd < 0 && wait->untraced) {
+            // nothing to time, so any change of the group can be waited on
+            int status;
+            pid_t pid = waitpid(-wait->pgid, &status, WUNTRACED);
+            if (pid < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            for (int i = 0; i < num_pids; i++) {
+                if (pids[i] == pid) {
+                    note_stage(wait, pids, statuses, i, status, &remaining);
+                }
+            }
+            continue;
+        }
+
+        int nfds = 0;
+        fds[nfds].fd = tfd;
+        fds[nfds++].events = POLLIN;
+        for (int i = 0; use_pidfds && i < num_pids; i++) {
+            if (pids[i] == 0) continue;
+            fds[nfds].fd = pidfds[i];
+            fds[nfds++].events = POLLIN;
+        }
+
+        if (poll(fds, nfds, use_pidfds ? -1 : TIMEOUT_POLL_MS) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        int status;
+        for (int i = 0; i < num_pids; i++) {
+            if (pids[i] != 0 && waitpid(pids[i], &status, WNOHANG | flags) == pids[i]) {
+                note_stage(wait, pids, statuses, i, status, &remaining);
+            }
+        }
+
+        uint64_t expirations;
+        if (tfd < 0 || !(fds[0].revents & POLLIN) ||
+            read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            continue;
+        }
+        if (!wait->timed_out) {
+            // ask nicely first, and wake anything stopped so it can hear it
+            wait->timed_out = true;
+            kill(-wait->pgid, SIGTERM);
+            kill(-wait->pgid, SIGCONT);
+            arm_timer(tfd, wait->kill_after_ms ? wait->kill_after_ms : 1);
+        } else if (!killed) {
+            killed = true;
+            kill(-wait->pgid, SIGKILL);
+        }
+    }
+
+    // whatever is left is waited for plainly, unless it is a stopped job
+    for (int i = 0; i < num_pids && !wait->stopped; i++) {
+        if (pids[i] == 0) continue;
+        waitpid(pids[i], &statuses[i], 0);
+        stats_child_reaped(pids[i]);
+        pids[i] = 0;
+        if (statuses[i] != 0 && wait->first_failed < 0) {
+            wait->first_failed = i;
+        }
+    }
+
+    for (int i = 0; i < num_pids; i++) {
+        if (pidfds[i] >= 0) close(pidfds[i]);
+    }
+    if (tfd >= 0) close(tfd);
+    free(pidfds);
+    free(fds);
+    return statuses[num_pids - 1];
+}